@@ -0,0 +1,194 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "AsyncFile.h"
+
+// number of threads shared by all AsyncFiles
+#define ASYNC_FILE_WRITER_THREADS 4
+
+using namespace std;
+
+// Files with queued requests wait here for a writer thread. A file is on
+// this queue at most once, which keeps its requests in order.
+static pthread_once_t writerPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t writerPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writerPoolCond = PTHREAD_COND_INITIALIZER;
+static deque<AsyncFile*> writerPoolQueue;
+
+static void* writerThread(void* arg) {
+  while (true) {
+    pthread_mutex_lock(&writerPoolMutex);
+    while (writerPoolQueue.empty()) {
+      pthread_cond_wait(&writerPoolCond, &writerPoolMutex);
+    }
+    AsyncFile* file = writerPoolQueue.front();
+    writerPoolQueue.pop_front();
+    pthread_mutex_unlock(&writerPoolMutex);
+
+    file->runRequests();
+  }
+  return NULL;
+}
+
+static void startWriterPool() {
+  for (int i = 0; i < ASYNC_FILE_WRITER_THREADS; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writerThread, NULL) != 0) {
+      LOG_OPER("ERROR: failed to start async file writer thread");
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+static void scheduleFile(AsyncFile* file) {
+  pthread_once(&writerPoolOnce, startWriterPool);
+
+  pthread_mutex_lock(&writerPoolMutex);
+  writerPoolQueue.push_back(file);
+  pthread_cond_signal(&writerPoolCond);
+  pthread_mutex_unlock(&writerPoolMutex);
+}
+
+AsyncFile::AsyncFile(const std::string& name, bool frame)
+  : StdFile(name, frame), outstanding(0), scheduled(false), failed(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&completed, NULL);
+}
+
+AsyncFile::~AsyncFile() {
+  close();
+  pthread_cond_destroy(&completed);
+  pthread_mutex_destroy(&mutex);
+}
+
+void AsyncFile::close() {
+  // don't close the fd out from under a writer thread
+  waitForWrites();
+  StdFile::close();
+
+  pthread_mutex_lock(&mutex);
+  failed = false;
+  pthread_mutex_unlock(&mutex);
+}
+
+bool AsyncFile::write(const std::string& data) {
+  if (fd < 0) {
+    return false;
+  }
+
+  // callers of write() don't keep data around, so take a copy
+  Request* request = new Request;
+  request->data = data;
+
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(request->data.data());
+  iov.iov_len = request->data.length();
+  request->iov.push_back(iov);
+
+  return submit(request);
+}
+
+bool AsyncFile::writev(const struct iovec* iov, int iovcnt) {
+  if (fd < 0) {
+    return false;
+  }
+
+  Request* request = new Request;
+  request->iov.assign(iov, iov + iovcnt);
+
+  return submit(request);
+}
+
+bool AsyncFile::waitForWrites() {
+  pthread_mutex_lock(&mutex);
+  while (outstanding > 0 || scheduled) {
+    pthread_cond_wait(&completed, &mutex);
+  }
+  bool success = !failed;
+  pthread_mutex_unlock(&mutex);
+  return success;
+}
+
+// Queued writes go to the fd in the background anyway, and durability is
+// up to sync(), so there is nothing to do. Queueing an fdatasync here
+// would put one behind every batch, since callers flush after each one.
+void AsyncFile::flush() {
+}
+
+// Waits for the queued writes, then syncs on this thread so that the
+// fdatasync can be shared with other files' syncs.
+bool AsyncFile::sync() {
+  return waitForWrites() && StdFile::sync();
+}
+
+// Returns false without queueing anything if an earlier request failed,
+// so that callers find out about the error as soon as possible.
+bool AsyncFile::submit(Request* request) {
+  pthread_mutex_lock(&mutex);
+  if (failed) {
+    pthread_mutex_unlock(&mutex);
+    delete request;
+    return false;
+  }
+
+  requests.push_back(request);
+  ++outstanding;
+
+  bool schedule = !scheduled;
+  scheduled = true;
+  pthread_mutex_unlock(&mutex);
+
+  if (schedule) {
+    scheduleFile(this);
+  }
+  return true;
+}
+
+void AsyncFile::runRequests() {
+  pthread_mutex_lock(&mutex);
+  while (!requests.empty()) {
+    Request* request = requests.front();
+    requests.pop_front();
+
+    // once something has failed the rest of the file is suspect,
+    // so just drain the queue
+    bool skip = failed;
+    pthread_mutex_unlock(&mutex);
+
+    bool success = true;
+    if (!skip) {
+      if (!request->iov.empty()) {
+        success = writeAll(&request->iov[0], request->iov.size());
+      }
+    }
+    delete request;
+
+    pthread_mutex_lock(&mutex);
+    if (!success) {
+      failed = true;
+    }
+    --outstanding;
+  }
+
+  // the file may be destroyed as soon as waitForWrites() sees this,
+  // so don't touch any members after unlocking
+  scheduled = false;
+  pthread_cond_broadcast(&completed);
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,69 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_ASYNC_FILE_H
+#define SCRIBE_ASYNC_FILE_H
+
+#include "file.h"
+
+/*
+ * Local file whose writes and flushes are done in the background.
+ *
+ * write()/writev() queue the data and return immediately; a shared pool of
+ * writer threads performs the writes for each file in the order they were
+ * submitted. flush() doesn't sync, sync() waits for the writes and then
+ * syncs through the group committer like StdFile. Errors are reported by
+ * the next write or by waitForWrites(). Reading and everything else
+ * behaves exactly like StdFile.
+ */
+class AsyncFile : public StdFile {
+ public:
+  AsyncFile(const std::string& name, bool framed);
+  virtual ~AsyncFile();
+
+  void close();
+  bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool waitForWrites();
+  void flush();
+  bool sync();
+
+  // called by the writer threads
+  void runRequests();
+
+ private:
+  struct Request {
+    std::vector<struct iovec> iov;
+    std::string data;              // owns the buffer for write()
+  };
+
+  bool submit(Request* request);
+
+  pthread_mutex_t mutex;
+  pthread_cond_t completed;
+  std::deque<Request*> requests; // not yet started, in submission order
+  unsigned long outstanding;     // queued or in progress
+  bool scheduled;                // queued on or running in the writer pool
+  bool failed;                   // a background request failed
+
+  // disallow copy, assignment, and empty construction
+  AsyncFile();
+  AsyncFile(AsyncFile& rhs);
+  AsyncFile& operator=(AsyncFile& rhs);
+};
+
+#endif // !defined SCRIBE_ASYNC_FILE_H
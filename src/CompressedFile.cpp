@@ -0,0 +1,451 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <zlib.h>
+#include "common.h"
+#include "CompressedFile.h"
+
+// uncompressed bytes gathered before a block is written
+#define COMPRESSED_FILE_BLOCK_SIZE (256 * 1024)
+
+// blocks larger than this are treated as corrupt when reading, so bigger
+// writes are split into several blocks
+#define COMPRESSED_FILE_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+#define COMPRESSED_FILE_HEADER_SIZE 8
+#define COMPRESSED_BLOCK_HEADER_SIZE 8
+#define COMPRESSED_FILE_VERSION 1
+#define UINT_SIZE 4
+
+using namespace std;
+
+static const char compressedFileMagic[5] = "\x89SCZ";
+
+// Reads exactly len bytes at offset. Returns false on a short read,
+// setting eof if there was nothing at all to read.
+static bool preadAll(int fd, char* buf, size_t len, off_t offset, bool& eof) {
+  size_t done = 0;
+  eof = false;
+  while (done < len) {
+    ssize_t r = ::pread(fd, buf + done, len - done, offset + done);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (r == 0) {
+      eof = (done == 0);
+      return false;
+    }
+    done += r;
+  }
+  return true;
+}
+
+CompressedFile::CompressedFile(const std::string& name, bool frame,
+                               codec_t codec_type, int compression_level)
+  : StdFile(name, frame),
+    codec(codec_type),
+    level(compression_level),
+    writeCodec(CODEC_NONE),
+    headerPending(false),
+    diskSize(0),
+    readCompressed(false),
+    readPos(0),
+    blockOffset(0) {
+}
+
+CompressedFile::~CompressedFile() {
+  // StdFile's destructor can't call our close()
+  close();
+}
+
+bool CompressedFile::openRead() {
+  if (isOpen()) {
+    return false;
+  }
+
+  fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  char header[COMPRESSED_FILE_HEADER_SIZE];
+  bool eof;
+  if (preadAll(fd, header, COMPRESSED_FILE_HEADER_SIZE, 0, eof) &&
+      0 == memcmp(header, compressedFileMagic, 4)) {
+    if (header[4] != COMPRESSED_FILE_VERSION || header[5] != CODEC_ZLIB) {
+      LOG_OPER("Unsupported compressed file <%s> version <%d> codec <%d>",
+               filename.c_str(), (int)header[4], (int)header[5]);
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+    readCompressed = true;
+    readPos = COMPRESSED_FILE_HEADER_SIZE;
+    block.clear();
+    blockOffset = 0;
+    return true;
+  }
+
+  // not compressed, read it like any other file
+  ::close(fd);
+  fd = -1;
+  return StdFile::openRead();
+}
+
+bool CompressedFile::openWrite() {
+  return StdFile::openWrite() && startWrite();
+}
+
+bool CompressedFile::openTruncate() {
+  return StdFile::openTruncate() && startWrite();
+}
+
+// Picks the format for the file just opened for write: new files get a
+// header if we're compressing, existing files keep the format they have.
+bool CompressedFile::startWrite() {
+  pending.clear();
+  writeCodec = CODEC_NONE;
+  headerPending = false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    LOG_OPER("Failed to stat file <%s>: %s", filename.c_str(), strerror(errno));
+    StdFile::close();
+    return false;
+  }
+  diskSize = st.st_size;
+
+  if (diskSize == 0) {
+    // the header goes out with the first block, so files with nothing
+    // written to them stay empty
+    writeCodec = codec;
+    headerPending = (codec != CODEC_NONE);
+    return true;
+  }
+
+  // our fd is write only, so look at the existing header separately
+  int read_fd = ::open(filename.c_str(), O_RDONLY);
+  if (read_fd >= 0) {
+    char header[COMPRESSED_FILE_HEADER_SIZE];
+    bool eof;
+    if (preadAll(read_fd, header, COMPRESSED_FILE_HEADER_SIZE, 0, eof) &&
+        0 == memcmp(header, compressedFileMagic, 4)) {
+      writeCodec = (codec_t)header[5];
+    }
+    ::close(read_fd);
+  }
+
+  if (writeCodec != CODEC_NONE && writeCodec != CODEC_ZLIB) {
+    LOG_OPER("Can't append to compressed file <%s> with unknown codec <%d>",
+             filename.c_str(), (int)writeCodec);
+    StdFile::close();
+    writeCodec = CODEC_NONE;
+    return false;
+  }
+
+  if (writeCodec == CODEC_NONE && codec != CODEC_NONE) {
+    LOG_OPER("Appending uncompressed data to existing file <%s>",
+             filename.c_str());
+  }
+  return true;
+}
+
+void CompressedFile::close() {
+  if (fd >= 0 && writeCodec != CODEC_NONE && !pending.empty()) {
+    writeBlock();
+  }
+  pending.clear();
+  writeCodec = CODEC_NONE;
+  headerPending = false;
+  diskSize = 0;
+
+  readCompressed = false;
+  readPos = 0;
+  string().swap(block);
+  blockOffset = 0;
+
+  StdFile::close();
+}
+
+bool CompressedFile::write(const std::string& data) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data.data());
+  iov.iov_len = data.length();
+  return writev(&iov, 1);
+}
+
+bool CompressedFile::writev(const struct iovec* iov, int iovcnt) {
+  if (fd < 0) {
+    return false;
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+
+  if (writeCodec == CODEC_NONE) {
+    if (!writeAll(iov, iovcnt)) {
+      return false;
+    }
+    diskSize += total;
+    return true;
+  }
+
+  // don't let what's already pending push a block over the limit
+  if (pending.length() + total > COMPRESSED_FILE_MAX_BLOCK_SIZE &&
+      !writeBlock()) {
+    return false;
+  }
+
+  if (pending.capacity() < pending.length() + total) {
+    pending.reserve(max(pending.length() + total,
+                        (size_t)COMPRESSED_FILE_BLOCK_SIZE));
+  }
+  for (int i = 0; i < iovcnt; ++i) {
+    pending.append((const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+
+  if (pending.length() >= COMPRESSED_FILE_BLOCK_SIZE) {
+    if (!writeBlock()) {
+      // a record that can't fit in any block is never written, so that
+      // the ones after it can still be read
+      if (pending.length() > COMPRESSED_FILE_MAX_BLOCK_SIZE) {
+        pending.clear();
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+// Length of the part of pending that goes in the next block: all of it if
+// it fits, otherwise as many whole records as fit. Returns 0 if the first
+// record is too big for a block.
+size_t CompressedFile::nextBlockLength() {
+  if (pending.length() <= COMPRESSED_FILE_MAX_BLOCK_SIZE) {
+    return pending.length();
+  }
+
+  if (!framed) {
+    string::size_type newline =
+      pending.rfind('\n', COMPRESSED_FILE_MAX_BLOCK_SIZE - 1);
+    return newline == string::npos ? 0 : newline + 1;
+  }
+
+  size_t length = 0;
+  while (length + UINT_SIZE <= pending.length()) {
+    size_t next = length + UINT_SIZE + unserializeUInt(&pending[length]);
+    if (next > COMPRESSED_FILE_MAX_BLOCK_SIZE || next == length + UINT_SIZE) {
+      break;
+    }
+    length = next;
+  }
+  return length;
+}
+
+bool CompressedFile::writeBlock() {
+  while (!pending.empty()) {
+    size_t length = nextBlockLength();
+    if (!length) {
+      LOG_OPER("Record too large for a compressed block in file <%s>",
+               filename.c_str());
+      return false;
+    }
+    if (!writeBlock(length)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Compresses the first length bytes of pending into a block
+bool CompressedFile::writeBlock(size_t length) {
+  uLongf compressed_length = compressBound(length);
+  size_t start = headerPending ? COMPRESSED_FILE_HEADER_SIZE : 0;
+  string compressed(start + COMPRESSED_BLOCK_HEADER_SIZE + compressed_length,
+                    '\0');
+
+  if (headerPending) {
+    memcpy(&compressed[0], compressedFileMagic, 4);
+    compressed[4] = COMPRESSED_FILE_VERSION;
+    compressed[5] = writeCodec;
+  }
+
+  if (compress2((Bytef*)&compressed[start + COMPRESSED_BLOCK_HEADER_SIZE],
+                &compressed_length, (const Bytef*)pending.data(),
+                length, level) != Z_OK) {
+    LOG_OPER("Failed to compress block for file <%s>", filename.c_str());
+    return false;
+  }
+
+  serializeUInt(length, &compressed[start]);
+  serializeUInt(compressed_length, &compressed[start + UINT_SIZE]);
+
+  struct iovec iov;
+  iov.iov_base = &compressed[0];
+  iov.iov_len = start + COMPRESSED_BLOCK_HEADER_SIZE + compressed_length;
+  if (!writeAll(&iov, 1)) {
+    return false;
+  }
+
+  diskSize += iov.iov_len;
+  headerPending = false;
+  pending.erase(0, length);
+  return true;
+}
+
+// Callers count their messages as written once this returns, so the
+// partial block has to go to disk now.
+bool CompressedFile::waitForWrites() {
+  if (fd < 0 || writeCodec == CODEC_NONE) {
+    return true;
+  }
+  return writeBlock();
+}
+
+void CompressedFile::flush() {
+  waitForWrites();
+  StdFile::flush();
+}
+
+bool CompressedFile::sync() {
+  return waitForWrites() && StdFile::sync();
+}
+
+// Data still pending isn't counted until it's compressed, since how much
+// space it will take isn't known yet
+unsigned long CompressedFile::fileSize() {
+  if (fd >= 0 && !readCompressed) {
+    return diskSize;
+  }
+  return StdFile::fileSize();
+}
+
+bool CompressedFile::readBlock() {
+  char header[COMPRESSED_BLOCK_HEADER_SIZE];
+  bool eof;
+  if (!preadAll(fd, header, COMPRESSED_BLOCK_HEADER_SIZE, readPos, eof)) {
+    if (!eof) {
+      LOG_OPER("ERROR: Failed to read file %s at offset %lu",
+               filename.c_str(), readPos);
+    }
+    return false;
+  }
+
+  unsigned uncompressed_length = unserializeUInt(header);
+  unsigned compressed_length = unserializeUInt(header + UINT_SIZE);
+  if (uncompressed_length > COMPRESSED_FILE_MAX_BLOCK_SIZE ||
+      compressed_length > compressBound(uncompressed_length)) {
+    LOG_OPER("ERROR: Bad compressed block in file %s at offset %lu",
+             filename.c_str(), readPos);
+    return false;
+  }
+
+  string compressed(compressed_length, '\0');
+  if (compressed_length &&
+      !preadAll(fd, &compressed[0], compressed_length,
+                readPos + COMPRESSED_BLOCK_HEADER_SIZE, eof)) {
+    LOG_OPER("ERROR: Failed to read file %s at offset %lu",
+             filename.c_str(), readPos);
+    return false;
+  }
+
+  block.resize(uncompressed_length);
+  uLongf dest_length = uncompressed_length;
+  if (uncompressed_length &&
+      (uncompress((Bytef*)&block[0], &dest_length,
+                  (const Bytef*)compressed.data(), compressed_length) != Z_OK ||
+       dest_length != uncompressed_length)) {
+    LOG_OPER("ERROR: Failed to decompress block in file %s at offset %lu",
+             filename.c_str(), readPos);
+    block.clear();
+    return false;
+  }
+
+  readPos += COMPRESSED_BLOCK_HEADER_SIZE + compressed_length;
+  blockOffset = 0;
+  return true;
+}
+
+bool CompressedFile::readNext(std::string& _return) {
+  if (!readCompressed) {
+    return StdFile::readNext(_return);
+  }
+
+  while (blockOffset >= block.length()) {
+    if (!readBlock()) {
+      return false;
+    }
+  }
+
+  size_t remaining = block.length() - blockOffset;
+  if (framed) {
+    if (remaining < UINT_SIZE) {
+      return false;
+    }
+
+    unsigned size = unserializeUInt(&block[blockOffset]);
+    if (!size) {
+      return false;
+    }
+    if (size > remaining - UINT_SIZE) {
+      LOG_OPER("ERROR: Failed to read file %s in block before offset %lu",
+               filename.c_str(), readPos);
+      return false;
+    }
+
+    _return.assign(block, blockOffset + UINT_SIZE, size);
+    blockOffset += UINT_SIZE + size;
+  } else {
+    string::size_type newline = block.find('\n', blockOffset);
+    if (newline == string::npos) {
+      newline = block.length();
+    }
+    _return.assign(block, blockOffset, newline - blockOffset);
+    blockOffset = newline + 1;
+  }
+  return true;
+}
+
+bool CompressedFile::seekRead(unsigned long offset) {
+  if (!readCompressed) {
+    return StdFile::seekRead(offset);
+  }
+
+  // offsets from readOffset() are always at the start of a block
+  readPos = offset ? offset : COMPRESSED_FILE_HEADER_SIZE;
+  block.clear();
+  blockOffset = 0;
+  return true;
+}
+
+// Resuming is only possible between blocks
+bool CompressedFile::readOffset(unsigned long& offset) {
+  if (!readCompressed) {
+    return StdFile::readOffset(offset);
+  }
+
+  if (blockOffset < block.length()) {
+    return false;
+  }
+  offset = readPos;
+  return true;
+}
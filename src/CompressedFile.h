@@ -0,0 +1,97 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_COMPRESSED_FILE_H
+#define SCRIBE_COMPRESSED_FILE_H
+
+#include "file.h"
+
+/*
+ * Local file that can be stored as a sequence of compressed blocks.
+ *
+ * A compressed file starts with an 8 byte header (magic, version, codec),
+ * followed by blocks of:
+ *   uncompressed length (4 bytes), compressed length (4 bytes), data
+ * Writes are gathered into a block until it reaches
+ * COMPRESSED_FILE_BLOCK_SIZE or waitForWrites()/flush()/close() is called.
+ * A block always ends on a record boundary, so records never span blocks.
+ * Writes too big for one block are split between records, and a single
+ * record bigger than COMPRESSED_FILE_MAX_BLOCK_SIZE fails to write.
+ *
+ * Reads detect the header, so files written with or without compression
+ * read back the same way. Appending to an existing file keeps whatever
+ * format the file already has, and with CODEC_NONE this behaves exactly
+ * like a StdFile.
+ *
+ * fileSize() is the size on disk, so callers limiting file sizes count
+ * compressed bytes. Writes that are still gathered in memory aren't
+ * counted until their block is written.
+ */
+class CompressedFile : public StdFile {
+ public:
+  enum codec_t {
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1
+  };
+
+  CompressedFile(const std::string& name, bool framed,
+                 codec_t codec_type, int compression_level);
+  virtual ~CompressedFile();
+
+  bool openRead();
+  bool openWrite();
+  bool openTruncate();
+  void close();
+  bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool waitForWrites();
+  void flush();
+  bool sync();
+  unsigned long fileSize();
+  bool readNext(std::string& _return);
+  bool seekRead(unsigned long offset);
+  bool readOffset(unsigned long& offset);
+
+ private:
+  bool startWrite();
+  size_t nextBlockLength();
+  bool writeBlock();
+  bool writeBlock(size_t length);
+  bool readBlock();
+
+  codec_t codec;        // used for new files
+  int level;
+
+  // write state
+  codec_t writeCodec;   // what the open file is written with
+  bool headerPending;   // new file, header not written yet
+  std::string pending;  // uncompressed data for the next block
+  unsigned long diskSize;
+
+  // read state, only used for compressed files
+  bool readCompressed;
+  unsigned long readPos; // file offset of the next block
+  std::string block;     // the current block, uncompressed
+  std::string::size_type blockOffset;
+
+  // disallow copy, assignment, and empty construction
+  CompressedFile();
+  CompressedFile(CompressedFile& rhs);
+  CompressedFile& operator=(CompressedFile& rhs);
+};
+
+#endif // !defined SCRIBE_COMPRESSED_FILE_H
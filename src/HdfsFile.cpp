@@ -27,10 +27,126 @@ static const lzo_uint32 lzo_flags = F_ADLER32_D | F_ADLER32_C;
 
 /* LZO1X */
 static const int lzo_method = 1;
+
+/* worst case LZO1X output for a full block */
+static const lzo_uint lzo_max_compressed_size =
+  lzo_block_size + lzo_block_size / 16 + 64 + 3;
+
+// number of compressor threads shared by all HdfsFiles
+#define HDFS_LZO_COMPRESSOR_THREADS 4
+
+// a writer blocks once it has this many blocks waiting to be written
+#define HDFS_LZO_MAX_PENDING_BLOCKS (2 * HDFS_LZO_COMPRESSOR_THREADS)
 #endif
 
 using namespace std;
 
+#ifdef LZO_STREAMING
+// Blocks from every file wait here for a compressor thread
+static pthread_once_t compressorPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t compressorPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compressorPoolCond = PTHREAD_COND_INITIALIZER;
+static deque<HdfsLZOBlock*> compressorPoolQueue;
+
+static void appendInt32(string& str, lzo_uint32 v) {
+  unsigned char b[4];
+
+  b[3] = (unsigned char) ((v >>  0) & 0xff);
+  b[2] = (unsigned char) ((v >>  8) & 0xff);
+  b[1] = (unsigned char) ((v >> 16) & 0xff);
+  b[0] = (unsigned char) ((v >> 24) & 0xff);
+
+  str.append((const char*)b, 4);
+}
+
+/*
+ * Compresses block->data into an LZOP block in block->output:
+ * uncompressed size, compressed size, uncompressed checksum, then the
+ * compressed checksum and data. Blocks that don't get smaller, or that fail
+ * to compress, are stored as is without the compressed checksum.
+ */
+static void compressBlock(HdfsLZOBlock* block, lzo_bytep out, lzo_bytep wrkmem) {
+  const unsigned char* in = (const unsigned char*)block->data.data();
+  lzo_uint in_len = block->data.length();
+  lzo_uint out_len = 0;
+  int r;
+
+  if (block->compressionLevel == 9) {
+    r = lzo1x_999_compress(in, in_len, out, &out_len, wrkmem);
+  } else {
+    r = lzo1x_1_compress(in, in_len, out, &out_len, wrkmem);
+  }
+
+  /* this should never occur */
+  if (r != LZO_E_OK || out_len > in_len + in_len / 16 + 64 + 3) {
+    LOG_OPER("[hdfs] LZO internal error - compression failed: %d", r);
+    out_len = in_len;
+  }
+
+  block->output.reserve(16 + (out_len < in_len ? out_len : in_len));
+  appendInt32(block->output, in_len);
+  if (out_len < in_len) {
+    appendInt32(block->output, out_len);
+    appendInt32(block->output, lzo_adler32(1, in, in_len));
+    appendInt32(block->output, lzo_adler32(1, out, out_len));
+    block->output.append((const char*)out, out_len);
+  } else {
+    appendInt32(block->output, in_len);
+    appendInt32(block->output, lzo_adler32(1, in, in_len));
+    block->output.append(block->data);
+  }
+
+  // the input isn't needed anymore
+  string().swap(block->data);
+}
+
+static void* compressorThread(void* arg) {
+  // LZO1X_999 needs more work memory than LZO1X_1, so this covers both
+  lzo_bytep out = (lzo_bytep) malloc(lzo_max_compressed_size);
+  lzo_bytep wrkmem = (lzo_bytep) calloc(1, LZO1X_999_MEM_COMPRESS);
+  if (out == NULL || wrkmem == NULL) {
+    LOG_OPER("[hdfs] ERROR: failed to allocate LZO compression buffers");
+    free(out);
+    free(wrkmem);
+    return NULL;
+  }
+
+  while (true) {
+    pthread_mutex_lock(&compressorPoolMutex);
+    while (compressorPoolQueue.empty()) {
+      pthread_cond_wait(&compressorPoolCond, &compressorPoolMutex);
+    }
+    HdfsLZOBlock* block = compressorPoolQueue.front();
+    compressorPoolQueue.pop_front();
+    pthread_mutex_unlock(&compressorPoolMutex);
+
+    compressBlock(block, out, wrkmem);
+    block->file->LZOBlockCompressed(block);
+  }
+  return NULL;
+}
+
+static void startCompressorPool() {
+  for (int i = 0; i < HDFS_LZO_COMPRESSOR_THREADS; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compressorThread, NULL) != 0) {
+      LOG_OPER("ERROR: failed to start LZO compressor thread");
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+static void scheduleBlock(HdfsLZOBlock* block) {
+  pthread_once(&compressorPoolOnce, startCompressorPool);
+
+  pthread_mutex_lock(&compressorPoolMutex);
+  compressorPoolQueue.push_back(block);
+  pthread_cond_signal(&compressorPoolCond);
+  pthread_mutex_unlock(&compressorPoolMutex);
+}
+#endif
+
 HdfsFile::HdfsFile(const std::string& name) : FileInterface(name, false), inputBuffer_(NULL), bufferSize_(0) {
   LOG_OPER("[hdfs] Connecting to HDFS");
 
@@ -44,9 +160,21 @@ HdfsFile::HdfsFile(const std::string& name) : FileInterface(name, false), inputB
     LOG_OPER("[hdfs] ERROR: HDFS is not configured for file: %s", name.c_str());
   }
   hfile = 0;
+
+#ifdef LZO_STREAMING
+  pthread_mutex_init(&LZOmutex, NULL);
+  pthread_cond_init(&LZOblockDone, NULL);
+#endif
 }
 
 HdfsFile::~HdfsFile() {
+#ifdef LZO_STREAMING
+  // the compressor threads may still be working on our blocks
+  LZODiscardBlocks();
+  pthread_cond_destroy(&LZOblockDone);
+  pthread_mutex_destroy(&LZOmutex);
+#endif
+
   if (fileSys) {
     hdfsDisconnect(fileSys);
   }
@@ -177,7 +305,8 @@ bool HdfsFile::openWrite() {
         if(bytesWritten != (tSize)lzo_header.length()) {
           LOG_OPER("[hdfs] Failed writing LZO header");
         }
-        LZObacklogBuffer = std::string("");
+        LZObacklogBuffer.clear();
+        LZObacklogBuffer.reserve(lzo_block_size);
       }
     }
     return true;
@@ -200,13 +329,11 @@ void HdfsFile::close() {
   if (fileSys) {
     if (hfile) {
       if(LZOCompressionLevel != 0) {
-        /* flush LZO buffer */
-        bool good = false;
-        const std::string& clearBuf = LZOCompress("", true, &good);
-
-        if(good == true) {
-          hdfsWrite(fileSys, hfile, clearBuf.data(), clearBuf.length());
+        /* flush the partial block and everything still compressing */
+        if (!LZObacklogBuffer.empty()) {
+          LZOSubmitBlock();
         }
+        LZOWriteBlocks(true);
 
         /* write EOF */
         unsigned int eof = 0;
@@ -236,127 +363,71 @@ void HdfsFile::setShouldLZOCompress(int compressionLevel) {
   }
 }
 
-const std::string HdfsFile::LZOCompress(const std::string& inputData, bool force, bool *success) {
-  *success = true;
-
-  // If we have a previous buffer, prepend it to our input
-  string data = string(inputData.data());
-  if(LZObacklogBuffer.length() > 0) {
-    data = LZObacklogBuffer + string(inputData.data());
-
-    /* and reset the pending data to an empty string */
-    LZObacklogBuffer = string("");
-  }
-
-  /*
-     If the data we've received is smaller than
-     lzo_block_size (256k by default), queue it and return the input
-
-     if 'force == true', then don't queue it, and compress it
-  */
-  if(data.length() < lzo_block_size && force == false) {
-    LZObacklogBuffer = data;
-    return inputData;
-  }
+void HdfsFile::LZOSubmitBlock() {
+  HdfsLZOBlock* block = new HdfsLZOBlock;
+  block->file = this;
+  block->compressionLevel = LZOCompressionLevel;
+  block->done = false;
+  block->data.swap(LZObacklogBuffer);
+  LZObacklogBuffer.reserve(lzo_block_size);
 
-  /* work buffers */
-  lzo_bytep out = NULL;
-  lzo_bytep wrkmem = NULL;
-  lzo_uint out_len = 0;
-  lzo_uint32 wrk_len = 0;
-  string compressedData("");
+  LZOblocks.push_back(block);
+  scheduleBlock(block);
+}
 
-  if (LZOCompressionLevel == 9)
-    wrk_len = LZO1X_999_MEM_COMPRESS;
-  else
-    wrk_len = LZO1X_1_MEM_COMPRESS;
+void HdfsFile::LZOBlockCompressed(HdfsLZOBlock* block) {
+  pthread_mutex_lock(&LZOmutex);
+  block->done = true;
+  pthread_cond_broadcast(&LZOblockDone);
+  pthread_mutex_unlock(&LZOmutex);
+}
 
-  int blocks = (int)(data.length() / lzo_block_size);
-  int total_data_length = blocks * lzo_block_size;
+// Writes out compressed blocks from the front of LZOblocks. Waits for the
+// rest to be compressed if wait is true, or for enough of them to get back
+// under HDFS_LZO_MAX_PENDING_BLOCKS otherwise.
+bool HdfsFile::LZOWriteBlocks(bool wait) {
+  bool success = true;
+
+  pthread_mutex_lock(&LZOmutex);
+  while (!LZOblocks.empty()) {
+    HdfsLZOBlock* block = LZOblocks.front();
+    if (!block->done) {
+      if (!wait && LZOblocks.size() <= HDFS_LZO_MAX_PENDING_BLOCKS) {
+        break;
+      }
+      pthread_cond_wait(&LZOblockDone, &LZOmutex);
+      continue;
+    }
+    LZOblocks.pop_front();
+    pthread_mutex_unlock(&LZOmutex);
+
+    tSize bytesWritten = hdfsWrite(fileSys, hfile, block->output.data(),
+                                   (tSize) block->output.length());
+    if (bytesWritten != (tSize) block->output.length()) {
+      LOG_OPER("[hdfs] Failed writing LZO block to %s", filename.c_str());
+      success = false;
+    }
+    delete block;
 
-  if(blocks == 0)
-    total_data_length = data.length();
-  
-  /*
-   *  allocate compression buffers and work-memory
-   */ 
-  out = (lzo_bytep) calloc(1, lzo_block_size + lzo_block_size / 16 + 64 + 3);
-  wrkmem = (lzo_bytep) calloc(1, wrk_len);
-  if (out == NULL || wrkmem == NULL) {
-    LOG_OPER("[hdfs] calloc failed");
-    *success = false;
-    return data;
+    pthread_mutex_lock(&LZOmutex);
   }
+  pthread_mutex_unlock(&LZOmutex);
 
-  /* 
-   *  Compress each block and write it
-   */ 
-  int r = 0;
-  for (int i = 0; i < blocks || blocks == 0; i++) {
-      int offset = i * lzo_block_size;
-      int data_len = blocks == 0 ? total_data_length : lzo_block_size;
-
-      /* Let last block be a little bigger before we flush */
-      if(i == blocks) {
-        data_len += data.length() - total_data_length;
-      }
-      const string block_data = data.substr(offset, data_len);
-
-      /* compress block */
-      if (LZOCompressionLevel == 9)
-        r = lzo1x_999_compress((const unsigned char *)block_data.data(), 
-                               block_data.length(),
-                               out, &out_len, wrkmem);
-      else
-        r = lzo1x_1_compress((const unsigned char *)block_data.data(), 
-                             block_data.length(), 
-                             out, &out_len, wrkmem);
-
-      /* this should never occur */
-      if (r != LZO_E_OK || 
-          out_len > block_data.length() + block_data.length() / 16 + 64 + 3) {
-        LOG_OPER("[hdfs] LZO internal error - compression failed: %d", r);
-        *success = false;
-        return data;
-      }
+  return success;
+}
 
-      /* write uncompressed block size */
-      LZOStringAppendInt32(compressedData, block_data.length()); 
-
-      /* write all the checksums and block sizes only if compression 
-         was useful (resulted in a smaller data set) */
-      if(out_len < block_data.length()) {
-        /* write compressed block size */
-        lzo_uint32 out_len32 = out_len;
-
-        LZOStringAppendInt32(compressedData, out_len32);
-
-        /* write uncompressed block checksum */
-        lzo_uint32 d_checksum = lzo_adler32(1,  // ADLER32_INIT_VALUE
-                                           (unsigned char *)block_data.data(), 
-                                           block_data.length());
-        LZOStringAppendInt32(compressedData, d_checksum);
-
-        /* write compressed block checksum */
-        lzo_uint32 c_checksum = lzo_adler32(1, out, out_len32);
-        LZOStringAppendInt32(compressedData, c_checksum);
-
-        /* write compressed block data */
-        compressedData.append((const char *)out, out_len);
-      } 
-      /* Otherwise, just write the raw block */
-      else {
-        LZOStringAppendInt32(compressedData, block_data.length());
-        compressedData.append(block_data);
-      }
-      if(blocks == 0)
-        break;
+void HdfsFile::LZODiscardBlocks() {
+  pthread_mutex_lock(&LZOmutex);
+  while (!LZOblocks.empty()) {
+    HdfsLZOBlock* block = LZOblocks.front();
+    if (!block->done) {
+      pthread_cond_wait(&LZOblockDone, &LZOmutex);
+      continue;
+    }
+    LZOblocks.pop_front();
+    delete block;
   }
-
-  free(out);        out = NULL;
-  free(wrkmem);  wrkmem = NULL;
-  
-  return compressedData;
+  pthread_mutex_unlock(&LZOmutex);
 }
 
 bool HdfsFile::write(const std::string& data) {
@@ -369,34 +440,32 @@ bool HdfsFile::write(const std::string& data) {
   }
 
   tSize bytesWritten = 0;
-  /*
-    'success' indicates whether a buffer was compressed and returned.
-    a compressed buffer will only be returned once the lzo_block_size 
-    has been reached.  until then the data is buffered/queued for compression.
-  */
-  bool success = false;
 
   if(LZOCompressionLevel != 0) {
-    const string& compressedData = LZOCompress(data, false, &success);
-    if(compressedData != data && success == true) {
-      bytesWritten = hdfsWrite(fileSys, hfile, compressedData.data(),
-                               (tSize) compressedData.length());
-
-      return (bytesWritten == (tSize)compressedData.length());
-    } else if(success == false) {
-      bytesWritten = hdfsWrite(fileSys, hfile, data.data(),
-                               (tSize) data.length());
-      
-      return (bytesWritten == (tSize) data.length()) ? true : false;
+    /*
+      data is buffered until a full lzo_block_size block is ready and then
+      compressed in the background. compressed blocks are written by later
+      calls, or by close().
+    */
+    string::size_type offset = 0;
+    while (offset < data.length()) {
+      string::size_type len = min(data.length() - offset,
+                                  (string::size_type)lzo_block_size -
+                                  LZObacklogBuffer.length());
+      LZObacklogBuffer.append(data, offset, len);
+      offset += len;
+
+      if (LZObacklogBuffer.length() == lzo_block_size) {
+        LZOSubmitBlock();
+      }
     }
-  } else {
-    /* normal unbuffered/compressed write */
-    bytesWritten = hdfsWrite(fileSys, hfile, data.data(),
-                             (tSize) data.length());
-    return (bytesWritten == (tSize) data.length()) ? true : false;
+    return LZOWriteBlocks(false);
   }
 
-  return success;
+  /* normal uncompressed write */
+  bytesWritten = hdfsWrite(fileSys, hfile, data.data(),
+                           (tSize) data.length());
+  return (bytesWritten == (tSize) data.length()) ? true : false;
 }
 
 void HdfsFile::flush() {
@@ -17,6 +17,17 @@
 #ifdef LZO_STREAMING
 #include "lzo/lzoconf.h"
 #include "lzo/lzo1x.h"
+
+class HdfsFile;
+
+// A full block of input waiting for, or done with, compression
+struct HdfsLZOBlock {
+  HdfsFile* file;
+  int compressionLevel;
+  std::string data;   // uncompressed input
+  std::string output; // the framed LZOP block, once done
+  bool done;          // protected by the owning file's LZOmutex
+};
 #endif
 
 class HdfsFile : public FileInterface {
@@ -40,6 +51,11 @@ class HdfsFile : public FileInterface {
   bool createDirectory(std::string path);
   bool createSymlink(std::string newpath, std::string oldpath);
 
+#ifdef LZO_STREAMING
+  // called by the compressor threads
+  void LZOBlockCompressed(HdfsLZOBlock* block);
+#endif
+
  private:
   char* inputBuffer_;
   unsigned bufferSize_;
@@ -53,9 +69,21 @@ class HdfsFile : public FileInterface {
   bool LZOStringAppendChar(std::string&str, int x);
   bool LZOStringAppendInt16(std::string&str, unsigned x);
   bool LZOStringAppendInt32(std::string&str, lzo_uint x);
-  const std::string LZOCompress(const std::string& data, bool force, bool *success);
+  void LZOSubmitBlock();
+  bool LZOWriteBlocks(bool wait);
+  void LZODiscardBlocks();
   lzo_uint32 lzo_checksum;
+
+  /*
+   * Writes are appended to LZObacklogBuffer until it holds a full block,
+   * which is then handed to a shared pool of compressor threads while the
+   * next block fills. LZOblocks keeps the blocks in submission order, and
+   * compressed blocks are written from its front so the file stays in order.
+   */
   std::string LZObacklogBuffer;
+  std::deque<HdfsLZOBlock*> LZOblocks;
+  pthread_mutex_t LZOmutex;
+  pthread_cond_t LZOblockDone;  // signaled when any block is compressed
 #endif
 
   // disallow copy, assignment, and empty construction
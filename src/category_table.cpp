@@ -0,0 +1,133 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "category_table.h"
+
+using namespace std;
+using namespace apache::thrift::concurrency;
+using boost::shared_ptr;
+
+CategoryTable::CategoryTable() {
+}
+
+CategoryTable::~CategoryTable() {
+}
+
+CategoryTable::Shard& CategoryTable::getShard(const string& category) {
+  size_t hash = boost::hash<string>()(category);
+  // the low bits pick the bucket inside the shard's own table, so
+  // use some higher ones to pick the shard
+  return shards[(hash >> 8) & (CATEGORY_TABLE_SHARDS - 1)];
+}
+
+shared_ptr<store_list_t> CategoryTable::find(const string& category) {
+  Shard& shard = getShard(category);
+  RWGuard guard(shard.lock);
+
+  category_map_t::iterator iter = shard.categories.find(category);
+  if (iter == shard.categories.end()) {
+    return shared_ptr<store_list_t>();
+  }
+  return iter->second;
+}
+
+bool CategoryTable::insert(const string& category,
+                           const shared_ptr<store_list_t>& pstores) {
+  Shard& shard = getShard(category);
+  RWGuard guard(shard.lock, true);
+
+  return shard.categories.insert(make_pair(category, pstores)).second;
+}
+
+void CategoryTable::getAll(store_list_vector_t& _return) {
+  for (int i = 0; i < CATEGORY_TABLE_SHARDS; ++i) {
+    RWGuard guard(shards[i].lock);
+
+    for (category_map_t::iterator iter = shards[i].categories.begin();
+         iter != shards[i].categories.end();
+         ++iter) {
+      _return.push_back(iter->second);
+    }
+  }
+}
+
+void CategoryTable::getCategories(vector<string>& _return) {
+  for (int i = 0; i < CATEGORY_TABLE_SHARDS; ++i) {
+    RWGuard guard(shards[i].lock);
+
+    for (category_map_t::iterator iter = shards[i].categories.begin();
+         iter != shards[i].categories.end();
+         ++iter) {
+      _return.push_back(iter->first);
+    }
+  }
+}
+
+void CategoryTable::clear() {
+  for (int i = 0; i < CATEGORY_TABLE_SHARDS; ++i) {
+    RWGuard guard(shards[i].lock, true);
+    shards[i].categories.clear();
+  }
+}
+
+CategoryPrefixIndex::CategoryPrefixIndex() {
+}
+
+CategoryPrefixIndex::~CategoryPrefixIndex() {
+}
+
+bool CategoryPrefixIndex::add(const string& prefix_category,
+                              const shared_ptr<StoreQueue>& model) {
+  string prefix = prefix_category.substr(0, prefix_category.size() - 1);
+  if (!prefixes.insert(make_pair(prefix, model)).second) {
+    return false;
+  }
+
+  vector<string::size_type>::iterator iter =
+    lower_bound(lengths.begin(), lengths.end(), prefix.size());
+  if (iter == lengths.end() || *iter != prefix.size()) {
+    lengths.insert(iter, prefix.size());
+  }
+  return true;
+}
+
+shared_ptr<StoreQueue>
+CategoryPrefixIndex::findModel(const string& category) const {
+  prefix_map_t::const_iterator best = prefixes.end();
+
+  for (vector<string::size_type>::const_iterator len_iter = lengths.begin();
+       len_iter != lengths.end() && *len_iter <= category.size();
+       ++len_iter) {
+    prefix_map_t::const_iterator iter =
+      prefixes.find(category.substr(0, *len_iter));
+    if (iter == prefixes.end()) {
+      continue;
+    }
+
+    // Matches are nested, so "longer*" sorts before "short*" only when the
+    // character following the shorter prefix sorts before the '*'.
+    if (best == prefixes.end() || category[best->first.size()] < '*') {
+      best = iter;
+    }
+  }
+
+  if (best == prefixes.end()) {
+    return shared_ptr<StoreQueue>();
+  }
+  return best->second;
+}
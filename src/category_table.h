@@ -0,0 +1,108 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_CATEGORY_TABLE_H
+#define SCRIBE_CATEGORY_TABLE_H
+
+#include "store_queue.h"
+
+// must be a power of two
+#define CATEGORY_TABLE_SHARDS 16
+
+typedef std::vector<boost::shared_ptr<StoreQueue> > store_list_t;
+typedef std::vector<boost::shared_ptr<store_list_t> > store_list_vector_t;
+typedef boost::unordered_map<std::string, boost::shared_ptr<store_list_t> >
+  category_map_t;
+
+/*
+ * Hash table of category -> list of StoreQueues, split into shards that
+ * each have their own lock.
+ *
+ * Lookups only take a read lock on one shard, and inserts only hold the
+ * write lock of one shard for the insert itself, so creating a category
+ * never stalls lookups of categories in other shards and only briefly
+ * stalls lookups in its own.
+ */
+class CategoryTable {
+ public:
+  CategoryTable();
+  ~CategoryTable();
+
+  // Returns NULL if the category isn't in the table
+  boost::shared_ptr<store_list_t> find(const std::string& category);
+
+  // Returns false and leaves the table alone if category is already present
+  bool insert(const std::string& category,
+              const boost::shared_ptr<store_list_t>& pstores);
+
+  // Appends every store list in the table to _return
+  void getAll(store_list_vector_t& _return);
+
+  // Appends the name of every category in the table to _return
+  void getCategories(std::vector<std::string>& _return);
+
+  void clear();
+
+ private:
+  struct Shard {
+    apache::thrift::concurrency::ReadWriteMutex lock;
+    category_map_t categories;
+  };
+
+  Shard& getShard(const std::string& category);
+
+  Shard shards[CATEGORY_TABLE_SHARDS];
+
+  // disallow copy and assignment
+  CategoryTable(const CategoryTable& rhs);
+  const CategoryTable& operator=(const CategoryTable& rhs);
+};
+
+/*
+ * Index of the prefix categories ("foo*") from the config file.
+ *
+ * Built once during configuration and read-only afterwards, so lookups
+ * need no locking. A lookup does one hash probe per distinct configured
+ * prefix length instead of comparing the category against every prefix.
+ */
+class CategoryPrefixIndex {
+ public:
+  CategoryPrefixIndex();
+  ~CategoryPrefixIndex();
+
+  // prefix_category includes the trailing '*'.
+  // Returns false if the prefix has already been added.
+  bool add(const std::string& prefix_category,
+           const boost::shared_ptr<StoreQueue>& model);
+
+  // Returns the model for the first prefix, in configured-name order,
+  // that matches category, or NULL if none do.
+  boost::shared_ptr<StoreQueue> findModel(const std::string& category) const;
+
+ private:
+  typedef boost::unordered_map<std::string, boost::shared_ptr<StoreQueue> >
+    prefix_map_t;
+
+  prefix_map_t prefixes;  // keyed by the prefix without the '*'
+  std::vector<std::string::size_type> lengths; // distinct, ascending
+
+  // disallow copy and assignment
+  CategoryPrefixIndex(const CategoryPrefixIndex& rhs);
+  const CategoryPrefixIndex& operator=(const CategoryPrefixIndex& rhs);
+};
+
+#endif // !defined SCRIBE_CATEGORY_TABLE_H
@@ -0,0 +1,159 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "chunk_index.h"
+
+#define CHUNK_INDEX_VERSION 1
+#define CHUNK_INDEX_HEADER_SIZE 24
+#define CHUNK_INDEX_ENTRY_SIZE 28
+
+using namespace std;
+using boost::shared_ptr;
+
+static const char chunkIndexMagic[5] = "SCIX";
+
+static void appendUInt(string& buf, unsigned long long value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    buf.push_back((char)((value >> (8 * i)) & 0xFF));
+  }
+}
+
+static unsigned long long readUInt(const char* buf, int bytes) {
+  unsigned long long value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value |= (unsigned long long)(unsigned char)buf[i] << (8 * i);
+  }
+  return value;
+}
+
+static bool compareMaxTime(const ChunkIndexEntry& entry, time_t timestamp) {
+  return entry.maxTime < timestamp;
+}
+
+ChunkIndex::ChunkIndex()
+  : chunkSize(0),
+    fileSize(0) {
+}
+
+void ChunkIndex::reset(unsigned long chunk_size) {
+  chunkSize = chunk_size ? chunk_size : 1;
+  fileSize = 0;
+  entries.clear();
+}
+
+void ChunkIndex::addMessage(unsigned long long offset, time_t timestamp) {
+  if (entries.empty() ||
+      offset / chunkSize != entries.back().offset / chunkSize) {
+    ChunkIndexEntry entry;
+    entry.offset = offset;
+    entry.count = 1;
+    entry.minTime = timestamp;
+    entry.maxTime = timestamp;
+    entries.push_back(entry);
+    return;
+  }
+
+  ChunkIndexEntry& entry = entries.back();
+  ++entry.count;
+  entry.minTime = min(entry.minTime, timestamp);
+  entry.maxTime = max(entry.maxTime, timestamp);
+}
+
+bool ChunkIndex::write(shared_ptr<FileInterface> file,
+                       unsigned long long file_size) {
+  fileSize = file_size;
+
+  string buf;
+  buf.reserve(CHUNK_INDEX_HEADER_SIZE + 4 +
+              entries.size() * (CHUNK_INDEX_ENTRY_SIZE + 4));
+
+  string header(chunkIndexMagic, 4);
+  appendUInt(header, CHUNK_INDEX_VERSION, 4);
+  appendUInt(header, chunkSize, 8);
+  appendUInt(header, fileSize, 8);
+  buf += file->getFrame(header.length());
+  buf += header;
+
+  for (vector<ChunkIndexEntry>::const_iterator iter = entries.begin();
+       iter != entries.end();
+       ++iter) {
+    string record;
+    appendUInt(record, iter->offset, 8);
+    appendUInt(record, iter->count, 4);
+    appendUInt(record, iter->minTime, 8);
+    appendUInt(record, iter->maxTime, 8);
+    buf += file->getFrame(record.length());
+    buf += record;
+  }
+
+  return file->write(buf) && file->waitForWrites();
+}
+
+bool ChunkIndex::read(shared_ptr<FileInterface> file) {
+  entries.clear();
+
+  string record;
+  if (!file->readNext(record) ||
+      record.length() != CHUNK_INDEX_HEADER_SIZE ||
+      0 != record.compare(0, 4, chunkIndexMagic) ||
+      readUInt(&record[4], 4) != CHUNK_INDEX_VERSION) {
+    return false;
+  }
+  chunkSize = readUInt(&record[8], 8);
+  fileSize = readUInt(&record[16], 8);
+  if (chunkSize == 0) {
+    return false;
+  }
+
+  while (file->readNext(record)) {
+    if (record.length() != CHUNK_INDEX_ENTRY_SIZE) {
+      entries.clear();
+      return false;
+    }
+    ChunkIndexEntry entry;
+    entry.offset = readUInt(&record[0], 8);
+    entry.count = readUInt(&record[8], 4);
+    entry.minTime = readUInt(&record[12], 8);
+    entry.maxTime = readUInt(&record[20], 8);
+    entries.push_back(entry);
+  }
+  return true;
+}
+
+// Entries are in the order they were written, so maxTime only goes down
+// if the clock does.
+bool ChunkIndex::findTime(time_t timestamp, unsigned long long& offset) const {
+  vector<ChunkIndexEntry>::const_iterator iter =
+    lower_bound(entries.begin(), entries.end(), timestamp, compareMaxTime);
+  if (iter == entries.end()) {
+    return false;
+  }
+  offset = iter->offset;
+  return true;
+}
+
+string ChunkIndex::makeIndexFilename(const std::string& filename) {
+  return filename + CHUNK_INDEX_SUFFIX;
+}
+
+bool ChunkIndex::isIndexFilename(const std::string& filename) {
+  static const string suffix(CHUNK_INDEX_SUFFIX);
+  return filename.length() > suffix.length() &&
+    0 == filename.compare(filename.length() - suffix.length(),
+                          suffix.length(), suffix);
+}
@@ -0,0 +1,80 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_CHUNK_INDEX_H
+#define SCRIBE_CHUNK_INDEX_H
+
+#include "common.h"
+#include "file.h"
+
+// Suffix added to a file's name to get the name of its index
+#define CHUNK_INDEX_SUFFIX ".index"
+
+struct ChunkIndexEntry {
+  unsigned long long offset; // where the first message in the chunk starts
+  unsigned long count;       // number of messages starting in the chunk
+  time_t minTime;            // range of times the messages were written
+  time_t maxTime;
+};
+
+/*
+ * Index of where messages start in a file, one entry per chunkSize bytes
+ * that has a message starting in it, in file order.
+ *
+ * FileStore builds one of these while it writes a file and saves it next
+ * to the file when the file is closed, so readers can seek straight to a
+ * message boundary or time range instead of scanning from the start. The
+ * index is stored as a framed file: a header record with the chunk size and
+ * the size of the file it covers, then a record per entry, all integers
+ * little endian.
+ *
+ * Not thread safe.
+ */
+class ChunkIndex {
+ public:
+  ChunkIndex();
+
+  // Starts indexing a new file in chunks of chunk_size bytes
+  void reset(unsigned long chunk_size);
+
+  // Records a message starting at offset
+  void addMessage(unsigned long long offset, time_t timestamp);
+
+  // Saves the index for a file that is file_size bytes long
+  bool write(boost::shared_ptr<FileInterface> file,
+             unsigned long long file_size);
+  bool read(boost::shared_ptr<FileInterface> file);
+
+  // Offset of the first chunk that may hold messages written at or after
+  // timestamp. Returns false if there are none.
+  bool findTime(time_t timestamp, unsigned long long& offset) const;
+
+  const std::vector<ChunkIndexEntry>& getEntries() const {return entries;}
+  unsigned long getChunkSize() const {return chunkSize;}
+  // size of the file this index covers, as of the last write or read
+  unsigned long long getFileSize() const {return fileSize;}
+
+  static std::string makeIndexFilename(const std::string& filename);
+  static bool isIndexFilename(const std::string& filename);
+
+ private:
+  unsigned long chunkSize;
+  unsigned long long fileSize;
+  std::vector<ChunkIndexEntry> entries;
+};
+
+#endif // !defined SCRIBE_CHUNK_INDEX_H
@@ -29,20 +29,29 @@
 #include <queue>
 #include <vector>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <map>
 #include <set>
+#include <algorithm>
 #include <stdexcept>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/convenience.hpp>
 
@@ -61,8 +70,13 @@
 
 #include "src/gen-cpp/scribe.h"
 
+// A LogEntry is shared by every store a message fans out to, so it must
+// be treated as immutable once it has been handed to a StoreQueue.
 typedef boost::shared_ptr<scribe::thrift::LogEntry> logentry_ptr_t;
 typedef std::vector<logentry_ptr_t> logentry_vector_t;
+// messages grouped by category
+typedef boost::unordered_map<std::string, boost::shared_ptr<logentry_vector_t> >
+  category_batch_map_t;
 typedef std::vector<std::pair<std::string, int> > server_vector_t;
 
 // For security reasons we can't release everything that's compiled
@@ -0,0 +1,199 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <zlib.h>
+#include <arpa/inet.h>
+#include "compressed_transport.h"
+
+using std::string;
+using boost::shared_ptr;
+using namespace apache::thrift::transport;
+using namespace apache::thrift::protocol;
+
+// Binary protocol messages start with 0x80 (strict) or 0x00 (the high byte
+// of the method name length), so this can't be mistaken for one.
+#define COMPRESSED_MAGIC 0x5a
+#define COMPRESSED_HEADER_SIZE 10
+
+// A compressed message must not expand past what the server accepts as a
+// plain frame (the default max frame size of TNonblockingServer and
+// TFramedTransport), otherwise compression would bypass that limit.
+#define MAX_UNCOMPRESSED_SIZE (256 * 1024 * 1024)
+
+CompressedTransport::CompressedTransport(shared_ptr<TTransport> transport_,
+                                         codec_t codec_, int level_)
+  : transport(transport_),
+    codec(codec_),
+    level(level_),
+    readState(READ_START),
+    havePeeked(false),
+    peekedByte(0),
+    readPos(0) {
+}
+
+CompressedTransport::~CompressedTransport() {
+}
+
+bool CompressedTransport::isOpen() {
+  return transport->isOpen();
+}
+
+void CompressedTransport::open() {
+  transport->open();
+}
+
+void CompressedTransport::close() {
+  transport->close();
+}
+
+uint32_t CompressedTransport::read(uint8_t* buf, uint32_t len) {
+  if (len == 0) {
+    return 0;
+  }
+
+  if (readState == READ_START) {
+    transport->readAll(&peekedByte, 1);
+    if (peekedByte == COMPRESSED_MAGIC) {
+      readCompressedMessage();
+      readState = READ_COMPRESSED;
+    } else {
+      havePeeked = true;
+      readState = READ_PLAIN;
+    }
+  }
+
+  if (readState == READ_PLAIN) {
+    if (havePeeked) {
+      havePeeked = false;
+      buf[0] = peekedByte;
+      return 1;
+    }
+    return transport->read(buf, len);
+  }
+
+  uint32_t available = readBuffer.length() - readPos;
+  if (available == 0) {
+    throw TTransportException(TTransportException::END_OF_FILE,
+                              "No more data in compressed message");
+  }
+  uint32_t give = std::min(len, available);
+  memcpy(buf, readBuffer.data() + readPos, give);
+  readPos += give;
+  return give;
+}
+
+// The magic byte has already been read.
+void CompressedTransport::readCompressedMessage() {
+  uint8_t header[COMPRESSED_HEADER_SIZE - 1];
+  transport->readAll(header, sizeof(header));
+
+  uint8_t message_codec = header[0];
+  uint32_t uncompressed_length;
+  uint32_t compressed_length;
+  memcpy(&uncompressed_length, header + 1, 4);
+  memcpy(&compressed_length, header + 5, 4);
+  uncompressed_length = ntohl(uncompressed_length);
+  compressed_length = ntohl(compressed_length);
+
+  if (message_codec != CODEC_ZLIB) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Unknown compression codec");
+  }
+  if (uncompressed_length > MAX_UNCOMPRESSED_SIZE ||
+      compressed_length > compressBound(uncompressed_length)) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Bad compressed message length");
+  }
+
+  string compressed(compressed_length, '\0');
+  if (compressed_length) {
+    transport->readAll((uint8_t*)&compressed[0], compressed_length);
+  }
+
+  readBuffer.resize(uncompressed_length);
+  readPos = 0;
+  uLongf dest_length = uncompressed_length;
+  if (uncompressed_length &&
+      (uncompress((Bytef*)&readBuffer[0], &dest_length,
+                  (const Bytef*)compressed.data(), compressed_length) != Z_OK ||
+       dest_length != uncompressed_length)) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Failed to decompress message");
+  }
+}
+
+uint32_t CompressedTransport::readEnd() {
+  readState = READ_START;
+  havePeeked = false;
+  readBuffer.clear();
+  readPos = 0;
+  return transport->readEnd();
+}
+
+void CompressedTransport::write(const uint8_t* buf, uint32_t len) {
+  if (codec == CODEC_NONE) {
+    transport->write(buf, len);
+  } else {
+    writeBuffer.append((const char*)buf, len);
+  }
+}
+
+void CompressedTransport::flush() {
+  if (writeBuffer.length() > MAX_UNCOMPRESSED_SIZE) {
+    writeBuffer.clear();
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "Message too large to compress");
+  }
+  if (!writeBuffer.empty()) {
+    uLongf compressed_length = compressBound(writeBuffer.length());
+    string message(COMPRESSED_HEADER_SIZE + compressed_length, '\0');
+
+    if (compress2((Bytef*)&message[COMPRESSED_HEADER_SIZE], &compressed_length,
+                  (const Bytef*)writeBuffer.data(), writeBuffer.length(),
+                  level) != Z_OK) {
+      writeBuffer.clear();
+      throw TTransportException(TTransportException::INTERNAL_ERROR,
+                                "Failed to compress message");
+    }
+
+    uint32_t uncompressed_net = htonl(writeBuffer.length());
+    uint32_t compressed_net = htonl(compressed_length);
+    message[0] = COMPRESSED_MAGIC;
+    message[1] = codec;
+    memcpy(&message[2], &uncompressed_net, 4);
+    memcpy(&message[6], &compressed_net, 4);
+
+    transport->write((const uint8_t*)message.data(),
+                     COMPRESSED_HEADER_SIZE + compressed_length);
+    writeBuffer.clear();
+  }
+  transport->flush();
+}
+
+uint32_t CompressedTransport::writeEnd() {
+  return transport->writeEnd();
+}
+
+shared_ptr<TProtocol>
+CompressedBinaryProtocolFactory::getProtocol(shared_ptr<TTransport> trans) {
+  shared_ptr<TTransport> compressed(
+    new CompressedTransport(trans, CompressedTransport::CODEC_NONE, 0));
+  shared_ptr<TBinaryProtocol> protocol(new TBinaryProtocol(compressed));
+  // same as TBinaryProtocolFactory(0, 0, false, false)
+  protocol->setStrict(false, false);
+  return protocol;
+}
@@ -0,0 +1,105 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_COMPRESSED_TRANSPORT_H
+#define SCRIBE_COMPRESSED_TRANSPORT_H
+
+#include "common.h"
+#include "thrift/transport/TVirtualTransport.h"
+
+/*
+ * Transport that compresses each message written to it.
+ *
+ * Everything written between flushes is sent as one compressed message:
+ *   magic (1 byte), codec (1 byte), uncompressed length (4 bytes),
+ *   compressed length (4 bytes), compressed data
+ * with lengths in network byte order. The magic byte can never start a
+ * TBinaryProtocol message, so reads detect compressed messages and pass
+ * anything else through untouched. That lets a server accept compressed
+ * and plain clients on the same port.
+ *
+ * Must be layered over a transport that preserves message boundaries
+ * (TFramedTransport, or the buffers TNonblockingServer hands to protocols)
+ * and relies on readEnd() being called after each message is read.
+ *
+ * read() and write() aren't virtual in TTransport, so the class goes through
+ * TVirtualTransport to be reachable from a protocol holding a TTransport.
+ */
+class CompressedTransport
+  : public apache::thrift::transport::TVirtualTransport<CompressedTransport> {
+ public:
+  enum codec_t {
+    CODEC_NONE = 0, // writes are passed through uncompressed
+    CODEC_ZLIB = 1
+  };
+
+  CompressedTransport(
+    boost::shared_ptr<apache::thrift::transport::TTransport> transport,
+    codec_t codec, int level);
+  virtual ~CompressedTransport();
+
+  bool isOpen();
+  void open();
+  void close();
+
+  uint32_t read(uint8_t* buf, uint32_t len);
+  uint32_t readEnd();
+  void write(const uint8_t* buf, uint32_t len);
+  void flush();
+  uint32_t writeEnd();
+
+ private:
+  void readCompressedMessage();
+
+  boost::shared_ptr<apache::thrift::transport::TTransport> transport;
+  codec_t codec;
+  int level;
+
+  // read state for the current message
+  enum {
+    READ_START,      // haven't looked at the message yet
+    READ_PLAIN,      // passing an uncompressed message through
+    READ_COMPRESSED  // returning data from readBuffer
+  } readState;
+  bool havePeeked;   // peekedByte is the next byte of a plain message
+  uint8_t peekedByte;
+  std::string readBuffer;
+  uint32_t readPos;
+
+  std::string writeBuffer;
+
+  // disallow copy, assignment, and empty construction
+  CompressedTransport();
+  CompressedTransport(CompressedTransport& rhs);
+  CompressedTransport& operator=(CompressedTransport& rhs);
+};
+
+/*
+ * Creates binary protocols that accept both compressed and plain messages.
+ * Replies are always sent uncompressed.
+ */
+class CompressedBinaryProtocolFactory
+  : public apache::thrift::protocol::TProtocolFactory {
+ public:
+  CompressedBinaryProtocolFactory() {}
+  virtual ~CompressedBinaryProtocolFactory() {}
+
+  boost::shared_ptr<apache::thrift::protocol::TProtocol>
+    getProtocol(boost::shared_ptr<apache::thrift::transport::TTransport> trans);
+};
+
+#endif // !defined SCRIBE_COMPRESSED_TRANSPORT_H
@@ -112,6 +112,35 @@ void StoreConf::setUnsignedLongLong(const std::string& stringName, unsigned long
   setString(stringName, oss.str());
 }
 
+pStoreConf StoreConf::clone() const {
+  pStoreConf copy(new StoreConf);
+  copy->values = values;
+  for (store_conf_map_t::const_iterator iter = stores.begin();
+       iter != stores.end();
+       ++iter) {
+    copy->stores[iter->first] = iter->second->clone();
+  }
+  return copy;
+}
+
+bool StoreConf::equals(const StoreConf& other) const {
+  if (values != other.values || stores.size() != other.stores.size()) {
+    return false;
+  }
+
+  // both maps are sorted by name
+  store_conf_map_t::const_iterator other_iter = other.stores.begin();
+  for (store_conf_map_t::const_iterator iter = stores.begin();
+       iter != stores.end();
+       ++iter, ++other_iter) {
+    if (iter->first != other_iter->first ||
+        !iter->second->equals(*other_iter->second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // reads and parses the config data
 void StoreConf::parseConfig(const std::string& filename) {
 
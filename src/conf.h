@@ -63,6 +63,11 @@ class StoreConf {
   void setUnsigned(const std::string& intName, unsigned long value);
   void setUnsignedLongLong(const std::string& intName, unsigned long long value);
 
+  // Deep copy, so later changes to either one don't show up in the other
+  pStoreConf clone() const;
+  // True if both have the same values and stores, all the way down
+  bool equals(const StoreConf& other) const;
+
   // Reads configuration from a file and throws an exception if it fails.
   void parseConfig(const std::string& filename);
 
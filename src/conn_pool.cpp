@@ -24,10 +24,14 @@
 #include "common.h"
 #include "scribe_server.h"
 #include "conn_pool.h"
+#include "compressed_transport.h"
+#include "latency_stats.h"
 
 using std::string;
 using std::ostringstream;
 using std::map;
+using std::min;
+using std::max;
 using boost::shared_ptr;
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -35,8 +39,13 @@ using namespace apache::thrift::transport;
 using namespace apache::thrift::server;
 using namespace scribe::thrift;
 
+// seconds between attempts to reopen a closed connection in a pool that
+// still has an open one to send to
+#define CONN_POOL_RETRY_INTERVAL 10
 
-ConnPool::ConnPool() {
+
+ConnPool::ConnPool()
+  : nextConn(0) {
   pthread_mutex_init(&mapMutex, NULL);
 }
 
@@ -54,14 +63,50 @@ string ConnPool::makeKey(const string& hostname, unsigned long port) {
   return key;
 }
 
-bool ConnPool::open(const string& hostname, unsigned long port, int timeout) {
-	return openCommon(makeKey(hostname, port),
-                    shared_ptr<scribeConn>(new scribeConn(hostname, port, timeout)));
+bool ConnPool::open(const string& hostname, unsigned long port, int timeout,
+                    unsigned long pipeline_window,
+                    unsigned long pipeline_batch_size,
+                    unsigned long pool_size,
+                    int compression_level) {
+  conn_list_t conns;
+  for (unsigned long i = 0; i < max(pool_size, 1UL); ++i) {
+    conns.push_back(shared_ptr<scribeConn>(new scribeConn(hostname, port, timeout,
+                                                          pipeline_window,
+                                                          pipeline_batch_size,
+                                                          compression_level)));
+  }
+	return openCommon(makeKey(hostname, port), conns);
 }
 
-bool ConnPool::open(const string &service, const server_vector_t &servers, int timeout) {
-	return openCommon(service,
-                    shared_ptr<scribeConn>(new scribeConn(service, servers, timeout)));
+bool ConnPool::open(const string &service, const server_vector_t &servers, int timeout,
+                    unsigned long pipeline_window,
+                    unsigned long pipeline_batch_size,
+                    unsigned long pool_size,
+                    int compression_level) {
+  conn_list_t conns;
+  if (pool_size <= 1) {
+    conns.push_back(shared_ptr<scribeConn>(new scribeConn(service, servers, timeout,
+                                                          pipeline_window,
+                                                          pipeline_batch_size,
+                                                          compression_level)));
+  } else {
+    // Give each connection a different first choice of server, so that
+    // the connections are spread across all of them.
+    for (unsigned long i = 0; i < pool_size; ++i) {
+      server_vector_t rotated(servers);
+      if (!rotated.empty()) {
+        std::rotate(rotated.begin(), rotated.begin() + (i % rotated.size()),
+                    rotated.end());
+      }
+      shared_ptr<scribeConn> conn(new scribeConn(service, rotated, timeout,
+                                                 pipeline_window,
+                                                 pipeline_batch_size,
+                                                 compression_level));
+      conn->setRandomizeServers(false);
+      conns.push_back(conn);
+    }
+  }
+	return openCommon(service, conns);
 }
 
 void ConnPool::close(const string& hostname, unsigned long port) {
@@ -82,31 +127,48 @@ bool ConnPool::send(const string &service,
   return sendCommon(service, messages);
 }
 
-bool ConnPool::openCommon(const string &key, shared_ptr<scribeConn> conn) {
+bool ConnPool::openCommon(const string &key, const conn_list_t& conns) {
 
   // note on locking:
   // The mapMutex locks all reads and writes to the connMap.
-  // The locks on each connection serialize writes and deletion.
+  // Connections do their own locking in send(), and the lock on each
+  // connection serializes writes and deletion.
   // The lock on a connection doesn't protect its refcount, as refcounts
   // are only accessed under the mapMutex.
   // mapMutex MUST be held before attempting to lock particular connection
+  //
+  // Every connection for a key has the same refcount.
 
   pthread_mutex_lock(&mapMutex);
   conn_map_t::iterator iter = connMap.find(key);
   if (iter != connMap.end()) {
-    (*iter).second->addRef();
+    for (conn_list_t::iterator conn_iter = (*iter).second.begin();
+         conn_iter != (*iter).second.end();
+         ++conn_iter) {
+      (*conn_iter)->addRef();
+    }
     pthread_mutex_unlock(&mapMutex);
     return true;
   } else {
-    // don't need to lock the conn yet, because no one know about 
-    // it until we release the mapMutex
-    if (conn->open()) {
+    // don't need to lock the conns yet, because no one know about
+    // them until we release the mapMutex
+    bool any_opened = false;
+    for (conn_list_t::const_iterator conn_iter = conns.begin();
+         conn_iter != conns.end();
+         ++conn_iter) {
+      // a connection that failed to open is retried by sendCommon
+      if ((*conn_iter)->open()) {
+        any_opened = true;
+      }
+    }
+
+    if (any_opened) {
       // ref count starts at one, so don't addRef here
-      connMap[key] = conn;
+      connMap[key] = conns;
       pthread_mutex_unlock(&mapMutex);
       return true;
     } else {
-      // conn object that failed to open is deleted
+      // conn objects that failed to open are deleted
       pthread_mutex_unlock(&mapMutex);
       return false;
     }
@@ -117,11 +179,20 @@ void ConnPool::closeCommon(const string &key) {
   pthread_mutex_lock(&mapMutex);
   conn_map_t::iterator iter = connMap.find(key);
   if (iter != connMap.end()) {
-    (*iter).second->releaseRef();
-    if ((*iter).second->getRef() <= 0) {
-      (*iter).second->lock();
-      (*iter).second->close();
-      (*iter).second->unlock();
+    conn_list_t& conns = (*iter).second;
+    for (conn_list_t::iterator conn_iter = conns.begin();
+         conn_iter != conns.end();
+         ++conn_iter) {
+      (*conn_iter)->releaseRef();
+    }
+    if (conns.front()->getRef() <= 0) {
+      for (conn_list_t::iterator conn_iter = conns.begin();
+           conn_iter != conns.end();
+           ++conn_iter) {
+        (*conn_iter)->lock();
+        (*conn_iter)->close();
+        (*conn_iter)->unlock();
+      }
       connMap.erase(iter);
     }
   } else {
@@ -136,11 +207,18 @@ bool ConnPool::sendCommon(const string &key,
   pthread_mutex_lock(&mapMutex);
   conn_map_t::iterator iter = connMap.find(key);
   if (iter != connMap.end()) {
-    (*iter).second->lock();
+    // hold a reference so the connection outlives the send even if it is
+    // removed from the map, and let other senders share the connection
+    shared_ptr<scribeConn> retry;
+    shared_ptr<scribeConn> conn = pickConn((*iter).second, retry);
     pthread_mutex_unlock(&mapMutex);
-    bool result = (*iter).second->send(messages);
-    (*iter).second->unlock();
-    return result;
+    bool success = conn->send(messages);
+
+    // once our own send is done, so that it isn't held up by the connect
+    if (retry && retry->reopen()) {
+      LOG_OPER("reopened connection for <%s>", key.c_str());
+    }
+    return success;
   } else {
     LOG_OPER("send failed. No connection pool entry for <%s>", key.c_str());
     pthread_mutex_unlock(&mapMutex);
@@ -148,27 +226,94 @@ bool ConnPool::sendCommon(const string &key,
   }
 }
 
-scribeConn::scribeConn(const string& hostname, unsigned long port, int timeout_)
+// Must hold mapMutex. Returns the open connection with the fewest sends in
+// progress, starting the search at a different connection each time so
+// that ties don't all go to the same one. Closed connections would never
+// be sent to again while another one is open, so retry is set to one of
+// them every CONN_POOL_RETRY_INTERVAL seconds for the caller to reopen.
+shared_ptr<scribeConn> ConnPool::pickConn(const conn_list_t& conns,
+                                          shared_ptr<scribeConn>& retry) {
+  unsigned long count = conns.size();
+  unsigned long start = nextConn++;
+  shared_ptr<scribeConn> best;
+  shared_ptr<scribeConn> closed;
+
+  for (unsigned long i = 0; i < count; ++i) {
+    const shared_ptr<scribeConn>& conn = conns[(start + i) % count];
+    if (!conn->isOpen()) {
+      if (!closed) {
+        closed = conn;
+      }
+    } else if (!best || conn->getLoad() < best->getLoad()) {
+      best = conn;
+    }
+  }
+
+  // If none are open, let the send fail and reopen one
+  if (!best) {
+    return conns[start % count];
+  }
+  if (closed && closed->claimRetry(time(NULL), CONN_POOL_RETRY_INTERVAL)) {
+    retry = closed;
+  }
+  return best;
+}
+
+scribeConn::scribeConn(const string& hostname, unsigned long port, int timeout_,
+                       unsigned long pipeline_window,
+                       unsigned long pipeline_batch_size,
+                       int compression_level)
   : refCount(1),
+  lastRetry(time(NULL)),
   smcBased(false),
+  randomizeServers(true),
   remoteHost(hostname),
   remotePort(port),
   timeout(timeout_),
+  pipelineWindow(pipeline_window ? pipeline_window : 1),
+  pipelineBatchSize(pipeline_batch_size),
+  compressionLevel(compression_level),
+  connected(false),
+  activeSends(0),
+  reading(false),
+  broken(false),
+  tryLater(false),
   lastHeartbeat(time(NULL)) {
   pthread_mutex_init(&mutex, NULL);
+  pthread_mutex_init(&stateMutex, NULL);
+  pthread_cond_init(&stateCond, NULL);
+  sendStatId = g_latencyStats.getId("conn " + connectionString() + " send us");
 }
 
-scribeConn::scribeConn(const string& service, const server_vector_t &servers, int timeout_)
+scribeConn::scribeConn(const string& service, const server_vector_t &servers, int timeout_,
+                       unsigned long pipeline_window,
+                       unsigned long pipeline_batch_size,
+                       int compression_level)
   : refCount(1),
+  lastRetry(time(NULL)),
   smcBased(true),
   smcService(service),
   serverList(servers),
+  randomizeServers(true),
   timeout(timeout_),
+  pipelineWindow(pipeline_window ? pipeline_window : 1),
+  pipelineBatchSize(pipeline_batch_size),
+  compressionLevel(compression_level),
+  connected(false),
+  activeSends(0),
+  reading(false),
+  broken(false),
+  tryLater(false),
   lastHeartbeat(time(NULL)) {
   pthread_mutex_init(&mutex, NULL);
+  pthread_mutex_init(&stateMutex, NULL);
+  pthread_cond_init(&stateCond, NULL);
+  sendStatId = g_latencyStats.getId("conn " + connectionString() + " send us");
 }
 
 scribeConn::~scribeConn() {
+  pthread_cond_destroy(&stateCond);
+  pthread_mutex_destroy(&stateMutex);
   pthread_mutex_destroy(&mutex);
 }
 
@@ -193,15 +338,51 @@ void scribeConn::unlock() {
 }
 
 bool scribeConn::isOpen() {
-  return framedTransport->isOpen();
+  return connected;
+}
+
+bool scribeConn::reopen() {
+  lock();
+  pthread_mutex_lock(&stateMutex);
+  while (reading) {
+    pthread_cond_wait(&stateCond, &stateMutex);
+  }
+  if (!connected && !broken) {
+    open();
+  }
+  bool opened = connected;
+  pthread_mutex_unlock(&stateMutex);
+  unlock();
+  return opened;
+}
+
+bool scribeConn::claimRetry(time_t now, time_t interval) {
+  if (connected || now - lastRetry < interval) {
+    return false;
+  }
+  lastRetry = now;
+  return true;
+}
+
+unsigned long scribeConn::getLoad() {
+  return activeSends;
+}
+
+void scribeConn::setRandomizeServers(bool randomize) {
+  randomizeServers = randomize;
 }
 
 bool scribeConn::open() {
+  connected = false;
   try {
 
-    socket = smcBased ?
-      shared_ptr<TSocket>(new TSocketPool(serverList)) :
-      shared_ptr<TSocket>(new TSocket(remoteHost, remotePort));
+    if (smcBased) {
+      shared_ptr<TSocketPool> socket_pool(new TSocketPool(serverList));
+      socket_pool->setRandomize(randomizeServers);
+      socket = socket_pool;
+    } else {
+      socket = shared_ptr<TSocket>(new TSocket(remoteHost, remotePort));
+    }
 
     if (!socket) {
       throw std::runtime_error("Failed to create socket");
@@ -214,7 +395,16 @@ bool scribeConn::open() {
     if (!framedTransport) {
       throw std::runtime_error("Failed to create framed transport");
     }
-    protocol = shared_ptr<TBinaryProtocol>(new TBinaryProtocol(framedTransport));
+    // compression happens inside the frame, so that each compressed
+    // message is still a single frame to the server
+    if (compressionLevel > 0) {
+      protocolTransport = shared_ptr<TTransport>(
+        new CompressedTransport(framedTransport, CompressedTransport::CODEC_ZLIB,
+                                compressionLevel));
+    } else {
+      protocolTransport = framedTransport;
+    }
+    protocol = shared_ptr<TBinaryProtocol>(new TBinaryProtocol(protocolTransport));
     if (!protocol) {
       throw std::runtime_error("Failed to create protocol");
     }
@@ -237,10 +427,12 @@ bool scribeConn::open() {
   }
   LOG_OPER("Opened connection to remote scribe server %s",
            connectionString().c_str());
+  connected = true;
   return true;
 }
 
 void scribeConn::close() {
+  connected = false;
   try {
     LOG_DEBUG("Closing connection to remote scribe server %s",
               connectionString().c_str());
@@ -252,44 +444,89 @@ void scribeConn::close() {
 }
 
 bool scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
-  int size = messages->size();
+  unsigned long size = messages->size();
   if (size <= 0) {
     LOG_DEBUG("[%s] DEBUG: send called with no messages.",
               connectionString().c_str());
     return true;
   }
 
-  // Copy the vector of pointers to a vector of objects
-  // This is because thrift doesn't support vectors of pointers,
-  // but we need to use them internally to avoid even more copies.
-  std::vector<LogEntry> msgs;
-  map<string, int> categorySendCounts;
-  for (logentry_vector_t::iterator iter = messages->begin();
-       iter != messages->end();
-       ++iter) {
-    msgs.push_back(**iter);
-    categorySendCounts[(*iter)->category] += 1;
+  __sync_add_and_fetch(&activeSends, 1);
+  unsigned long long start = g_latencyStats.isEnabled() ? currentTimeUs() : 0;
+
+  unsigned long call_size = pipelineBatchSize ? pipelineBatchSize : size;
+  std::vector<pending_call_ptr_t> calls;
+
+  // Write our calls back to back, reading replies whenever the window is full
+  lock();
+  pthread_mutex_lock(&stateMutex);
+  for (unsigned long begin = 0; begin < size; begin += call_size) {
+    pending_call_ptr_t call(new pendingCall);
+    calls.push_back(call);
+
+    // once the server says TRY_LATER, nothing more is written until every
+    // earlier call has its reply, so later calls can't overtake a failed one
+    while (!broken &&
+           pendingCalls.size() >= (tryLater ? 1 : pipelineWindow)) {
+      waitForReply(true);
+    }
+
+    // don't write anything after a failure, so that order is preserved
+    bool failed = broken;
+    for (unsigned long i = 0; !failed && i + 1 < calls.size(); ++i) {
+      failed = calls[i]->done && calls[i]->result != OK;
+    }
+    if (failed) {
+      call->done = true;
+      continue;
+    }
+
+    pthread_mutex_unlock(&stateMutex);
+    bool written = sendLog(*messages, begin, min(begin + call_size, size));
+    pthread_mutex_lock(&stateMutex);
+
+    if (written) {
+      pendingCalls.push_back(call);
+    } else {
+      call->done = true;
+      breakConnection();
+    }
   }
 
-  ResultCode result = TRY_LATER;
-  try {
-    result = resendClient->Log(msgs);
-  } catch (TTransportException& ttx) {
-    LOG_OPER("Failed to send <%d> messages to remote scribe server %s error <%s>",
-             size, connectionString().c_str(), ttx.what());
-  } catch (...) {
-    LOG_OPER("Unknown exception sending <%d> messages to remote scribe server %s",
-             size, connectionString().c_str());
+  if (broken) {
+    resetConnection();
+  }
+  unlock();
+
+  // Calls we didn't write are already done, so wait for each of them
+  for (unsigned long i = 0; i < calls.size(); ++i) {
+    while (!calls[i]->done) {
+      waitForReply(false);
+    }
+  }
+
+  // Only the calls that didn't get an OK reply have to be retried. Calls
+  // written after a failed one may still have succeeded.
+  unsigned long num_sent = 0;
+  logentry_vector_t unsent;
+  for (unsigned long i = 0; i < calls.size(); ++i) {
+    unsigned long begin = i * call_size;
+    unsigned long end = min(begin + call_size, size);
+    updateSendCounts(*messages, begin, end, calls[i]->result);
+    if (calls[i]->result == OK) {
+      num_sent += end - begin;
+    } else {
+      unsent.insert(unsent.end(), messages->begin() + begin,
+                    messages->begin() + end);
+    }
+  }
+  if (start) {
+    g_latencyStats.record(sendStatId, currentTimeUs() - start);
   }
 
   // Periodically log sent message stats. While these statistics are
   // available as counters they may not be being collected, and serve
   // as heartbeats useful when diagnosing issues.
-  for (map<string, int>::iterator it = categorySendCounts.begin();
-       it != categorySendCounts.end();
-       ++it) {
-    sendCounts[it->first + ":" + resultCodeToString(result)] += it->second;
-  }
   time_t now = time(NULL);
   if (now - lastHeartbeat > 60) {
     for (map<string, int>::iterator it2 = sendCounts.begin();
@@ -301,21 +538,163 @@ bool scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
     sendCounts.clear();
     lastHeartbeat = now;
   }
+  pthread_mutex_unlock(&stateMutex);
+  __sync_sub_and_fetch(&activeSends, 1);
+
+  if (num_sent) {
+    incCounter("sent", num_sent);
+  }
 
-  if (result == OK) {
-    incCounter("sent", size);
-    LOG_DEBUG("DEBUG: Successfully sent <%d> messages to remote scribe server %s",
+  if (num_sent == size) {
+    LOG_DEBUG("DEBUG: Successfully sent <%lu> messages to remote scribe server %s",
               size, connectionString().c_str());
     return true;
   }
 
-  LOG_OPER("Failed to send <%d> messages, remote scribe server %s returned error code <%d>",
-           size, connectionString().c_str(), (int) result);
-  close();
-  open();
+  LOG_OPER("Failed to send <%lu> of <%lu> messages to remote scribe server %s",
+           size - num_sent, size, connectionString().c_str());
+
+  // update messages to include only the messages that were not sent
+  messages->swap(unsent);
   return false;
 }
 
+// Must hold stateMutex. Reads the reply to the oldest pending call, or waits
+// for another thread that is already reading one.
+void scribeConn::waitForReply(bool haveWriteLock) {
+  if (reading) {
+    pthread_cond_wait(&stateCond, &stateMutex);
+    return;
+  }
+
+  reading = true;
+  pthread_mutex_unlock(&stateMutex);
+
+  ResultCode result = TRY_LATER;
+  bool received = false;
+  try {
+    result = resendClient->recv_Log();
+    received = true;
+  } catch (TTransportException& ttx) {
+    LOG_OPER("Failed to receive reply from remote scribe server %s error <%s>",
+             connectionString().c_str(), ttx.what());
+  } catch (...) {
+    LOG_OPER("Unknown exception receiving reply from remote scribe server %s",
+             connectionString().c_str());
+  }
+
+  pthread_mutex_lock(&stateMutex);
+  reading = false;
+
+  // if the connection broke while we were reading, the call has already failed
+  if (!broken) {
+    if (received) {
+      pending_call_ptr_t call = pendingCalls.front();
+      pendingCalls.pop_front();
+      call->result = result;
+      call->done = true;
+
+      // the connection is still in sync, so the calls behind this one
+      // keep waiting for their own replies
+      tryLater = result != OK;
+      if (result != OK) {
+        LOG_OPER("remote scribe server %s returned error code <%d>",
+                 connectionString().c_str(), (int) result);
+      }
+    } else {
+      breakConnection();
+    }
+  }
+  pthread_cond_broadcast(&stateCond);
+
+  if (broken && !haveWriteLock) {
+    pthread_mutex_unlock(&stateMutex);
+    lock();
+    pthread_mutex_lock(&stateMutex);
+    resetConnection();
+    unlock();
+  }
+}
+
+// Must hold stateMutex. Fails every call still waiting for a reply, since
+// we can no longer tell which replies belong to which calls.
+void scribeConn::breakConnection() {
+  broken = true;
+  for (std::deque<pending_call_ptr_t>::iterator iter = pendingCalls.begin();
+       iter != pendingCalls.end();
+       ++iter) {
+    (*iter)->done = true;
+  }
+  pendingCalls.clear();
+  pthread_cond_broadcast(&stateCond);
+}
+
+// Must hold mutex and stateMutex. Reopens a broken connection once nobody
+// is reading from it.
+void scribeConn::resetConnection() {
+  while (reading) {
+    pthread_cond_wait(&stateCond, &stateMutex);
+  }
+  if (broken) {
+    close();
+    open();
+    broken = false;
+    tryLater = false;
+  }
+}
+
+// Must hold stateMutex.
+void scribeConn::updateSendCounts(const logentry_vector_t& messages,
+                                  unsigned long begin, unsigned long end,
+                                  ResultCode result) {
+  map<string, int> categorySendCounts;
+  for (unsigned long i = begin; i < end; ++i) {
+    categorySendCounts[messages[i]->category] += 1;
+  }
+
+  for (map<string, int>::iterator it = categorySendCounts.begin();
+       it != categorySendCounts.end();
+       ++it) {
+    sendCounts[it->first + ":" + resultCodeToString(result)] += it->second;
+  }
+}
+
+// Writes a Log() call for messages[begin, end) directly from the vector of
+// pointers. This produces exactly what scribeClient::send_Log() would, but
+// thrift only takes a vector of objects and we don't want to copy every
+// message just to serialize it.
+bool scribeConn::sendLog(const logentry_vector_t& messages,
+                         unsigned long begin, unsigned long end) {
+  try {
+    protocol->writeMessageBegin("Log", T_CALL, 0);
+
+    // scribe_Log_pargs
+    protocol->writeStructBegin("scribe_Log_pargs");
+    protocol->writeFieldBegin("messages", T_LIST, 1);
+    protocol->writeListBegin(T_STRUCT, end - begin);
+    for (unsigned long i = begin; i < end; ++i) {
+      messages[i]->write(protocol.get());
+    }
+    protocol->writeListEnd();
+    protocol->writeFieldEnd();
+    protocol->writeFieldStop();
+    protocol->writeStructEnd();
+
+    protocol->writeMessageEnd();
+    protocol->getTransport()->flush();
+    protocol->getTransport()->writeEnd();
+  } catch (TTransportException& ttx) {
+    LOG_OPER("Failed to send <%lu> messages to remote scribe server %s error <%s>",
+             end - begin, connectionString().c_str(), ttx.what());
+    return false;
+  } catch (...) {
+    LOG_OPER("Unknown exception sending <%lu> messages to remote scribe server %s",
+             end - begin, connectionString().c_str());
+    return false;
+  }
+  return true;
+}
+
 std::string scribeConn::connectionString() {
   if (smcBased) {
     return "<SMC service: " + smcService + ">";
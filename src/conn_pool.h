@@ -24,10 +24,36 @@
 
 #include "common.h"
 
+// A Log call that has been written to a connection and is waiting for its reply
+struct pendingCall {
+  pendingCall() : done(false), result(scribe::thrift::TRY_LATER) {}
+
+  bool done;
+  scribe::thrift::ResultCode result;
+};
+typedef boost::shared_ptr<pendingCall> pending_call_ptr_t;
+
+/*
+ * A connection to a remote scribe server.
+ *
+ * send() may be called from several threads at once. Log calls are written
+ * to the connection back to back, up to pipelineWindow calls at a time,
+ * and whichever thread is waiting reads the replies, which arrive in the
+ * order the calls were written. A failed reply only fails its own call,
+ * but any other failure fails every call that is still waiting for a reply
+ * and resets the connection.
+ */
 class scribeConn {
  public:
-  scribeConn(const std::string& host, unsigned long port, int timeout);
-  scribeConn(const std::string &service, const server_vector_t &servers, int timeout);
+  // compressionLevel is a zlib level (1-9), or 0 to send uncompressed
+  scribeConn(const std::string& host, unsigned long port, int timeout,
+             unsigned long pipelineWindow = 1,
+             unsigned long pipelineBatchSize = 0,
+             int compressionLevel = 0);
+  scribeConn(const std::string &service, const server_vector_t &servers,
+             int timeout, unsigned long pipelineWindow = 1,
+             unsigned long pipelineBatchSize = 0,
+             int compressionLevel = 0);
   virtual ~scribeConn();
   
   void addRef();
@@ -41,39 +67,87 @@ class scribeConn {
   bool open();
   void close();    
   bool send(boost::shared_ptr<logentry_vector_t> messages);
+  // opens the connection again if it is closed, returns whether it's open
+  bool reopen();
+  // Must hold the pool's mapMutex. True at most once every interval
+  // seconds while the connection is closed, to pick who retries it.
+  bool claimRetry(time_t now, time_t interval);
+
+  unsigned long getLoad();  // number of sends in progress
+  void setRandomizeServers(bool randomize);
 
  private:
   std::string connectionString();
+  bool sendLog(const logentry_vector_t& messages,
+               unsigned long begin, unsigned long end);
+  void waitForReply(bool haveWriteLock);
+  void breakConnection();
+  void resetConnection();
+  void updateSendCounts(const logentry_vector_t& messages,
+                        unsigned long begin, unsigned long end,
+                        scribe::thrift::ResultCode result);
   
  protected:
   boost::shared_ptr<apache::thrift::transport::TSocket> socket;
   boost::shared_ptr<apache::thrift::transport::TFramedTransport> framedTransport;
+  // framedTransport, or a compressing transport on top of it
+  boost::shared_ptr<apache::thrift::transport::TTransport> protocolTransport;
   boost::shared_ptr<apache::thrift::protocol::TBinaryProtocol> protocol;
   boost::shared_ptr<scribe::thrift::scribeClient> resendClient;
 
   unsigned refCount;
+  time_t lastRetry; // protected by the pool's mapMutex, like refCount
     
   bool smcBased;
   std::string smcService;
   server_vector_t serverList;
+  bool randomizeServers;
   std::string remoteHost;
   unsigned long remotePort;
   int timeout; // connection, send, and recv timeout
+  unsigned long pipelineWindow;    // max calls waiting for a reply
+  unsigned long pipelineBatchSize; // max messages per call, 0 for no limit
+  int compressionLevel;            // 0 for no compression
+  bool connected;
+  volatile unsigned long activeSends;
+  unsigned long sendStatId;        // for g_latencyStats
+
+  // Lock ordering: mutex before stateMutex.
+  // mutex serializes writing calls and opening/closing the connection.
+  // stateMutex protects everything below it.
   pthread_mutex_t mutex;
+  pthread_mutex_t stateMutex;
+  pthread_cond_t stateCond;
+  std::deque<pending_call_ptr_t> pendingCalls; // in the order written
+  bool reading; // a thread is reading a reply
+  bool broken;  // connection must be reset before it is used again
+  bool tryLater; // last reply wasn't OK, write one call at a time
   time_t lastHeartbeat;
   std::map<std::string, int> sendCounts; // Periodically logged for diagnostics
 };
 
-// key is hostname:port
-typedef std::map<std::string, boost::shared_ptr<scribeConn> > conn_map_t;
+typedef std::vector<boost::shared_ptr<scribeConn> > conn_list_t;
+
+// key is hostname:port or service
+typedef std::map<std::string, conn_list_t> conn_map_t;
 
 class ConnPool {
  public:
   ConnPool();
   virtual ~ConnPool();
 
-  bool open(const std::string& host, unsigned long port, int timeout);
-  bool open(const std::string &service, const server_vector_t &servers, int timeout);
+  // poolSize is the number of connections to keep for this key. It and the
+  // other connection settings only have an effect on the first open of a key.
+  bool open(const std::string& host, unsigned long port, int timeout,
+            unsigned long pipelineWindow = 1,
+            unsigned long pipelineBatchSize = 0,
+            unsigned long poolSize = 1,
+            int compressionLevel = 0);
+  bool open(const std::string &service, const server_vector_t &servers,
+            int timeout, unsigned long pipelineWindow = 1,
+            unsigned long pipelineBatchSize = 0,
+            unsigned long poolSize = 1,
+            int compressionLevel = 0);
 
   void close(const std::string& host, unsigned long port);
   void close(const std::string &service);
@@ -84,7 +158,9 @@ class ConnPool {
             boost::shared_ptr<logentry_vector_t> messages);
   
  private:
-  bool openCommon(const std::string &key, boost::shared_ptr<scribeConn> conn);
+  bool openCommon(const std::string &key, const conn_list_t& conns);
+  boost::shared_ptr<scribeConn> pickConn(const conn_list_t& conns,
+                                         boost::shared_ptr<scribeConn>& retry);
   void closeCommon(const std::string &key);
   bool sendCommon(const std::string &key,
                   boost::shared_ptr<logentry_vector_t> messages);
@@ -94,6 +170,7 @@ class ConnPool {
 
   pthread_mutex_t mapMutex;
   conn_map_t connMap;
+  unsigned long nextConn; // spreads sends across equally busy connections
 };
 
 #endif // !defined SCRIBE_CONN_POOL_H
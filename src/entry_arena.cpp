@@ -0,0 +1,39 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "entry_arena.h"
+
+using namespace std;
+using namespace scribe::thrift;
+
+LogEntryArena::LogEntryArena(size_t expected)
+  : used(0),
+    nextSize(expected ? min(expected, (size_t)ENTRY_ARENA_MAX_SLAB)
+                      : ENTRY_ARENA_MIN_SLAB) {
+}
+
+logentry_ptr_t LogEntryArena::allocate() {
+  if (!slab || used == slab->size()) {
+    slab = boost::shared_ptr<slab_t>(new slab_t(nextSize));
+    used = 0;
+    // batches bigger than expected get bigger slabs
+    nextSize = min(nextSize * 2, (size_t)ENTRY_ARENA_MAX_SLAB);
+  }
+  // shares slab's reference count
+  return logentry_ptr_t(slab, &(*slab)[used++]);
+}
@@ -0,0 +1,64 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_ENTRY_ARENA_H
+#define SCRIBE_ENTRY_ARENA_H
+
+#include "common.h"
+
+// bounds on how many entries are allocated at once
+#define ENTRY_ARENA_MIN_SLAB 16
+#define ENTRY_ARENA_MAX_SLAB 512
+
+/*
+ * Allocates LogEntry objects for a batch of messages in slabs.
+ *
+ * Each slab holds many entries. The entries it hands out share the
+ * slab's reference count instead of having their own, so a batch needs
+ * one allocation per slab rather than a LogEntry and a shared_ptr
+ * control block per message. A slab is freed all at once, when the last
+ * store lets go of the last entry in it. One entry held onto for a long
+ * time (e.g. a failed message being retried) keeps its whole slab
+ * around, so slabs are kept small.
+ *
+ * Use an arena per destination (category, bucket): entries from one slab
+ * that go to different queues would keep each other alive, and that
+ * memory isn't counted against either queue.
+ *
+ * The arena itself is only needed while allocating; entries stay valid
+ * after it's gone. Not thread safe.
+ */
+class LogEntryArena {
+ public:
+  // expected is how many entries the batch will probably need, 0 if unknown
+  explicit LogEntryArena(size_t expected = 0);
+
+  logentry_ptr_t allocate();
+
+ private:
+  typedef std::vector<scribe::thrift::LogEntry> slab_t;
+
+  boost::shared_ptr<slab_t> slab;
+  size_t used;     // entries handed out from slab
+  size_t nextSize; // size of the next slab
+
+  // disallow copy and assignment
+  LogEntryArena(const LogEntryArena& rhs);
+  const LogEntryArena& operator=(const LogEntryArena& rhs);
+};
+
+#endif // !defined SCRIBE_ENTRY_ARENA_H
@@ -98,6 +98,20 @@ class strhash {
     }
     return hash;
   }
+
+  // Same hash of at most length bytes of s, so callers can hash part of a
+  // buffer without copying it. Stops at a NUL just like hash32(s).
+  static uint32_t hash32(const char *s, size_t length) {
+    if (s == NULL) {
+      return 0;
+    }
+    uint32_t hash = 5381;
+    int c;
+    for (const char* end = s + length; s < end && (c = *s); ++s) {
+      hash = ((hash << 5) + hash) + c; // hash * 33 + c
+    }
+    return hash;
+  }
 };
 
 #endif // SCRIBE_ENV
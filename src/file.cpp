@@ -22,6 +22,8 @@
 #include "common.h"
 #include "file.h"
 #include "HdfsFile.h"
+#include "AsyncFile.h"
+#include "group_commit.h"
 
 // INITIAL_BUFFER_SIZE must always be >= UINT_SIZE
 #define INITIAL_BUFFER_SIZE 4096
@@ -35,6 +37,8 @@ boost::shared_ptr<FileInterface> FileInterface::createFileInterface(const std::s
                                                                     bool framed) {
   if (0 == type.compare("std")) {
     return shared_ptr<FileInterface>(new StdFile(name, framed));
+  } else if (0 == type.compare("async")) {
+    return shared_ptr<FileInterface>(new AsyncFile(name, framed));
   } else if (0 == type.compare("hdfs")) {
     return shared_ptr<FileInterface>(new HdfsFile(name));
   } else {
@@ -63,11 +67,28 @@ void FileInterface::setShouldLZOCompress(int compressionLevel) {
   LZOCompressionLevel = compressionLevel;
 }
 
+bool FileInterface::writev(const struct iovec* iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+
+  string data;
+  data.reserve(total);
+  for (int i = 0; i < iovcnt; ++i) {
+    data.append((const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+  return write(data);
+}
+
 StdFile::StdFile(const std::string& name, bool frame)
-  : FileInterface(name, frame), inputBuffer(NULL), bufferSize(0) {
+  : FileInterface(name, frame), fd(-1), inputBuffer(NULL),
+    bufferSize(0), eagerWriteback(false), writebackOffset(0),
+    preallocated(false), mapping(NULL), mappingSize(0), mappingOffset(0) {
 }
 
 StdFile::~StdFile() {
+  close();
   if (inputBuffer) {
     delete[] inputBuffer;
     inputBuffer = NULL;
@@ -75,9 +96,50 @@ StdFile::~StdFile() {
 }
 
 bool StdFile::openRead() {
+  if (framed && openMapped()) {
+    return true;
+  }
   return open(fstream::in);
 }
 
+// Maps the whole file so that readNext() copies each record straight out of
+// the page cache. Returns false (and leaves the file closed) if the file
+// can't be mapped, in which case we fall back to reading with an fstream.
+bool StdFile::openMapped() {
+
+  if (isOpen()) {
+    return false;
+  }
+
+  int map_fd = ::open(filename.c_str(), O_RDONLY);
+  if (map_fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(map_fd, &st) != 0 || st.st_size <= 0) {
+    ::close(map_fd);
+    return false;
+  }
+
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, map_fd, 0);
+  // the mapping stays valid after the fd is closed
+  ::close(map_fd);
+  if (addr == MAP_FAILED) {
+    LOG_OPER("Failed to map file <%s>: %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  // records are read once, front to back
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  madvise(addr, st.st_size, MADV_WILLNEED);
+
+  mapping = (char*)addr;
+  mappingSize = st.st_size;
+  mappingOffset = 0;
+  return true;
+}
+
 bool StdFile::openWrite() {
   /* try to create the directory containing the file */
   string::size_type slash;
@@ -93,19 +155,17 @@ bool StdFile::openWrite() {
   }
 
   // open file for write in append mode
-  ios_base::openmode mode = fstream::out | fstream::app;
-  return open(mode);
+  return openFd(O_WRONLY | O_CREAT | O_APPEND);
 }
 
 bool StdFile::openTruncate() {
   // open an existing file for write and truncate its contents
-  ios_base::openmode mode = fstream::out | fstream::app | fstream::trunc;
-  return open(mode);
+  return openFd(O_WRONLY | O_CREAT | O_APPEND | O_TRUNC);
 }
 
 bool StdFile::open(ios_base::openmode mode) {
 
-  if (file.is_open()) {
+  if (isOpen()) {
     return false;
   }
 
@@ -114,14 +174,55 @@ bool StdFile::open(ios_base::openmode mode) {
   return file.good();
 }
 
+// Writes bypass iostreams and go straight to the fd so that
+// writev() can hand the kernel the caller's buffers without copying.
+bool StdFile::openFd(int flags) {
+
+  if (isOpen()) {
+    return false;
+  }
+
+  fd = ::open(filename.c_str(), flags, 0666);
+  if (fd < 0) {
+    LOG_OPER("Failed to open file <%s> for write: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    writebackOffset = st.st_size;
+  }
+  return true;
+}
+
 bool StdFile::isOpen() {
-  return file.is_open();
+  return file.is_open() || fd >= 0 || mapping != NULL;
 }
 
 void StdFile::close() {
   if (file.is_open()) {
     file.close();
   }
+  if (mapping) {
+    munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+    mappingOffset = 0;
+  }
+  if (fd >= 0) {
+    if (preallocated) {
+      // give back whatever we reserved and didn't use
+      struct stat st;
+      if (fstat(fd, &st) == 0 && ftruncate(fd, st.st_size) != 0) {
+        LOG_OPER("Failed to release preallocated space for file <%s>: %s",
+                 filename.c_str(), strerror(errno));
+      }
+      preallocated = false;
+    }
+    ::close(fd);
+    fd = -1;
+  }
 }
 
 string StdFile::getFrame(unsigned data_length) {
@@ -137,26 +238,103 @@ string StdFile::getFrame(unsigned data_length) {
 }
 
 bool StdFile::write(const std::string& data) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data.data());
+  iov.iov_len = data.length();
+  return writev(&iov, 1);
+}
 
-  if (!file.is_open()) {
+bool StdFile::writev(const struct iovec* iov, int iovcnt) {
+
+  if (fd < 0) {
     return false;
   }
 
-  file << data;
-  if (file.bad()) {
-    return false;
+  return writeAll(iov, iovcnt);
+}
+
+bool StdFile::writeAll(const struct iovec* iov, int iovcnt) {
+  // writev may write less than asked for and takes at most IOV_MAX
+  // buffers at a time, so work from a copy we can advance
+  vector<struct iovec> pending(iov, iov + iovcnt);
+  size_t next = 0;
+
+  while (next < pending.size()) {
+    int count = min(pending.size() - next, (size_t)IOV_MAX);
+    ssize_t written = ::writev(fd, &pending[next], count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_OPER("Failed to write to file <%s>: %s",
+               filename.c_str(), strerror(errno));
+      return false;
+    }
+
+    // skip past everything that was written
+    while (next < pending.size() &&
+           (size_t)written >= pending[next].iov_len) {
+      written -= pending[next].iov_len;
+      ++next;
+    }
+    if (written > 0) {
+      pending[next].iov_base = (char*)pending[next].iov_base + written;
+      pending[next].iov_len -= written;
+    }
+  }
+
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (eagerWriteback) {
+    // we append, so everything new is between the last write and the end
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    if (end > writebackOffset) {
+      sync_file_range(fd, writebackOffset, end - writebackOffset,
+                      SYNC_FILE_RANGE_WRITE);
+      writebackOffset = end;
+    }
   }
+#endif
   return true;
 }
 
 void StdFile::flush() {
+  // writes go directly to the fd, so there is nothing buffered here
   if (file.is_open()) {
     file.flush();
   }
 }
 
+bool StdFile::sync() {
+  if (fd < 0) {
+    return false;
+  }
+  return g_groupCommitter.sync(fd);
+}
+
+void StdFile::preallocate(unsigned long size) {
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (fd < 0) {
+    return;
+  }
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+    preallocated = true;
+  } else if (errno != EOPNOTSUPP) {
+    LOG_OPER("Failed to preallocate <%lu> bytes for file <%s>: %s",
+             size, filename.c_str(), strerror(errno));
+  }
+#endif
+}
+
+void StdFile::setEagerWriteback(bool eager) {
+  eagerWriteback = eager;
+}
+
 bool StdFile::readNext(std::string& _return) {
 
+  if (mapping) {
+    return readNextMapped(_return);
+  }
+
   if (!inputBuffer) {
     bufferSize = INITIAL_BUFFER_SIZE;
     inputBuffer = new char[bufferSize];
@@ -201,6 +379,61 @@ bool StdFile::readNext(std::string& _return) {
   return false;
 }
 
+bool StdFile::readNextMapped(std::string& _return) {
+  size_t remaining = mappingSize - mappingOffset;
+  if (remaining < UINT_SIZE) {
+    return false;
+  }
+
+  unsigned size = unserializeUInt(mapping + mappingOffset);
+  if (!size) {
+    return false;
+  }
+
+  if (size > remaining - UINT_SIZE) {
+    LOG_OPER("ERROR: Failed to read file %s at offset %lu",
+             filename.c_str(), (unsigned long)mappingOffset);
+    return false;
+  }
+
+  _return.assign(mapping + mappingOffset + UINT_SIZE, size);
+  mappingOffset += UINT_SIZE + size;
+  return true;
+}
+
+bool StdFile::seekRead(unsigned long offset) {
+  if (mapping) {
+    if (offset > mappingSize) {
+      return false;
+    }
+    mappingOffset = offset;
+    return true;
+  }
+
+  if (!file.is_open()) {
+    return false;
+  }
+  file.seekg(offset);
+  return file.good();
+}
+
+bool StdFile::readOffset(unsigned long& offset) {
+  if (mapping) {
+    offset = mappingOffset;
+    return true;
+  }
+
+  if (!file.is_open()) {
+    return false;
+  }
+  streampos pos = file.tellg();
+  if (pos < 0) {
+    return false;
+  }
+  offset = pos;
+  return true;
+}
+
 unsigned long StdFile::fileSize() {
   unsigned long size = 0;
   try {
@@ -40,9 +40,29 @@ class FileInterface {
   virtual bool isOpen() = 0;
   virtual void close() = 0;
   virtual bool write(const std::string& data) = 0;
+  // gathers iovcnt buffers into one write. The default implementation
+  // concatenates them and calls write(). Implementations may complete the
+  // write in the background, so the buffers (but not the iovec array) must
+  // stay valid until waitForWrites() returns.
+  virtual bool writev(const struct iovec* iov, int iovcnt);
+  // blocks until all previous writes have completed, returns false if any
+  // of them failed
+  virtual bool waitForWrites() {return true;};
   virtual void flush() = 0;
+  // makes everything written so far durable, returns false on failure
+  virtual bool sync() {return true;};
+  // reserves disk space for the file to grow to size bytes, without
+  // changing its size
+  virtual void preallocate(unsigned long size) {};
+  // starts writeback of each write as soon as it's made, so that a later
+  // sync() has less left to do
+  virtual void setEagerWriteback(bool eager) {};
   virtual unsigned long fileSize() = 0;
   virtual bool readNext(std::string& _return) = 0; // returns a line if unframed or a record if framed
+  // resume reading at a byte offset previously returned by readOffset().
+  // Files that can't seek only support offset 0.
+  virtual bool seekRead(unsigned long offset) {return offset == 0;};
+  virtual bool readOffset(unsigned long& offset) {return false;};
   virtual void deleteFile() = 0;
   virtual void listImpl(const std::string& path, std::vector<std::string>& _return) = 0;
   virtual std::string getFrame(unsigned data_size) {return std::string();};
@@ -70,21 +90,44 @@ class StdFile : public FileInterface {
   bool isOpen();
   void close();
   bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
   void flush();
+  bool sync();
+  void preallocate(unsigned long size);
+  void setEagerWriteback(bool eager);
   unsigned long fileSize();
   bool readNext(std::string& _return);
+  bool seekRead(unsigned long offset);
+  bool readOffset(unsigned long& offset);
   void deleteFile();
   void listImpl(const std::string& path, std::vector<std::string>& _return);
   std::string getFrame(unsigned data_size);
   bool createDirectory(std::string path);
   bool createSymlink(std::string newpath, std::string oldpath);
 
+ protected:
+  bool writeAll(const struct iovec* iov, int iovcnt);
+
+  int fd;            // used for writing, -1 if not open
+
  private:
   bool open(std::ios_base::openmode mode);
+  bool openFd(int flags);
+  bool openMapped();
+  bool readNextMapped(std::string& _return);
 
   char* inputBuffer;
   unsigned bufferSize;
-  std::fstream file;
+  std::fstream file; // used for reading
+
+  bool eagerWriteback;
+  off_t writebackOffset; // writeback has been started up to here
+  bool preallocated;     // space may be allocated past the end of file
+
+  // framed files are read through a read-only mapping when possible
+  char* mapping;
+  size_t mappingSize;
+  size_t mappingOffset;
 
   // disallow copy, assignment, and empty construction
   StdFile();
@@ -0,0 +1,90 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "group_commit.h"
+
+using namespace std;
+
+GroupCommitter g_groupCommitter;
+
+GroupCommitter::GroupCommitter() {
+  pthread_mutex_init(&mutex, NULL);
+}
+
+GroupCommitter::~GroupCommitter() {
+}
+
+bool GroupCommitter::sync(int fd) {
+  pthread_mutex_lock(&mutex);
+
+  File* file;
+  map<int, File*>::iterator iter = files.find(fd);
+  if (iter == files.end()) {
+    file = new File;
+    pthread_cond_init(&file->done, NULL);
+    file->syncing = false;
+    file->waiters = 0;
+    file->started = 0;
+    file->finished = 0;
+    file->lastFailed = 0;
+    files[fd] = file;
+  } else {
+    file = iter->second;
+  }
+  ++file->waiters;
+
+  // a sync already running may have started before our write, so we need
+  // the one after it
+  unsigned long needed = file->started + 1;
+  while (file->finished < needed) {
+    if (file->syncing) {
+      pthread_cond_wait(&file->done, &mutex);
+      continue;
+    }
+
+    // nobody is syncing this file, so sync it for everyone waiting
+    file->syncing = true;
+    ++file->started;
+    pthread_mutex_unlock(&mutex);
+
+    bool success = (fdatasync(fd) == 0);
+    if (!success) {
+      LOG_OPER("Failed to sync fd <%d>: %s", fd, strerror(errno));
+    }
+
+    pthread_mutex_lock(&mutex);
+    ++file->finished;
+    if (!success) {
+      file->lastFailed = file->finished;
+    }
+    file->syncing = false;
+    pthread_cond_broadcast(&file->done);
+  }
+  // a later sync may have finished too, and one that failed might have
+  // lost our writes even if ours succeeded
+  bool success = file->lastFailed < needed;
+
+  if (--file->waiters == 0) {
+    files.erase(fd);
+    pthread_cond_destroy(&file->done);
+    delete file;
+  }
+
+  pthread_mutex_unlock(&mutex);
+  return success;
+}
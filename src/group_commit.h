@@ -0,0 +1,65 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_GROUP_COMMIT_H
+#define SCRIBE_GROUP_COMMIT_H
+
+#include <map>
+#include <pthread.h>
+
+/*
+ * Coalesces fdatasync calls from many threads.
+ *
+ * Callers of sync() for the same file are grouped: the first one in runs
+ * fdatasync while the rest wait, and callers that arrive during a sync are
+ * handled together by the next one. Different files sync in parallel, each
+ * from its own caller, so one slow file never holds up the others and the
+ * filesystem can batch concurrent syncs into a single journal commit.
+ * Syncing every file on a device from one thread would serialize them
+ * behind each other instead.
+ *
+ * A caller returns once a sync of its file that started after it called
+ * has completed, and gets false if that sync or a later one failed.
+ */
+class GroupCommitter {
+ public:
+  GroupCommitter();
+  ~GroupCommitter();
+
+  bool sync(int fd);
+
+ private:
+  struct File {
+    pthread_cond_t done;      // signaled when a sync finishes
+    bool syncing;
+    unsigned long waiters;    // callers using this entry
+    unsigned long started;    // number of syncs started
+    unsigned long finished;
+    unsigned long lastFailed; // number of the last failed sync, or 0
+  };
+
+  pthread_mutex_t mutex; // Must be held to read/modify everything
+  std::map<int, File*> files; // by fd, removed once nobody is waiting
+
+  // disallow copy and assignment
+  GroupCommitter(const GroupCommitter& rhs);
+  const GroupCommitter& operator=(const GroupCommitter& rhs);
+};
+
+extern GroupCommitter g_groupCommitter;
+
+#endif // !defined SCRIBE_GROUP_COMMIT_H
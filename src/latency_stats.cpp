@@ -0,0 +1,233 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "scribe_server.h"
+#include "latency_stats.h"
+
+using namespace std;
+
+LatencyStats g_latencyStats;
+
+static __thread void* threadStats = NULL;
+
+static unsigned bucketIndex(unsigned long long usec) {
+  if (usec < 4) {
+    return usec;
+  }
+  unsigned msb = 63 - __builtin_clzll(usec);
+  unsigned index = 4 * (msb - 1) + ((usec >> (msb - 2)) & 3);
+  return min(index, (unsigned)LATENCY_HISTOGRAM_BUCKETS - 1);
+}
+
+// largest value that goes in bucket index
+static unsigned long long bucketLimit(unsigned index) {
+  if (index < 4) {
+    return index;
+  }
+  unsigned msb = index / 4 + 1;
+  unsigned long long sub = index % 4;
+  return ((4 + sub + 1) << (msb - 2)) - 1;
+}
+
+static void* exportStatic(void* arg) {
+  ((LatencyStats*)arg)->exportMember();
+  return NULL;
+}
+
+LatencyHistogram::LatencyHistogram() {
+  clear();
+}
+
+void LatencyHistogram::add(unsigned long long usec) {
+  ++buckets[bucketIndex(usec)];
+  ++count;
+  sum += usec;
+  if (usec > max) {
+    max = usec;
+  }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (unsigned i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+    buckets[i] += other.buckets[i];
+  }
+  count += other.count;
+  sum += other.sum;
+  if (other.max > max) {
+    max = other.max;
+  }
+}
+
+void LatencyHistogram::clear() {
+  memset(buckets, 0, sizeof(buckets));
+  count = 0;
+  sum = 0;
+  max = 0;
+}
+
+unsigned long long LatencyHistogram::getPercentile(double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  unsigned long long rank = (unsigned long long)(count * percentile / 100);
+  unsigned long long seen = 0;
+  for (unsigned i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+    seen += buckets[i];
+    if (seen > rank) {
+      return std::min(bucketLimit(i), max);
+    }
+  }
+  return max;
+}
+
+LatencyStats::LatencyStats()
+  : enabled(false),
+    interval(0) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_key_create(&threadKey, threadExit);
+}
+
+bool LatencyStats::start(unsigned long new_interval) {
+  pthread_mutex_lock(&mutex);
+  if (enabled || new_interval == 0) {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  interval = new_interval;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  bool success = pthread_create(&thread, &attr, exportStatic, this) == 0;
+  pthread_attr_destroy(&attr);
+  if (success) {
+    enabled = true;
+  } else {
+    LOG_OPER("ERROR: failed to start latency stats thread");
+  }
+  pthread_mutex_unlock(&mutex);
+  return success;
+}
+
+unsigned long LatencyStats::getId(const std::string& name) {
+  pthread_mutex_lock(&mutex);
+  map<string, unsigned long>::iterator iter = ids.find(name);
+  unsigned long id;
+  if (iter != ids.end()) {
+    id = iter->second;
+  } else {
+    id = names.size();
+    ids[name] = id;
+    names.push_back(name);
+  }
+  pthread_mutex_unlock(&mutex);
+  return id;
+}
+
+void LatencyStats::record(unsigned long id, unsigned long long usec) {
+  if (!enabled) {
+    return;
+  }
+
+  ThreadStats* stats = getThreadStats();
+  pthread_mutex_lock(&stats->mutex);
+  stats->histograms[id].add(usec);
+  pthread_mutex_unlock(&stats->mutex);
+}
+
+LatencyStats::ThreadStats* LatencyStats::getThreadStats() {
+  if (threadStats) {
+    return (ThreadStats*)threadStats;
+  }
+
+  ThreadStats* stats = new ThreadStats;
+  pthread_mutex_init(&stats->mutex, NULL);
+  pthread_mutex_lock(&mutex);
+  threads.insert(stats);
+  pthread_mutex_unlock(&mutex);
+
+  threadStats = stats;
+  pthread_setspecific(threadKey, stats);
+  return stats;
+}
+
+// Keeps what an exiting thread recorded for the next export
+void LatencyStats::threadExit(void* arg) {
+  ThreadStats* stats = (ThreadStats*)arg;
+  LatencyStats& self = g_latencyStats;
+
+  pthread_mutex_lock(&self.mutex);
+  self.threads.erase(stats);
+  mergeAll(self.retired, stats->histograms);
+  pthread_mutex_unlock(&self.mutex);
+
+  pthread_mutex_destroy(&stats->mutex);
+  delete stats;
+}
+
+void LatencyStats::exportMember() {
+  while (true) {
+    sleep(interval);
+    exportStats();
+  }
+}
+
+void LatencyStats::mergeAll(histogram_map_t& totals,
+                            const histogram_map_t& from) {
+  for (histogram_map_t::const_iterator iter = from.begin();
+       iter != from.end();
+       ++iter) {
+    totals[iter->first].merge(iter->second);
+  }
+}
+
+void LatencyStats::exportStats() {
+  histogram_map_t totals;
+  vector<string> export_names;
+
+  pthread_mutex_lock(&mutex);
+  totals.swap(retired);
+  for (set<ThreadStats*>::iterator iter = threads.begin();
+       iter != threads.end();
+       ++iter) {
+    ThreadStats* stats = *iter;
+    histogram_map_t histograms;
+    pthread_mutex_lock(&stats->mutex);
+    histograms.swap(stats->histograms);
+    pthread_mutex_unlock(&stats->mutex);
+    mergeAll(totals, histograms);
+  }
+  export_names = names;
+  pthread_mutex_unlock(&mutex);
+
+  // everything gets set each interval, so idle paths go back to 0
+  const LatencyHistogram empty;
+  for (unsigned long i = 0; i < export_names.size(); ++i) {
+    const string& name = export_names[i];
+    histogram_map_t::const_iterator found = totals.find(i);
+    const LatencyHistogram& histogram =
+      found != totals.end() ? found->second : empty;
+    setCounter(name + " count", histogram.getCount());
+    setCounter(name + " avg", histogram.getAverage());
+    setCounter(name + " p50", histogram.getPercentile(50));
+    setCounter(name + " p90", histogram.getPercentile(90));
+    setCounter(name + " p99", histogram.getPercentile(99));
+    setCounter(name + " max", histogram.getMax());
+  }
+}
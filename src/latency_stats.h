@@ -0,0 +1,123 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_LATENCY_STATS_H
+#define SCRIBE_LATENCY_STATS_H
+
+#include "common.h"
+
+// 4 buckets per power of two, up to about 2^40 microseconds
+#define LATENCY_HISTOGRAM_BUCKETS 160
+
+// monotonic time in microseconds, for measuring how long things take
+inline unsigned long long currentTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Histogram of latencies in microseconds, with buckets spaced
+ * logarithmically so percentiles are accurate to within about 20%.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void add(unsigned long long usec);
+  void merge(const LatencyHistogram& other);
+  void clear();
+
+  unsigned long long getCount() const {return count;}
+  unsigned long long getAverage() const {return count ? sum / count : 0;}
+  unsigned long long getMax() const {return max;}
+  // upper end of the bucket the percentile falls in, 0 if empty
+  unsigned long long getPercentile(double percentile) const;
+
+ private:
+  unsigned long long buckets[LATENCY_HISTOGRAM_BUCKETS];
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+};
+
+/*
+ * Latency histograms for the hot paths, exported as fb303 counters.
+ *
+ * Each thread records into its own histograms, so recording never waits
+ * on another thread doing the same. A thread only has histograms for the
+ * ids it recorded since the last export, since there is an id per
+ * category. Every interval seconds a background thread merges and drops
+ * them, then publishes the count, average,
+ * p50/p90/p99 and max for the interval as "<name> count", "<name> p99"
+ * and so on.
+ *
+ * Recording does nothing until start() has been called, and callers
+ * should check isEnabled() before timing anything.
+ */
+class LatencyStats {
+ public:
+  LatencyStats();
+
+  // Starts exporting. The interval can't be changed once running.
+  bool start(unsigned long interval);
+  bool isEnabled() const {return enabled;}
+
+  // Id to record name's latencies with. Safe to call from any thread.
+  unsigned long getId(const std::string& name);
+
+  // Safe to call from any thread
+  void record(unsigned long id, unsigned long long usec);
+
+  // these need to be public for the thread to get to them,
+  // but no one else should ever call them
+  void exportMember();
+  static void threadExit(void* arg);
+
+ private:
+  typedef boost::unordered_map<unsigned long, LatencyHistogram>
+    histogram_map_t;
+
+  struct ThreadStats {
+    pthread_mutex_t mutex; // only contended while being merged
+    histogram_map_t histograms; // by id
+  };
+
+  static void mergeAll(histogram_map_t& totals, const histogram_map_t& from);
+
+  ThreadStats* getThreadStats();
+  void exportStats();
+
+  volatile bool enabled;
+  unsigned long interval; // seconds
+
+  pthread_mutex_t mutex; // protects everything below
+  std::map<std::string, unsigned long> ids;
+  std::vector<std::string> names; // by id
+  std::set<ThreadStats*> threads;
+  histogram_map_t retired; // from threads that have exited
+
+  pthread_key_t threadKey; // so exiting threads hand in their stats
+
+  // disallow copy and assignment
+  LatencyStats(const LatencyStats& rhs);
+  const LatencyStats& operator=(const LatencyStats& rhs);
+};
+
+extern LatencyStats g_latencyStats;
+
+#endif // !defined SCRIBE_LATENCY_STATS_H
@@ -0,0 +1,135 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "parallel_dispatcher.h"
+
+using namespace std;
+
+static void* dispatcherStatic(void* arg) {
+  ((ParallelDispatcher*)arg)->workerMember();
+  return NULL;
+}
+
+ParallelDispatcher::ParallelDispatcher()
+  : job(NULL),
+    numTasks(0),
+    nextTask(0),
+    tasksDone(0),
+    stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&workCond, NULL);
+  pthread_cond_init(&doneCond, NULL);
+}
+
+ParallelDispatcher::~ParallelDispatcher() {
+  stop();
+  pthread_cond_destroy(&doneCond);
+  pthread_cond_destroy(&workCond);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool ParallelDispatcher::start(unsigned long num_threads) {
+  stop();
+
+  pthread_mutex_lock(&mutex);
+  stopping = false;
+  pthread_mutex_unlock(&mutex);
+
+  for (unsigned long i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dispatcherStatic, (void*)this) != 0) {
+      LOG_OPER("ERROR: failed to start dispatch thread");
+      return false;
+    }
+    threads.push_back(thread);
+  }
+  return true;
+}
+
+void ParallelDispatcher::stop() {
+  if (threads.empty()) {
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&workCond);
+  pthread_mutex_unlock(&mutex);
+
+  for (vector<pthread_t>::iterator iter = threads.begin();
+       iter != threads.end();
+       ++iter) {
+    pthread_join(*iter, NULL);
+  }
+  threads.clear();
+}
+
+void ParallelDispatcher::run(DispatchJob* new_job, unsigned long num_tasks) {
+  if (threads.empty()) {
+    for (unsigned long i = 0; i < num_tasks; ++i) {
+      new_job->runTask(i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  job = new_job;
+  numTasks = num_tasks;
+  nextTask = 0;
+  tasksDone = 0;
+  pthread_cond_broadcast(&workCond);
+
+  // help out rather than sit idle
+  while (nextTask < numTasks) {
+    unsigned long index = nextTask++;
+    pthread_mutex_unlock(&mutex);
+    new_job->runTask(index);
+    pthread_mutex_lock(&mutex);
+    ++tasksDone;
+  }
+
+  while (tasksDone < numTasks) {
+    pthread_cond_wait(&doneCond, &mutex);
+  }
+  job = NULL;
+  pthread_mutex_unlock(&mutex);
+}
+
+void ParallelDispatcher::workerMember() {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    while (!stopping && (job == NULL || nextTask >= numTasks)) {
+      pthread_cond_wait(&workCond, &mutex);
+    }
+    if (stopping) {
+      break;
+    }
+
+    unsigned long index = nextTask++;
+    DispatchJob* current_job = job;
+    pthread_mutex_unlock(&mutex);
+
+    current_job->runTask(index);
+
+    pthread_mutex_lock(&mutex);
+    if (++tasksDone == numTasks) {
+      pthread_cond_signal(&doneCond);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+}
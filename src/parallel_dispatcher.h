@@ -0,0 +1,73 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_PARALLEL_DISPATCHER_H
+#define SCRIBE_PARALLEL_DISPATCHER_H
+
+#include <vector>
+#include <pthread.h>
+
+// A set of independent tasks, numbered from 0
+class DispatchJob {
+ public:
+  virtual ~DispatchJob() {}
+  virtual void runTask(unsigned long index) = 0;
+};
+
+/*
+ * Small thread pool owned by a single store, for running a job's tasks
+ * concurrently.
+ *
+ * run() hands the tasks out to the workers and also works on them itself,
+ * then returns once every task has finished. Only one job runs at a time,
+ * so the owner must not call run() from more than one thread at once.
+ * With no threads started, run() just runs the tasks in order.
+ */
+class ParallelDispatcher {
+ public:
+  ParallelDispatcher();
+  ~ParallelDispatcher();
+
+  // num_threads is in addition to the thread calling run()
+  bool start(unsigned long num_threads);
+  void stop();
+  bool isRunning() {return !threads.empty();}
+
+  void run(DispatchJob* job, unsigned long num_tasks);
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void workerMember();
+
+ private:
+  pthread_mutex_t mutex;     // Must be held to read/modify everything below
+  pthread_cond_t workCond;   // signaled when there are tasks or on stop
+  pthread_cond_t doneCond;   // signaled when the last task finishes
+
+  std::vector<pthread_t> threads;
+  DispatchJob* job;          // NULL between runs
+  unsigned long numTasks;
+  unsigned long nextTask;
+  unsigned long tasksDone;
+  bool stopping;
+
+  // disallow copy and assignment
+  ParallelDispatcher(const ParallelDispatcher& rhs);
+  const ParallelDispatcher& operator=(const ParallelDispatcher& rhs);
+};
+
+#endif // !defined SCRIBE_PARALLEL_DISPATCHER_H
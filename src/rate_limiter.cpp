@@ -0,0 +1,127 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "rate_limiter.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// how far ahead of now the arrival time may get, i.e. the bucket size
+#define TOKEN_BUCKET_TOLERANCE NSEC_PER_SEC
+
+// monotonic, so stepping the wall clock doesn't stall or burst the bucket
+static unsigned long long nowNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * NSEC_PER_SEC +
+         (unsigned long long)ts.tv_nsec;
+}
+
+TokenBucket::TokenBucket()
+  : interval(0),
+    arrival(0) {
+}
+
+void TokenBucket::setRate(unsigned long long per_second) {
+  if (per_second == 0) {
+    interval = 0;
+  } else {
+    // anything faster than a unit per nanosecond isn't worth limiting
+    interval = NSEC_PER_SEC / per_second;
+  }
+}
+
+unsigned long long TokenBucket::getIncrement(unsigned long long cost) {
+  unsigned long long iv = interval;
+  if (iv == 0) {
+    return 0;
+  }
+  // an oversized request takes the whole bucket
+  if (cost >= TOKEN_BUCKET_TOLERANCE / iv) {
+    return TOKEN_BUCKET_TOLERANCE;
+  }
+  return cost * iv;
+}
+
+bool TokenBucket::tryAcquire(unsigned long long cost,
+                             unsigned long long now) {
+  unsigned long long increment = getIncrement(cost);
+  if (increment == 0) {
+    return true;
+  }
+
+  while (true) {
+    unsigned long long old_arrival = arrival;
+    unsigned long long new_arrival =
+      (old_arrival > now ? old_arrival : now) + increment;
+
+    if (new_arrival > now + TOKEN_BUCKET_TOLERANCE) {
+      return false;
+    }
+    if (__sync_bool_compare_and_swap(&arrival, old_arrival, new_arrival)) {
+      return true;
+    }
+  }
+}
+
+void TokenBucket::release(unsigned long long cost) {
+  unsigned long long increment = getIncrement(cost);
+  if (increment == 0) {
+    return;
+  }
+
+  while (true) {
+    unsigned long long old_arrival = arrival;
+    unsigned long long new_arrival =
+      old_arrival > increment ? old_arrival - increment : 0;
+    if (__sync_bool_compare_and_swap(&arrival, old_arrival, new_arrival)) {
+      return;
+    }
+  }
+}
+
+RateLimiter::RateLimiter() {
+}
+
+void RateLimiter::configure(unsigned long long msgs_per_second,
+                            unsigned long long bytes_per_second) {
+  msgBucket.setRate(msgs_per_second);
+  byteBucket.setRate(bytes_per_second);
+}
+
+bool RateLimiter::tryAcquire(unsigned long long num_messages,
+                             unsigned long long num_bytes) {
+  if (!isLimited()) {
+    return true;
+  }
+
+  unsigned long long now = nowNanoseconds();
+  if (!msgBucket.tryAcquire(num_messages, now)) {
+    return false;
+  }
+  if (!byteBucket.tryAcquire(num_bytes, now)) {
+    msgBucket.release(num_messages);
+    return false;
+  }
+  return true;
+}
+
+void RateLimiter::release(unsigned long long num_messages,
+                          unsigned long long num_bytes) {
+  msgBucket.release(num_messages);
+  byteBucket.release(num_bytes);
+}
@@ -0,0 +1,76 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_RATE_LIMITER_H
+#define SCRIBE_RATE_LIMITER_H
+
+/*
+ * Token bucket, implemented as a generic cell rate algorithm.
+ *
+ * The only state is the theoretical arrival time of the next unit, which
+ * is advanced with a compare-and-swap, so callers on different threads
+ * never wait on a lock. The bucket holds one second's worth of units, and
+ * a request bigger than that is allowed once the bucket is full so that
+ * oversized requests can't be refused forever.
+ */
+class TokenBucket {
+ public:
+  TokenBucket();
+
+  // units per second, 0 for unlimited
+  void setRate(unsigned long long per_second);
+  bool isLimited() {return interval != 0;}
+
+  // now is in nanoseconds
+  bool tryAcquire(unsigned long long cost, unsigned long long now);
+
+  // gives back units from a successful tryAcquire that weren't used
+  void release(unsigned long long cost);
+
+ private:
+  unsigned long long getIncrement(unsigned long long cost);
+
+  volatile unsigned long long interval;  // nanoseconds per unit
+  volatile unsigned long long arrival;   // theoretical arrival time, in ns
+};
+
+/*
+ * Limits the rate of both messages and bytes.
+ */
+class RateLimiter {
+ public:
+  RateLimiter();
+
+  void configure(unsigned long long msgs_per_second,
+                 unsigned long long bytes_per_second);
+  bool isLimited() {return msgBucket.isLimited() || byteBucket.isLimited();}
+
+  // Takes both budgets or neither
+  bool tryAcquire(unsigned long long num_messages,
+                  unsigned long long num_bytes);
+  void release(unsigned long long num_messages, unsigned long long num_bytes);
+
+ private:
+  TokenBucket msgBucket;
+  TokenBucket byteBucket;
+
+  // disallow copy and assignment
+  RateLimiter(const RateLimiter& rhs);
+  const RateLimiter& operator=(const RateLimiter& rhs);
+};
+
+#endif // !defined SCRIBE_RATE_LIMITER_H
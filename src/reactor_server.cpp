@@ -0,0 +1,180 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <event.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "reactor_server.h"
+
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::server;
+using namespace apache::thrift::concurrency;
+using namespace std;
+using boost::shared_ptr;
+
+struct reactorArgs {
+  ReactorServer* server;
+  unsigned long index;
+};
+
+static void* reactorStatic(void* arg) {
+  reactorArgs* args = (reactorArgs*)arg;
+  ReactorServer* server = args->server;
+  unsigned long index = args->index;
+  delete args;
+
+  server->reactorMember(index);
+  return NULL;
+}
+
+ReactorServer::ReactorServer(shared_ptr<TProcessor> processor_,
+                             shared_ptr<TProtocolFactory> protocol_factory,
+                             unsigned long port_, unsigned long num_reactors,
+                             shared_ptr<ThreadManager> thread_manager)
+  : processor(processor_),
+    protocolFactory(protocol_factory),
+    threadManager(thread_manager),
+    port(port_),
+    numReactors(num_reactors ? num_reactors : 1) {
+}
+
+// The reactors are never stopped, the server lives as long as the process.
+ReactorServer::~ReactorServer() {
+}
+
+void ReactorServer::serve() {
+  if (numReactors == 1) {
+    TNonblockingServer server(processor, protocolFactory, port,
+                              threadManager);
+    server.serve();
+    return;
+  }
+
+  if (threadManager) {
+    LOG_OPER("Ignoring thread manager, calls are processed on the <%lu> reactor threads",
+             numReactors);
+  }
+
+  // every reactor is set up before any of them starts accepting
+  bool reuse_port = true;
+  int shared_fd = -1;
+  for (unsigned long i = 0; i < numReactors; ++i) {
+    shared_ptr<TNonblockingServer>
+      server(new TNonblockingServer(processor, protocolFactory, port));
+
+    int fd = shared_fd;
+    if (fd < 0) {
+      fd = openListenSocket(reuse_port);
+      if (!reuse_port) {
+        LOG_OPER("SO_REUSEPORT not available, reactors share one listen socket");
+        shared_fd = fd;
+      }
+    }
+    server->listenSocket(fd);
+    servers.push_back(server);
+  }
+
+  for (unsigned long i = 1; i < numReactors; ++i) {
+    reactorArgs* args = new reactorArgs;
+    args->server = this;
+    args->index = i;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reactorStatic, (void*)args) != 0) {
+      LOG_OPER("ERROR: failed to start reactor thread");
+      delete args;
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  reactorMember(0);
+}
+
+void ReactorServer::reactorMember(unsigned long index) {
+  // each loop has its own event base, only used from this thread
+  struct event_base* base = event_base_new();
+  if (base == NULL) {
+    LOG_OPER("ERROR: failed to create event base for reactor <%lu>", index);
+    return;
+  }
+  servers[index]->registerEvents(base);
+  event_base_loop(base, 0);
+  LOG_OPER("reactor <%lu> exited", index);
+}
+
+// Same as TNonblockingServer::listenSocket(), but binds with SO_REUSEPORT
+// if reuse_port. Clears reuse_port if the option can't be set.
+int ReactorServer::openListenSocket(bool& reuse_port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+
+  char port_string[sizeof("65535")];
+  snprintf(port_string, sizeof(port_string), "%lu", port);
+
+  struct addrinfo* res0;
+  int error = getaddrinfo(NULL, port_string, &hints, &res0);
+  if (error) {
+    throw runtime_error(string("getaddrinfo failed: ") + gai_strerror(error));
+  }
+
+  // ipv4 addresses can be mapped into ipv6 space, so prefer ipv6
+  struct addrinfo* res;
+  for (res = res0; res; res = res->ai_next) {
+    if (res->ai_family == AF_INET6 || res->ai_next == NULL) {
+      break;
+    }
+  }
+
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd < 0) {
+    freeaddrinfo(res0);
+    throw runtime_error(string("socket failed: ") + strerror(errno));
+  }
+
+  int one = 1;
+#ifdef IPV6_V6ONLY
+  if (res->ai_family == AF_INET6) {
+    int zero = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  }
+#endif
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+#ifdef SO_REUSEPORT
+  if (reuse_port &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+    reuse_port = false;
+  }
+#else
+  reuse_port = false;
+#endif
+
+  if (bind(fd, res->ai_addr, res->ai_addrlen) != 0) {
+    int bind_errno = errno;
+    ::close(fd);
+    freeaddrinfo(res0);
+    throw runtime_error(string("bind failed: ") + strerror(bind_errno));
+  }
+  freeaddrinfo(res0);
+  return fd;
+}
@@ -0,0 +1,71 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_REACTOR_SERVER_H
+#define SCRIBE_REACTOR_SERVER_H
+
+#include "common.h"
+
+/*
+ * Thrift front end for scribed: one or more TNonblockingServers on the same
+ * port, each running its own libevent loop on its own thread.
+ *
+ * With one reactor this is just a TNonblockingServer, handing calls to the
+ * ThreadManager if there is one. With more, every reactor reads, decodes and
+ * processes its connections' frames on its own thread, so there is no
+ * ThreadManager. Each reactor binds its own listen socket with SO_REUSEPORT
+ * and the kernel spreads new connections across them. Where SO_REUSEPORT
+ * isn't available the reactors all accept from one shared listen socket.
+ */
+class ReactorServer {
+ public:
+  ReactorServer(boost::shared_ptr<apache::thrift::TProcessor> processor,
+                boost::shared_ptr<apache::thrift::protocol::TProtocolFactory>
+                  protocol_factory,
+                unsigned long port, unsigned long num_reactors,
+                boost::shared_ptr<apache::thrift::concurrency::ThreadManager>
+                  thread_manager);
+  ~ReactorServer();
+
+  // Runs the first reactor on the calling thread, so never returns unless
+  // it fails to start.
+  void serve();
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void reactorMember(unsigned long index);
+
+ private:
+  int openListenSocket(bool& reuse_port);
+
+  boost::shared_ptr<apache::thrift::TProcessor> processor;
+  boost::shared_ptr<apache::thrift::protocol::TProtocolFactory>
+    protocolFactory;
+  boost::shared_ptr<apache::thrift::concurrency::ThreadManager>
+    threadManager;
+  unsigned long port;
+  unsigned long numReactors;
+  std::vector<boost::shared_ptr<apache::thrift::server::TNonblockingServer> >
+    servers;
+
+  // disallow copy, assignment, and empty construction
+  ReactorServer();
+  ReactorServer(const ReactorServer& rhs);
+  const ReactorServer& operator=(const ReactorServer& rhs);
+};
+
+#endif // !defined SCRIBE_REACTOR_SERVER_H
@@ -0,0 +1,132 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_RING_BUFFER_H
+#define SCRIBE_RING_BUFFER_H
+
+/*
+ * Bounded multi-producer/single-consumer queue.
+ *
+ * Producers claim a slot with a compare-and-swap on the enqueue position
+ * and publish it by advancing the slot's sequence number, so concurrent
+ * pushes never wait on a mutex. Only one thread may pop at a time; callers
+ * are responsible for serializing consumers.
+ * (This is Dmitry Vyukov's bounded queue restricted to a single consumer.)
+ */
+template <typename T>
+class MpscRing {
+ public:
+  // capacity is rounded up to a power of two
+  explicit MpscRing(unsigned long capacity)
+    : cells(NULL), mask(0), enqueuePos(0), dequeuePos(0) {
+    unsigned long size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask = size - 1;
+    cells = new Cell[size];
+    for (unsigned long i = 0; i < size; ++i) {
+      cells[i].sequence = i;
+    }
+  }
+
+  ~MpscRing() {
+    delete[] cells;
+  }
+
+  // Returns false if the ring is full. Safe to call from any thread.
+  bool push(const T& item) {
+    Cell* cell;
+    unsigned long pos = enqueuePos;
+    for (;;) {
+      cell = &cells[pos & mask];
+      unsigned long seq = cell->sequence;
+      __sync_synchronize();
+      long diff = (long)seq - (long)pos;
+      if (diff == 0) {
+        if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos + 1)) {
+          break;
+        }
+        pos = enqueuePos;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueuePos;
+      }
+    }
+
+    cell->data = item;
+    __sync_synchronize();
+    cell->sequence = pos + 1;
+    return true;
+  }
+
+  // Returns false if the ring is empty or the oldest slot has been claimed
+  // but not yet published. Must not be called concurrently with itself.
+  bool pop(T& item) {
+    Cell* cell = &cells[dequeuePos & mask];
+    unsigned long seq = cell->sequence;
+    __sync_synchronize();
+    if ((long)seq - (long)(dequeuePos + 1) < 0) {
+      return false;
+    }
+
+    item = cell->data;
+    cell->data = T(); // don't hold a reference to the popped item
+    __sync_synchronize();
+    cell->sequence = dequeuePos + mask + 1;
+    ++dequeuePos;
+    return true;
+  }
+
+  // Count of slots claimed by push so far. Once popped() reaches a value
+  // this returned, everything pushed before that call has been popped.
+  unsigned long claimed() const {
+    return enqueuePos;
+  }
+
+  // Count of items popped so far. Same thread as pop only.
+  unsigned long popped() const {
+    return dequeuePos;
+  }
+
+  unsigned long capacity() const {
+    return mask + 1;
+  }
+
+ private:
+  struct Cell {
+    volatile unsigned long sequence;
+    T data;
+  };
+
+  Cell* cells;
+  unsigned long mask;
+
+  // keep the producer and consumer positions on separate cache lines
+  char pad0[64];
+  volatile unsigned long enqueuePos;
+  char pad1[64];
+  unsigned long dequeuePos;
+
+  // disallow copy, assignment, and empty construction
+  MpscRing();
+  MpscRing(const MpscRing& rhs);
+  MpscRing& operator=(const MpscRing& rhs);
+};
+
+#endif // !defined SCRIBE_RING_BUFFER_H
@@ -0,0 +1,579 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+// Throughput and latency benchmark for scribed.
+//
+// Runs a scribeHandler in this process with a generated config for one of
+// a few store topologies, and has a number of client threads call Log on
+// it for a fixed time, either directly or through a TNonblockingServer on
+// a local port. Reports messages and bytes per second accepted, and the
+// latency of the Log calls. Payloads and categories are the same on every
+// run with the same options, so runs can be compared with each other.
+// With --reload the config is changed and reinitialize is called while the
+// clients are running, to measure reloads and exercise reconfiguring
+// running stores.
+
+int debug_level = 0;
+#include "common.h"
+#include "scribe_server.h"
+#include "compressed_transport.h"
+#include "latency_stats.h"
+#include "reactor_server.h"
+
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::transport;
+using namespace apache::thrift::server;
+using namespace apache::thrift::concurrency;
+
+using namespace scribe::thrift;
+using namespace std;
+using boost::shared_ptr;
+
+#define DEFAULT_BENCH_PORT     11463
+#define DEFAULT_BENCH_DIR      "/tmp/scribe_bench"
+#define BENCH_CONNECT_TIMEOUT  10 // seconds to wait for the server to start
+
+struct BenchOptions {
+  bool server;                  // go through TNonblockingServer
+  string topology;              // null, file, buffer, bucket or multi
+  string configFile;            // use this instead of a generated config
+  vector<string> storeOptions;  // added to the generated store
+  unsigned long port;
+  string dir;                   // for files and generated configs
+  unsigned long messageSize;
+  unsigned long categories;
+  unsigned long threads;
+  unsigned long batchSize;      // messages per Log call
+  unsigned long seconds;
+  unsigned long serverThreads;  // num_thrift_server_threads
+  unsigned long ioThreads;      // num_thrift_io_threads
+  unsigned long reloadSeconds;  // 0 for no reloads
+};
+
+struct ClientResult {
+  unsigned long long messagesOk;
+  unsigned long long messagesTryLater;
+  unsigned long long bytesOk;
+  unsigned long long calls;
+  unsigned long long errors;
+  LatencyHistogram latency;
+};
+
+struct ClientArgs {
+  const BenchOptions* options;
+  unsigned long index;
+  volatile bool* stop;
+  ClientResult result;
+};
+
+static void printUsage(const char* program_name) {
+  cout << "Usage: " << program_name << " [options]" << endl
+       << "  -m, --mode inproc|server    call Log directly or over a socket"
+       << " (inproc)" << endl
+       << "  -t, --topology null|file|buffer|bucket|multi" << endl
+       << "                              stores to log to (null)" << endl
+       << "  -c, --config file           use this config instead" << endl
+       << "  -o, --store-option key=val  add to the generated store" << endl
+       << "  -s, --size bytes            message size (100)" << endl
+       << "  -k, --categories n          number of categories (1)" << endl
+       << "  -n, --threads n             client threads (4)" << endl
+       << "  -b, --batch n               messages per Log call (100)" << endl
+       << "  -d, --duration seconds      how long to run (10)" << endl
+       << "  -r, --server-threads n      num_thrift_server_threads (1)"
+       << endl
+       << "  -i, --io-threads n          num_thrift_io_threads (1)" << endl
+       << "  -e, --reload seconds        change the config and reinitialize"
+       << " this often (0)" << endl
+       << "  -p, --port port             port for server mode ("
+       << DEFAULT_BENCH_PORT << ")" << endl
+       << "  -w, --dir path              for files and configs ("
+       << DEFAULT_BENCH_DIR << ")" << endl;
+}
+
+static string toString(unsigned long value) {
+  ostringstream out;
+  out << value;
+  return out.str();
+}
+
+static string makeStoreConfig(const BenchOptions& options,
+                              unsigned long downstream_port,
+                              const string& category) {
+  string store = "<store>\ncategory=" + category + "\n";
+  for (vector<string>::const_iterator iter = options.storeOptions.begin();
+       iter != options.storeOptions.end();
+       ++iter) {
+    store += *iter + "\n";
+  }
+
+  if (options.topology == "null") {
+    store += "type=null\n";
+  } else if (options.topology == "file") {
+    store += "type=file\n"
+      "fs_type=std\n"
+      "file_path=" + options.dir + "/file\n"
+      "base_filename=bench\n"
+      "max_size=1000000000\n";
+  } else if (options.topology == "buffer") {
+    store += "type=buffer\n"
+      "retry_interval=1\n"
+      "retry_interval_range=0\n"
+      "<primary>\n"
+      "type=network\n"
+      "remote_host=localhost\n"
+      "remote_port=" + toString(downstream_port) + "\n"
+      "</primary>\n"
+      "<secondary>\n"
+      "type=file\n"
+      "fs_type=std\n"
+      "file_path=" + options.dir + "/buffer\n"
+      "base_filename=bench\n"
+      "max_size=1000000000\n"
+      "</secondary>\n";
+  } else if (options.topology == "bucket") {
+    // messages start with a key and a ':'
+    store += "type=bucket\n"
+      "num_buckets=8\n"
+      "bucket_type=key_hash\n"
+      "delimiter=58\n"
+      "<bucket>\n"
+      "type=null\n"
+      "</bucket>\n";
+  } else if (options.topology == "multi") {
+    store += "type=multi\n"
+      "<store0>\n"
+      "type=null\n"
+      "</store0>\n"
+      "<store1>\n"
+      "type=null\n"
+      "</store1>\n";
+  } else {
+    throw runtime_error("unknown topology <" + options.topology + ">");
+  }
+  return store + "</store>\n";
+}
+
+static string writeConfig(const BenchOptions& options, const string& name,
+                          unsigned long port, const string& store) {
+  string filename = options.dir + "/" + name;
+  ofstream out(filename.c_str());
+  out << "port=" << port << "\n"
+      << "max_msg_per_second=0\n"
+      << "max_queue_size=1000000000\n"
+      << "check_interval=1\n"
+      << "num_thrift_server_threads=" << options.serverThreads << "\n"
+      << "num_thrift_io_threads=" << options.ioThreads << "\n"
+      << store;
+  out.close();
+  if (!out) {
+    throw runtime_error("failed to write config file <" + filename + ">");
+  }
+  return filename;
+}
+
+// With reloads every category gets a store of its own, so a reload
+// reconfigures the running queues in place rather than replacing copies of
+// the default store. Each reload's config differs by a key that no store
+// looks at.
+static string writeBenchConfig(const BenchOptions& options,
+                               unsigned long downstream_port,
+                               unsigned long reloads) {
+  if (!options.reloadSeconds) {
+    return writeConfig(options, "bench.conf", options.port,
+                       makeStoreConfig(options, downstream_port, "default"));
+  }
+
+  BenchOptions changed = options;
+  changed.storeOptions.push_back("bench_reload=" + toString(reloads));
+  string stores;
+  for (unsigned long i = 0; i < options.categories; ++i) {
+    stores += makeStoreConfig(changed, downstream_port,
+                              "bench" + toString(i));
+  }
+  return writeConfig(options, "bench.conf", options.port, stores);
+}
+
+struct ServerArgs {
+  shared_ptr<scribeHandler> handler;
+};
+
+// Same setup as main in scribe_server.cpp
+static void* serverThread(void* arg) {
+  shared_ptr<scribeHandler> handler = ((ServerArgs*)arg)->handler;
+  delete (ServerArgs*)arg;
+
+  try {
+    shared_ptr<TProcessor> processor(new scribeProcessor(handler));
+    shared_ptr<TProtocolFactory>
+      protocol_factory(new CompressedBinaryProtocolFactory());
+    shared_ptr<ThreadManager> thread_manager;
+
+    if (handler->numThriftServerThreads > 1 &&
+        handler->numThriftIoThreads <= 1) {
+      thread_manager = ThreadManager::
+        newSimpleThreadManager(handler->numThriftServerThreads);
+      shared_ptr<PosixThreadFactory> thread_factory(new PosixThreadFactory());
+      thread_manager->threadFactory(thread_factory);
+      thread_manager->start();
+    }
+
+    ReactorServer server(processor, protocol_factory, handler->port,
+                         handler->numThriftIoThreads, thread_manager);
+    server.serve();
+  } catch(std::exception const& e) {
+    LOG_OPER("Exception in bench server: %s", e.what());
+  }
+  return NULL;
+}
+
+static void startServer(shared_ptr<scribeHandler> handler) {
+  ServerArgs* args = new ServerArgs;
+  args->handler = handler;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, serverThread, args) != 0) {
+    delete args;
+    throw runtime_error("failed to start server thread");
+  }
+  pthread_attr_destroy(&attr);
+}
+
+// The same messages for the same options on every run
+static void makeBatch(const BenchOptions& options, unsigned long client,
+                      vector<LogEntry>& batch) {
+  unsigned long seed = client * 2654435761UL + 1;
+  for (unsigned long i = 0; i < options.batchSize; ++i) {
+    LogEntry entry;
+    seed = seed * 1103515245 + 12345;
+    entry.category = "bench" + toString((seed >> 8) % options.categories);
+
+    string key = toString((seed >> 4) % 100000) + ":";
+    entry.message.reserve(options.messageSize);
+    entry.message = key.substr(0, options.messageSize);
+    while (entry.message.length() < options.messageSize) {
+      entry.message.push_back('a' + (entry.message.length() + seed) % 26);
+    }
+    batch.push_back(entry);
+  }
+}
+
+static shared_ptr<scribeClient> connect(const BenchOptions& options) {
+  time_t give_up = time(NULL) + BENCH_CONNECT_TIMEOUT;
+  while (true) {
+    try {
+      shared_ptr<TSocket> socket(new TSocket("localhost", options.port));
+      shared_ptr<TFramedTransport> transport(new TFramedTransport(socket));
+      shared_ptr<TBinaryProtocol> protocol(new TBinaryProtocol(transport));
+      transport->open();
+      return shared_ptr<scribeClient>(new scribeClient(protocol));
+    } catch(TTransportException& e) {
+      if (time(NULL) >= give_up) {
+        throw;
+      }
+      usleep(100000);
+    }
+  }
+}
+
+static void* clientThread(void* arg) {
+  ClientArgs* args = (ClientArgs*)arg;
+  const BenchOptions& options = *args->options;
+  ClientResult& result = args->result;
+
+  vector<LogEntry> batch;
+  makeBatch(options, args->index, batch);
+  unsigned long long batch_bytes = 0;
+  for (vector<LogEntry>::iterator iter = batch.begin();
+       iter != batch.end();
+       ++iter) {
+    batch_bytes += iter->message.length();
+  }
+
+  try {
+    shared_ptr<scribeClient> client;
+    if (options.server) {
+      client = connect(options);
+    }
+
+    while (!*args->stop) {
+      unsigned long long start = currentTimeUs();
+      ResultCode rc = client ? client->Log(batch) : g_Handler->Log(batch);
+      result.latency.add(currentTimeUs() - start);
+      ++result.calls;
+
+      if (rc == OK) {
+        result.messagesOk += batch.size();
+        result.bytesOk += batch_bytes;
+      } else {
+        result.messagesTryLater += batch.size();
+      }
+    }
+  } catch(std::exception const& e) {
+    LOG_OPER("Exception in bench client %lu: %s", args->index, e.what());
+    ++result.errors;
+  }
+  return NULL;
+}
+
+static void parseOptions(int argc, char** argv, BenchOptions& options) {
+  options.server = false;
+  options.topology = "null";
+  options.port = DEFAULT_BENCH_PORT;
+  options.dir = DEFAULT_BENCH_DIR;
+  options.messageSize = 100;
+  options.categories = 1;
+  options.threads = 4;
+  options.batchSize = 100;
+  options.seconds = 10;
+  options.serverThreads = 1;
+  options.ioThreads = 1;
+  options.reloadSeconds = 0;
+
+  const char* const short_options = "hm:t:c:o:s:k:n:b:d:r:i:e:p:w:";
+  const struct option long_options[] = {
+    { "help",           0, NULL, 'h' },
+    { "mode",           1, NULL, 'm' },
+    { "topology",       1, NULL, 't' },
+    { "config",         1, NULL, 'c' },
+    { "store-option",   1, NULL, 'o' },
+    { "size",           1, NULL, 's' },
+    { "categories",     1, NULL, 'k' },
+    { "threads",        1, NULL, 'n' },
+    { "batch",          1, NULL, 'b' },
+    { "duration",       1, NULL, 'd' },
+    { "server-threads", 1, NULL, 'r' },
+    { "io-threads",     1, NULL, 'i' },
+    { "reload",         1, NULL, 'e' },
+    { "port",           1, NULL, 'p' },
+    { "dir",            1, NULL, 'w' },
+    { NULL,             0, NULL, 0 },
+  };
+
+  int next_option;
+  while (0 < (next_option = getopt_long(argc, argv, short_options,
+                                        long_options, NULL))) {
+    switch (next_option) {
+    case 'm':
+      if (0 == strcmp(optarg, "server")) {
+        options.server = true;
+      } else if (0 == strcmp(optarg, "inproc")) {
+        options.server = false;
+      } else {
+        printUsage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 't':
+      options.topology = optarg;
+      break;
+    case 'c':
+      options.configFile = optarg;
+      break;
+    case 'o':
+      options.storeOptions.push_back(optarg);
+      break;
+    case 's':
+      options.messageSize = strtoul(optarg, NULL, 0);
+      break;
+    case 'k':
+      options.categories = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      options.threads = strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      options.batchSize = strtoul(optarg, NULL, 0);
+      break;
+    case 'd':
+      options.seconds = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      options.serverThreads = strtoul(optarg, NULL, 0);
+      break;
+    case 'i':
+      options.ioThreads = strtoul(optarg, NULL, 0);
+      break;
+    case 'e':
+      options.reloadSeconds = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      options.port = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      options.dir = optarg;
+      break;
+    case 'h':
+    default:
+      printUsage(argv[0]);
+      exit(next_option == 'h' ? 0 : 1);
+    }
+  }
+
+  if (options.categories == 0 || options.threads == 0 ||
+      options.batchSize == 0 || options.seconds == 0 ||
+      options.serverThreads == 0 || options.ioThreads == 0) {
+    printUsage(argv[0]);
+    exit(1);
+  }
+}
+
+static void printResults(const BenchOptions& options,
+                         const ClientResult& total, double seconds,
+                         unsigned long reloads) {
+  printf("mode=%s topology=%s threads=%lu categories=%lu size=%lu "
+         "batch=%lu seconds=%.2f\n",
+         options.server ? "server" : "inproc",
+         options.configFile.empty() ? options.topology.c_str() : "config",
+         options.threads, options.categories, options.messageSize,
+         options.batchSize, seconds);
+  printf("messages: %llu ok, %llu try_later, %llu client errors\n",
+         total.messagesOk, total.messagesTryLater, total.errors);
+  printf("throughput: %.0f msgs/s, %.2f MB/s\n",
+         total.messagesOk / seconds, total.bytesOk / seconds / 1000000);
+  printf("Log latency (us): calls=%llu avg=%llu p50=%llu p90=%llu "
+         "p99=%llu p99.9=%llu max=%llu\n",
+         total.calls, total.latency.getAverage(),
+         total.latency.getPercentile(50), total.latency.getPercentile(90),
+         total.latency.getPercentile(99), total.latency.getPercentile(99.9),
+         total.latency.getMax());
+  if (options.reloadSeconds) {
+    printf("reloads: %lu\n", reloads);
+  }
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options;
+  parseOptions(argc, argv, options);
+
+  unsigned long downstream_port = options.port + 1;
+  try {
+    boost::filesystem::create_directories(options.dir);
+
+    string config_file = options.configFile;
+    if (config_file.empty()) {
+      if (options.topology == "buffer") {
+        // the network store sends to a second handler with a null store
+        BenchOptions downstream = options;
+        downstream.topology = "null";
+        downstream.storeOptions.clear();
+        string downstream_file = writeConfig(
+          options, "downstream.conf", downstream_port,
+          makeStoreConfig(downstream, 0, "default"));
+
+        shared_ptr<scribeHandler> handler(
+          new scribeHandler(downstream_port, downstream_file));
+        handler->initialize();
+        startServer(handler);
+      }
+      config_file = writeBenchConfig(options, downstream_port, 0);
+    }
+
+    g_Handler = shared_ptr<scribeHandler>(
+      new scribeHandler(options.port, config_file));
+    g_Handler->initialize();
+    if (options.server) {
+      startServer(g_Handler);
+    }
+  } catch(std::exception const& e) {
+    LOG_OPER("Exception setting up benchmark: %s", e.what());
+    return 1;
+  }
+
+  volatile bool stop = false;
+  vector<ClientArgs> clients(options.threads);
+  vector<pthread_t> threads(options.threads);
+  for (unsigned long i = 0; i < options.threads; ++i) {
+    clients[i].options = &options;
+    clients[i].index = i;
+    clients[i].stop = &stop;
+    clients[i].result.messagesOk = 0;
+    clients[i].result.messagesTryLater = 0;
+    clients[i].result.bytesOk = 0;
+    clients[i].result.calls = 0;
+    clients[i].result.errors = 0;
+  }
+
+  unsigned long long start = currentTimeUs();
+  for (unsigned long i = 0; i < options.threads; ++i) {
+    if (pthread_create(&threads[i], NULL, clientThread, &clients[i]) != 0) {
+      LOG_OPER("failed to start client thread");
+      return 1;
+    }
+  }
+
+  // a given config file is just read again on each reload
+  unsigned long reloads = 0;
+  unsigned long elapsed = 0;
+  while (options.reloadSeconds &&
+         elapsed + options.reloadSeconds < options.seconds) {
+    sleep(options.reloadSeconds);
+    elapsed += options.reloadSeconds;
+    try {
+      if (options.configFile.empty()) {
+        writeBenchConfig(options, downstream_port, reloads + 1);
+      }
+    } catch(std::exception const& e) {
+      LOG_OPER("Exception writing benchmark config: %s", e.what());
+      break;
+    }
+    unsigned long long reload_start = currentTimeUs();
+    g_Handler->reinitialize();
+    ++reloads;
+    LOG_OPER("reload %lu took %llu us", reloads, currentTimeUs() - reload_start);
+  }
+  sleep(options.seconds - elapsed);
+  stop = true;
+
+  pthread_join(threads[0], NULL);
+  ClientResult total = clients[0].result;
+  for (unsigned long i = 1; i < options.threads; ++i) {
+    pthread_join(threads[i], NULL);
+    total.messagesOk += clients[i].result.messagesOk;
+    total.messagesTryLater += clients[i].result.messagesTryLater;
+    total.bytesOk += clients[i].result.bytesOk;
+    total.calls += clients[i].result.calls;
+    total.errors += clients[i].result.errors;
+    total.latency.merge(clients[i].result.latency);
+  }
+  double seconds = (currentTimeUs() - start) / 1000000.0;
+
+  printResults(options, total, seconds, reloads);
+  fflush(stdout);
+
+  // With only null stores every message accepted has to have reached each
+  // of them once, even with stores replaced by reloads along the way.
+  g_Handler->stopAllStores();
+  int status = 0;
+  if (options.reloadSeconds && options.configFile.empty() &&
+      (options.topology == "null" || options.topology == "bucket" ||
+       options.topology == "multi")) {
+    long long expected = total.messagesOk *
+      (options.topology == "multi" ? 2 : 1);
+    long long ignored = g_Handler->getCounter("ignored");
+    printf("reload check: %lld of %lld messages reached the stores: %s\n",
+           ignored, expected, ignored == expected ? "ok" : "FAILED");
+    status = (ignored == expected) ? 0 : 1;
+  }
+  fflush(stdout);
+
+  // exits without waiting for the server threads
+  exit(status);
+}
@@ -26,6 +26,11 @@
 int debug_level = 0;
 #include "common.h"
 #include "scribe_server.h"
+#include "compressed_transport.h"
+#include "store_thread_pool.h"
+#include "entry_arena.h"
+#include "latency_stats.h"
+#include "reactor_server.h"
 
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -39,16 +44,24 @@ using namespace scribe::thrift;
 using namespace std;
 using boost::shared_ptr;
 
-static shared_ptr<scribeHandler> g_Handler;
+shared_ptr<scribeHandler> g_Handler;
 
 #define DEFAULT_CHECK_PERIOD       5
 #define DEFAULT_MAX_MSG_PER_SECOND 100000
 #define DEFAULT_MAX_QUEUE_SIZE     5000000LL
 #define DEFAULT_SERVER_THREADS     1
+#define DEFAULT_IO_THREADS         1
 
 static int pending_signal = 0;
 static string log_separator = ":";
 
+static bool sameConfig(pStoreConf a, pStoreConf b) {
+  return a && b && a->equals(*b);
+}
+
+// scribe_bench links in everything here except main
+#ifndef SCRIBE_BENCHMARK
+
 static void sigalrm(int sig)
 {
   (void)sig;
@@ -74,6 +87,8 @@ static void terminate(int sig) {
   raise(sig);
 }
 
+#endif // !defined SCRIBE_BENCHMARK
+
 void print_usage(const char* program_name) {
   cout << "Usage: " << program_name << " [-p port] [-c config_file]";
 }
@@ -107,6 +122,17 @@ void incCounter(string counter, long amount) {
   g_Handler->incrementCounter(counter, amount);
 }
 
+// For values that only make sense per category, so unlike incCounter
+// there is no total across categories.
+void setCounter(string category, string counter, long value) {
+  g_Handler->setCounter(category + log_separator + counter, value);
+}
+
+void setCounter(string counter, long value) {
+  g_Handler->setCounter(counter, value);
+}
+
+#ifndef SCRIBE_BENCHMARK
 int main(int argc, char **argv) {
 
   try {
@@ -164,12 +190,14 @@ int main(int argc, char **argv) {
     signal(SIGHUP,  terminate);
 
     shared_ptr<TProcessor> processor(new scribeProcessor(g_Handler));
-    /* This factory is for binary compatibility. */
+    /* This factory is for binary compatibility. It also accepts messages
+     * from clients that compress them, and always replies uncompressed. */
     shared_ptr<TProtocolFactory>
-      binaryProtocolFactory(new TBinaryProtocolFactory(0, 0, false, false));
+      binaryProtocolFactory(new CompressedBinaryProtocolFactory());
     shared_ptr<ThreadManager> thread_manager;
 
-    if (g_Handler->numThriftServerThreads > 1) {
+    if (g_Handler->numThriftServerThreads > 1 &&
+        g_Handler->numThriftIoThreads <= 1) {
       // create a ThreadManager to process incoming calls
       thread_manager = ThreadManager::
         newSimpleThreadManager(g_Handler->numThriftServerThreads);
@@ -179,10 +207,11 @@ int main(int argc, char **argv) {
       thread_manager->start();
     }
 
-    TNonblockingServer server(processor, binaryProtocolFactory,
-                              g_Handler->port, thread_manager);
+    ReactorServer server(processor, binaryProtocolFactory, g_Handler->port,
+                         g_Handler->numThriftIoThreads, thread_manager);
 
-    LOG_OPER("Starting scribe server on port %lu", g_Handler->port);
+    LOG_OPER("Starting scribe server on port %lu with %lu io threads",
+             g_Handler->port, (unsigned long)g_Handler->numThriftIoThreads);
     fflush(stderr);
 
     server.serve();
@@ -194,22 +223,26 @@ int main(int argc, char **argv) {
   LOG_OPER("scribe server exiting");
   return 0;
 }
+#endif // !defined SCRIBE_BENCHMARK
 
 scribeHandler::scribeHandler(unsigned long int server_port, const std::string& config_file)
   : FacebookBase("Scribe"),
     port(server_port),
     numThriftServerThreads(DEFAULT_SERVER_THREADS),
+    numThriftIoThreads(DEFAULT_IO_THREADS),
     checkPeriod(DEFAULT_CHECK_PERIOD),
     pcategories(NULL),
     pcategory_prefixes(NULL),
     configFilename(config_file),
     status(STARTING),
     statusDetails("initial state"),
-    numMsgLastSecond(0),
     maxMsgPerSecond(DEFAULT_MAX_MSG_PER_SECOND),
+    maxBytesPerSecond(0),
     maxQueueSize(DEFAULT_MAX_QUEUE_SIZE),
-    newThreadPerCategory(true) {
-  time(&lastMsgTime);
+    newThreadPerCategory(true),
+    throttleStatId(g_latencyStats.getId("throttle us")) {
+  globalLimiter.configure(maxMsgPerSecond, maxBytesPerSecond);
+  StoreQueue::setDefaultMaxQueueSize(maxQueueSize);
 }
 
 scribeHandler::~scribeHandler() {
@@ -227,12 +260,14 @@ fb_status scribeHandler::getStatus() {
   Guard status_monitor(statusLock);
 
   fb_status return_status(status);
-  if (status == ALIVE) {
-    for (category_map_t::iterator cat_iter = pcategories->begin();
-        cat_iter != pcategories->end();
+  if (status == ALIVE && pcategories) {
+    store_list_vector_t all_stores;
+    pcategories->getAll(all_stores);
+    for (store_list_vector_t::iterator cat_iter = all_stores.begin();
+        cat_iter != all_stores.end();
         ++cat_iter) {
-      for (store_list_t::iterator store_iter = cat_iter->second->begin();
-           store_iter != cat_iter->second->end();
+      for (store_list_t::iterator store_iter = (*cat_iter)->begin();
+           store_iter != (*cat_iter)->end();
            ++store_iter)
       {
         if (!(*store_iter)->getStatus().empty())
@@ -261,11 +296,13 @@ void scribeHandler::getStatusDetails(std::string& _return) {
   _return = statusDetails;
   if (_return.empty()) {
     if (pcategories) {
-      for (category_map_t::iterator cat_iter = pcategories->begin();
-          cat_iter != pcategories->end();
+      store_list_vector_t all_stores;
+      pcategories->getAll(all_stores);
+      for (store_list_vector_t::iterator cat_iter = all_stores.begin();
+          cat_iter != all_stores.end();
           ++cat_iter) {
-        for (store_list_t::iterator store_iter = cat_iter->second->begin();
-            store_iter != cat_iter->second->end();
+        for (store_list_t::iterator store_iter = (*cat_iter)->begin();
+            store_iter != (*cat_iter)->end();
             ++store_iter) {
 
           if (!(_return = (*store_iter)->getStatus()).empty()) {
@@ -304,12 +341,12 @@ const char* scribeHandler::statusAsString(fb_status status) {
 }
 
 
-// Should be called while holding a writeLock on scribeHandlerLock
+// Should be called while holding categoryCreateLock
 bool scribeHandler::createCategoryFromModel(
   const string &category, const boost::shared_ptr<StoreQueue> &model) {
 
   if ((pcategories == NULL) ||
-      (pcategories->find(category) != pcategories->end())) {
+      (pcategories->find(category) != NULL)) {
     return false;
   }
 
@@ -344,22 +381,16 @@ bool scribeHandler::createCategoryFromModel(
 
   shared_ptr<store_list_t> pstores =
     shared_ptr<store_list_t>(new store_list_t);
-
-  (*pcategories)[category] = pstores;
   pstores->push_back(pstore);
 
-  return true;
+  // Fill in the list before publishing it, other threads can start
+  // using it as soon as it's in the table.
+  return pcategories->insert(category, pstores);
 }
 
 
 // Check if we need to deny this request due to throttling
 bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
-  // Check if we need to rate limit
-  if (throttleDeny(messages.size())) {
-    incCounter("denied for rate");
-    return true;
-  }
-
   if (!pcategories || !pcategory_prefixes) {
     // don't bother to spam anything for this, our status should already
     // be showing up as WARNING in the monitoring tools.
@@ -375,29 +406,9 @@ bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
   // Also note that we always check all categories, not just the ones in this request.
   // This is a simplification based on the assumption that most Log() calls contain most
   // categories.
-  unsigned long long max_count = 0;
-  for (category_map_t::iterator cat_iter = pcategories->begin();
-       cat_iter != pcategories->end();
-       ++cat_iter) {
-    shared_ptr<store_list_t> pstores = cat_iter->second;
-    if (!pstores) {
-      throw std::logic_error("throttle check: iterator in category map holds null pointer");
-    }
-    for (store_list_t::iterator store_iter = pstores->begin();
-         store_iter != pstores->end();
-         ++store_iter) {
-      if (*store_iter == NULL) {
-        throw std::logic_error("throttle check: iterator in store map holds null pointer");
-      } else {
-        unsigned long long size = (*store_iter)->getSize();
-        if (size > max_count) {
-          max_count = size;
-        }
-      }
-    }
-  }
-
-  if (max_count > maxQueueSize) {
+  // The queues keep a count of how many of them are over their limit
+  // (max_queue_size, either global or set per store), so this is O(1).
+  if (StoreQueue::getNumOverloaded() > 0) {
     incCounter("denied for queue size");
     return true;
   }
@@ -405,32 +416,36 @@ bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
   return false;
 }
 
-// Should be called while holding a writeLock on scribeHandlerLock
+// Should be called while holding a readLock on scribeHandlerLock
 shared_ptr<store_list_t> scribeHandler::createNewCategory(
   const string& category) {
 
-  shared_ptr<store_list_t> store_list;
+  if (!pcategories || !pcategory_prefixes) {
+    return shared_ptr<store_list_t>();
+  }
 
-  // First, check the list of category prefixes for a model
-  category_prefix_map_t::iterator cat_prefix_iter = pcategory_prefixes->begin();
-  while (cat_prefix_iter != pcategory_prefixes->end()) {
-    string::size_type len = cat_prefix_iter->first.size();
-    if (cat_prefix_iter->first.compare(0, len-1, category, 0, len-1) == 0) {
-      // Found a matching prefix model
+  // Only one thread creates categories at a time. Lookups of existing
+  // categories carry on while we do.
+  Guard create_monitor(categoryCreateLock);
 
-      createCategoryFromModel(category, cat_prefix_iter->second);
-      category_map_t::iterator cat_iter = pcategories->find(category);
+  // Someone else may have created it while we were waiting
+  shared_ptr<store_list_t> store_list = pcategories->find(category);
+  if (store_list != NULL) {
+    return store_list;
+  }
 
-      if (cat_iter != pcategories->end()) {
-        store_list = cat_iter->second;
-      } else {
-        LOG_OPER("failed to create new prefix store for category <%s>",
-                 category.c_str());
-      }
+  // First, check the list of category prefixes for a model
+  shared_ptr<StoreQueue> model = pcategory_prefixes->findModel(category);
+  if (model != NULL) {
+    // Found a matching prefix model
+
+    createCategoryFromModel(category, model);
+    store_list = pcategories->find(category);
 
-      break;
+    if (store_list == NULL) {
+      LOG_OPER("failed to create new prefix store for category <%s>",
+               category.c_str());
     }
-    cat_prefix_iter++;
   }
 
   // Then try creating a store if we have a default store defined
@@ -438,11 +453,9 @@ shared_ptr<store_list_t> scribeHandler::createNewCategory(
     if (defaultStore != NULL) {
 
       createCategoryFromModel(category, defaultStore);
-      category_map_t::iterator cat_iter = pcategories->find(category);
+      store_list = pcategories->find(category);
 
-      if (cat_iter != pcategories->end()) {
-        store_list = cat_iter->second;
-      } else {
+      if (store_list == NULL) {
         LOG_OPER("failed to create new default store for category <%s>",
                  category.c_str());
       }
@@ -452,43 +465,59 @@ shared_ptr<store_list_t> scribeHandler::createNewCategory(
   return store_list;
 }
 
-// Add this message to every store in list
-void scribeHandler::addMessage(
-  const LogEntry& entry,
+// Add this batch of messages for one category to every store in list
+void scribeHandler::addMessages(
+  const string& category,
+  const shared_ptr<logentry_vector_t>& messages,
   const shared_ptr<store_list_t>& store_list) {
 
   int numstores = 0;
 
-  // Add message to store_list
+  // Add messages to store_list
   for (store_list_t::iterator store_iter = store_list->begin();
        store_iter != store_list->end();
        ++store_iter) {
     ++numstores;
-    boost::shared_ptr<LogEntry> ptr(new LogEntry);
-    ptr->category = entry.category;
-    ptr->message = entry.message;
 
-    (*store_iter)->addMessage(ptr);
+    // Every store shares the same entries. Stores must not modify a
+    // LogEntry after it has been queued.
+    (*store_iter)->addMessages(messages);
   }
 
   if (numstores) {
-    incCounter(entry.category, "received good");
+    incCounter(category, "received good", messages->size());
   } else {
-    incCounter(entry.category, "received bad");
+    incCounter(category, "received bad", messages->size());
   }
 }
 
 
 ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
   ResultCode result;
+  category_batch_map_t batches;
+  category_route_vector_t routes;
+  unsigned long long num_bytes = 0;
+  // One arena per category, so a slab only holds entries going to the same
+  // stores. A category that is stuck retrying then can't keep other
+  // categories' messages in memory where their queues don't count them.
+  boost::unordered_map<string, shared_ptr<LogEntryArena> > arenas;
+  unsigned long long start;
+  bool throttled;
 
   scribeHandlerLock.acquireRead();
 
-  if (throttleRequest(messages)) {
+  start = g_latencyStats.isEnabled() ? currentTimeUs() : 0;
+  throttled = throttleRequest(messages);
+  if (start) {
+    g_latencyStats.record(throttleStatId, currentTimeUs() - start);
+  }
+  if (throttled) {
     result = TRY_LATER;
     goto end;
   }
 
+  // Group the request by category first, so that each StoreQueue is
+  // handed one batch per request instead of one message at a time.
   for (vector<LogEntry>::const_iterator msg_iter = messages.begin();
        msg_iter != messages.end();
        ++msg_iter) {
@@ -499,38 +528,60 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
       continue;
     }
 
+    shared_ptr<logentry_vector_t>& batch = batches[(*msg_iter).category];
+    shared_ptr<LogEntryArena>& arena = arenas[(*msg_iter).category];
+    if (!batch) {
+      batch = shared_ptr<logentry_vector_t>(new logentry_vector_t);
+      arena = shared_ptr<LogEntryArena>(new LogEntryArena);
+    }
+
+    logentry_ptr_t ptr = arena->allocate();
+    ptr->category = (*msg_iter).category;
+    ptr->message = (*msg_iter).message;
+    batch->push_back(ptr);
+    num_bytes += ptr->message.size();
+  }
+
+  // Find the stores for every category before queueing anything, so the
+  // rate limits can refuse the whole request.
+  for (category_batch_map_t::iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
+
     shared_ptr<store_list_t> store_list;
-    string category = (*msg_iter).category;
+    const string& category = batch_iter->first;
 
     // First look for an exact match of the category
     if (pcategories) {
-      category_map_t::iterator cat_iter = pcategories->find(category);
-      if (cat_iter != pcategories->end()) {
-        store_list = cat_iter->second;
-      }
+      store_list = pcategories->find(category);
     }
 
     // Try creating a new store for this category if we didn't find one
     if (store_list == NULL) {
-      // Need write lock to create a new category
-      scribeHandlerLock.release();
-      scribeHandlerLock.acquireWrite();
-
       store_list = createNewCategory(category);
-
-      scribeHandlerLock.release();
-      scribeHandlerLock.acquireRead();
     }
 
     if (store_list == NULL) {
       LOG_OPER("log entry has invalid category <%s>", category.c_str());
-      incCounter(category, "received bad");
+      incCounter(category, "received bad", batch_iter->second->size());
 
       continue;
     }
 
-    // Log this message
-    addMessage(*msg_iter, store_list);
+    routes.push_back(make_pair(batch_iter, store_list));
+  }
+
+  if (!acquireRateBudget(routes, messages.size(), num_bytes)) {
+    result = TRY_LATER;
+    goto end;
+  }
+
+  for (category_route_vector_t::iterator route_iter = routes.begin();
+       route_iter != routes.end();
+       ++route_iter) {
+    // Log these messages. This is the only copy we make of the payload.
+    addMessages(route_iter->first->first, route_iter->first->second,
+                route_iter->second);
   }
 
   result = OK;
@@ -540,31 +591,62 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
   return result;
 }
 
-// Returns true if overloaded.
-// Allows a fixed number of messages per second.
-bool scribeHandler::throttleDeny(int num_messages) {
-  time_t now;
-  time(&now);
-  if (now != lastMsgTime) {
-    lastMsgTime = now;
-    numMsgLastSecond = 0;
-  }
-
-  // If we get a single huge packet it's not cool, but we'd better
-  // accept it or we'll keep having to read it and deny it indefinitely
-  if (num_messages > (int)maxMsgPerSecond/2) {
-    LOG_OPER("throttle allowing rediculously large packet with <%d> messages", num_messages);
+// Takes the global budget for the whole request and the budget of every
+// store each category is going to. Either all of them are taken or none.
+bool scribeHandler::acquireRateBudget(const category_route_vector_t& routes,
+                                      unsigned long num_messages,
+                                      unsigned long long num_bytes) {
+  if (!globalLimiter.tryAcquire(num_messages, num_bytes)) {
+    LOG_DEBUG("throttle denying request with <%lu> messages, <%llu> bytes",
+              num_messages, num_bytes);
+    incCounter("denied for rate");
     return false;
   }
 
-  if (numMsgLastSecond + num_messages > maxMsgPerSecond) {
-    LOG_OPER("throttle denying request with <%d> messages. It would exceed max of <%lu> messages this second",
-           num_messages, maxMsgPerSecond);
-    return true;
-  } else {
-    numMsgLastSecond += num_messages;
-    return false;
+  // what we've taken for each store so far, to give back on failure
+  vector<pair<RateLimiter*, pair<unsigned long, unsigned long long> > > taken;
+
+  for (category_route_vector_t::const_iterator route_iter = routes.begin();
+       route_iter != routes.end();
+       ++route_iter) {
+    const string& category = route_iter->first->first;
+    const logentry_vector_t& batch = *route_iter->first->second;
+
+    unsigned long long batch_bytes = 0;
+    for (logentry_vector_t::const_iterator iter = batch.begin();
+         iter != batch.end();
+         ++iter) {
+      batch_bytes += (*iter)->message.size();
+    }
+
+    for (store_list_t::const_iterator store_iter = route_iter->second->begin();
+         store_iter != route_iter->second->end();
+         ++store_iter) {
+      RateLimiter& limiter = (*store_iter)->getRateLimiter();
+      if (!limiter.isLimited()) {
+        continue;
+      }
+
+      if (!limiter.tryAcquire(batch.size(), batch_bytes)) {
+        LOG_DEBUG("[%s] throttle denying request with <%lu> messages",
+                  category.c_str(), (unsigned long)batch.size());
+        incCounter(category, "denied for rate");
+        incCounter("denied for rate");
+
+        for (size_t i = 0; i < taken.size(); ++i) {
+          taken[i].first->release(taken[i].second.first,
+                                 taken[i].second.second);
+        }
+        globalLimiter.release(num_messages, num_bytes);
+        return false;
+      }
+      taken.push_back(make_pair(&limiter,
+                                make_pair((unsigned long)batch.size(),
+                                          batch_bytes)));
+    }
   }
+
+  return true;
 }
 
 void scribeHandler::stopStores() {
@@ -572,19 +654,27 @@ void scribeHandler::stopStores() {
 
   // Thrift doesn't currently support stopping the server from the handler,
   // so this could leave clients in weird states.
+  deleteStores();
+}
+
+void scribeHandler::deleteStores() {
   deleteCategoryMap(pcategories);
   pcategories = NULL;
   if (pcategory_prefixes) {
     delete pcategory_prefixes;
     pcategory_prefixes = NULL;
   }
+  defaultStore.reset();
 }
 
 void scribeHandler::shutdown() {
-  RWGuard monitor(scribeHandlerLock, true);
+  stopAllStores();
+  exit(0);
+}
 
+void scribeHandler::stopAllStores() {
+  RWGuard monitor(scribeHandlerLock, true);
   stopStores();
-  exit(0);
 }
 
 void scribeHandler::reinitialize() {
@@ -593,8 +683,9 @@ void scribeHandler::reinitialize() {
   // reinitialize() will re-read the config file and re-configure the stores.
   // This is done without shutting down the Thrift server, so this will not
   // reconfigure any server settings such as port number.
+  // Stores whose config hasn't changed are kept running as they are, with
+  // their queues, files and connections. See configureStoreCategory().
   LOG_OPER("reinitializing");
-  stopStores();
   initialize();
 }
 
@@ -608,8 +699,8 @@ void scribeHandler::initialize() {
   bool enough_config_to_run = true;
   int numstores = 0;
 
-  pnew_categories = new category_map_t;
-  pnew_category_prefixes = new category_prefix_map_t;
+  pnew_categories = new CategoryTable;
+  pnew_category_prefixes = new CategoryPrefixIndex;
   tmpDefault.reset();
 
   try {
@@ -630,7 +721,12 @@ void scribeHandler::initialize() {
 
     // load the global config
     config.getUnsigned("max_msg_per_second", maxMsgPerSecond);
+    config.getUnsignedLongLong("max_bytes_per_second", maxBytesPerSecond);
+    globalLimiter.configure(maxMsgPerSecond, maxBytesPerSecond);
     config.getUnsignedLongLong("max_queue_size", maxQueueSize);
+    StoreQueue::setDefaultMaxQueueSize(maxQueueSize);
+    unsigned long old_check_period = checkPeriod;
+    bool old_new_thread_per_category = newThreadPerCategory;
     config.getUnsigned("check_interval", checkPeriod);
 
     // If new_thread_per_category, then we will create a new thread/StoreQueue
@@ -644,6 +740,39 @@ void scribeHandler::initialize() {
       newThreadPerCategory = true;
     }
 
+    // stores made with the old settings can't be kept
+    if (pcategories && (checkPeriod != old_check_period ||
+                        newThreadPerCategory != old_new_thread_per_category)) {
+      LOG_OPER("check_interval or new_thread_per_category changed, recreating all stores");
+      deleteStores();
+    }
+
+    // If store_thread_pool, StoreQueues created from now on run on a fixed
+    // pool of threads instead of each having its own thread. The pool can't
+    // be resized or turned off without restarting.
+    temp.clear();
+    config.getString("store_thread_pool", temp);
+    if (0 == temp.compare("yes")) {
+      long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      unsigned long pool_size = num_cpus > 0 ? num_cpus : 1;
+      config.getUnsigned("store_thread_pool_size", pool_size);
+      if (pool_size == 0) {
+        LOG_OPER("invalid value for store_thread_pool_size: 0");
+      } else if (!g_storeThreadPool.start(pool_size)) {
+        LOG_OPER("store thread pool already running, ignoring new size <%lu>",
+                 pool_size);
+      }
+    }
+
+    // If latency_stats_interval, hot path latencies are recorded and exported
+    // as counters every that many seconds. Can't be turned off again
+    // without restarting.
+    unsigned long stats_interval = 0;
+    if (config.getUnsigned("latency_stats_interval", stats_interval) &&
+        stats_interval > 0 && !g_latencyStats.isEnabled()) {
+      g_latencyStats.start(stats_interval);
+    }
+
     unsigned long int old_port = port;
     config.getUnsigned("port", port);
     if (old_port != 0 && port != old_port) {
@@ -665,6 +794,15 @@ void scribeHandler::initialize() {
       }
     }
 
+    // num_thrift_io_threads only takes effect when the server starts
+    if (config.getUnsigned("num_thrift_io_threads", num_threads)) {
+      if (num_threads == 0) {
+        LOG_OPER("invalid value for num_thrift_io_threads: %lu", num_threads);
+        throw runtime_error("invalid value for num_thrift_io_threads");
+      }
+      numThriftIoThreads = (size_t) num_threads;
+    }
+
     // Build a new map of stores, and move stores from the old map as
     // we find them in the config file. Any stores left in the old map
     // at the end will be deleted.
@@ -697,14 +835,12 @@ void scribeHandler::initialize() {
     enough_config_to_run = false;
   }
 
-  // clean up existing stores
-  deleteCategoryMap(pcategories);
-  pcategories = NULL;
-  if (pcategory_prefixes) {
-    delete pcategory_prefixes;
-    pcategory_prefixes = NULL;
+  if (enough_config_to_run && pcategories) {
+    keepModelCategories();
   }
-  defaultStore.reset();
+
+  // clean up existing stores
+  deleteStores();
 
   if (enough_config_to_run) {
     pcategories = pnew_categories;
@@ -853,20 +989,30 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
     return shared_ptr<StoreQueue>();
   }
 
-  // look for the store in the current list
+  // Look for the store in the current list. A store with the same config
+  // is kept as it is. Otherwise the old store is stopped here, which
+  // handles what's queued in it and closes its files, before a new one is
+  // created. Stores aren't configured again in place, since configure()
+  // builds on whatever the store already has (bucket and multi stores
+  // would add a second set of children).
+  // A multi-category store made from a model is the model itself, so there
+  // is nothing to look for. Without a thread per category, default and
+  // prefix stores aren't models and are listed under "default" and
+  // "prefix*", so they're found like any other store; keepModelCategories
+  // then keeps the categories that were sent to them.
   shared_ptr<StoreQueue> pstore;
-  if (!is_prefix_category && pcategories) {
-    category_map_t::iterator category_iter = pcategories->find(category);
-    if (category_iter != pcategories->end()) {
-      shared_ptr<store_list_t> pstores = category_iter->second;
-
-      for ( store_list_t::iterator it = pstores->begin(); it != pstores->end(); ++it ) {
-        if ( (*it)->getBaseType() == type &&
-             pstores->size() <=  1) { // no good way to match them up if there's more than one
-          pstore = (*it);
-          pstores->erase(it);
-        }
-      }
+  bool unchanged = false;
+  if (pcategories && (model == NULL || newThreadPerCategory)) {
+    shared_ptr<store_list_t> pstores = pcategories->find(category);
+    // no good way to match them up if there's more than one
+    if (pstores != NULL && pstores->size() == 1 &&
+        pstores->front()->getBaseType() == type &&
+        sameConfig(pstores->front()->getConfiguration(), store_conf)) {
+      unchanged = true;
+      pstore = pstores->front();
+      pstores->clear();
+    } else if (pstores != NULL) {
+      stopStoreList(pstores);
     }
   }
 
@@ -917,7 +1063,9 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
   }
 
   // open store. and configure it if not copied from a model
-  if (model == NULL) {
+  if (unchanged) {
+    LOG_OPER("[%s] config unchanged, keeping store", category.c_str());
+  } else if (model == NULL) {
     pstore->configureAndOpen(store_conf);
   } else if (!already_created) {
     pstore->open();
@@ -928,12 +1076,7 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
     tmpDefault = pstore;
   }
   else if (is_prefix_category) {
-    category_prefix_map_t::iterator category_iter =
-      pnew_category_prefixes->find(category);
-
-    if (category_iter == pnew_category_prefixes->end()) {
-      (*pnew_category_prefixes)[category] = pstore;
-    } else {
+    if (!pnew_category_prefixes->add(category, pstore)) {
       string errormsg =
         "Bad config - multiple prefix stores specified for category: ";
 
@@ -945,13 +1088,10 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
 
   // push the new store onto the new map if it's not just a model
   if (!pstore->isModelStore() && !category_list) {
-    shared_ptr<store_list_t> pstores;
-    category_map_t::iterator category_iter = pnew_categories->find(category);
-    if (category_iter != pnew_categories->end()) {
-      pstores = category_iter->second;
-    } else {
+    shared_ptr<store_list_t> pstores = pnew_categories->find(category);
+    if (pstores == NULL) {
       pstores = shared_ptr<store_list_t>(new store_list_t);
-      (*pnew_categories)[category] = pstores;
+      pnew_categories->insert(category, pstores);
     }
         pstores->push_back(pstore);
   }
@@ -960,15 +1100,59 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
 }
 
 
+// Moves categories that were created on the fly from a model in the old
+// config over to the new one, if the new config would create them from a
+// model that hasn't changed. Everything else left in the old map gets
+// stopped, and is created again when messages for it next arrive.
+void scribeHandler::keepModelCategories() {
+  vector<string> categories;
+  pcategories->getCategories(categories);
+
+  for (vector<string>::iterator iter = categories.begin();
+       iter != categories.end();
+       ++iter) {
+    shared_ptr<store_list_t> pstores = pcategories->find(*iter);
+    if (pstores == NULL || pstores->size() != 1 ||
+        pnew_categories->find(*iter) != NULL) {
+      continue;
+    }
+
+    shared_ptr<StoreQueue> model = pnew_category_prefixes->findModel(*iter);
+    if (model == NULL) {
+      model = tmpDefault;
+    }
+    if (model == NULL) {
+      continue;
+    }
+
+    // without a thread per category the store is the default or prefix
+    // store itself, and it's only the same if that store was kept
+    shared_ptr<StoreQueue> pstore = pstores->front();
+    bool same = newThreadPerCategory ?
+      (pstore != model && pstore->getBaseType() == model->getBaseType() &&
+       sameConfig(pstore->getConfiguration(), model->getConfiguration())) :
+      pstore == model;
+    if (!same) {
+      continue;
+    }
+
+    shared_ptr<store_list_t> kept(new store_list_t(*pstores));
+    pstores->clear();
+    pnew_categories->insert(*iter, kept);
+  }
+}
+
 // delete pcats and everything it contains
-void scribeHandler::deleteCategoryMap(category_map_t *pcats) {
+void scribeHandler::deleteCategoryMap(CategoryTable *pcats) {
   if (!pcats) {
     return;
   }
-  for (category_map_t::iterator cat_iter = pcats->begin();
-       cat_iter != pcats->end();
+  store_list_vector_t all_stores;
+  pcats->getAll(all_stores);
+  for (store_list_vector_t::iterator cat_iter = all_stores.begin();
+       cat_iter != all_stores.end();
        ++cat_iter) {
-    shared_ptr<store_list_t> pstores = cat_iter->second;
+    shared_ptr<store_list_t> pstores = *cat_iter;
     if (!pstores) {
       throw std::logic_error("deleteCategoryMap: iterator in category map holds null pointer");
     }
@@ -978,11 +1162,22 @@ void scribeHandler::deleteCategoryMap(category_map_t *pcats) {
       if (!*store_iter) {
         throw std::logic_error("deleteCategoryMap: iterator in store map holds null pointer");
       }
-
-      (*store_iter)->stop();
     } // for each store
-    pstores->clear();
+    stopStoreList(pstores);
   } // for each category
   pcats->clear();
   delete pcats;
 }
+
+// Stops the stores in pstores and empties it. A store that is listed under
+// more than one category may already have been stopped.
+void scribeHandler::stopStoreList(shared_ptr<store_list_t> pstores) {
+  for (store_list_t::iterator store_iter = pstores->begin();
+       store_iter != pstores->end();
+       ++store_iter) {
+    if (!(*store_iter)->isStopping()) {
+      (*store_iter)->stop();
+    }
+  }
+  pstores->clear();
+}
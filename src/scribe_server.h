@@ -26,10 +26,13 @@
 
 #include "store.h"
 #include "store_queue.h"
+#include "category_table.h"
+#include "rate_limiter.h"
 
-typedef std::vector<boost::shared_ptr<StoreQueue> > store_list_t;
-typedef std::map<std::string, boost::shared_ptr<store_list_t> > category_map_t;
-typedef std::map<std::string, boost::shared_ptr<StoreQueue> > category_prefix_map_t;
+// The batch for each category in one Log call, and the stores it goes to
+typedef std::vector<std::pair<category_batch_map_t::iterator,
+                              boost::shared_ptr<store_list_t> > >
+  category_route_vector_t;
 
 std::string resultCodeToString(scribe::thrift::ResultCode rc);
 
@@ -37,6 +40,8 @@ void incCounter(std::string category, std::string counter);
 void incCounter(std::string category, std::string counter, long amount);
 void incCounter(std::string counter);
 void incCounter(std::string counter, long amount);
+void setCounter(std::string category, std::string counter, long value);
+void setCounter(std::string counter, long value);
 
 class scribeHandler : virtual public scribe::thrift::scribeIf,
                               public facebook::fb303::FacebookBase {
@@ -46,6 +51,8 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   ~scribeHandler();
 
   void shutdown();
+  // stops every store, handling what's queued in them, without exiting
+  void stopAllStores();
   void initialize();
   void reinitialize();
 
@@ -62,47 +69,57 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   // number of threads processing new Thrift connections
   size_t numThriftServerThreads;
 
+  // number of event loops reading from Thrift connections, each on its own
+  // thread. With more than one, calls are processed on these threads and
+  // numThriftServerThreads is ignored.
+  size_t numThriftIoThreads;
+
  private:
   unsigned long checkPeriod; // periodic check interval for all contained stores
 
   // This map has an entry for each configured category.
   // Each of these entries is a map of type->StoreQueue.
   // The StoreQueue contains a store, which could contain additional stores.
-  category_map_t* pcategories;
-  category_prefix_map_t* pcategory_prefixes;
+  CategoryTable* pcategories;
+  CategoryPrefixIndex* pcategory_prefixes;
 
   // the default store
   boost::shared_ptr<StoreQueue> defaultStore;
 
   // temp versions of the above 3 pointers to use during initialization
-  category_map_t* pnew_categories;
-  category_prefix_map_t* pnew_category_prefixes;
+  CategoryTable* pnew_categories;
+  CategoryPrefixIndex* pnew_category_prefixes;
   boost::shared_ptr<StoreQueue> tmpDefault;
 
   std::string configFilename;
   facebook::fb303::fb_status status;
   std::string statusDetails;
   apache::thrift::concurrency::Mutex statusLock;
-  time_t lastMsgTime;
-  unsigned long numMsgLastSecond;
   unsigned long maxMsgPerSecond;
+  unsigned long long maxBytesPerSecond;
+  RateLimiter globalLimiter;
   unsigned long long maxQueueSize;
   bool newThreadPerCategory;
+  unsigned long throttleStatId; // for g_latencyStats
 
   /* mutex to syncronize access to scribeHandler.
    * A single mutex is fine since it only needs to be locked in write mode
-   * during start/stop/reinitialize or when we need to create a new category.
+   * during start/stop/reinitialize. The category table does its own
+   * locking for lookups and inserts.
    */
   apache::thrift::concurrency::ReadWriteMutex scribeHandlerLock;
 
+  // serializes creating new categories, without blocking lookups
+  apache::thrift::concurrency::Mutex categoryCreateLock;
+
   // disallow empty construction, copy, and assignment
   scribeHandler();
   scribeHandler(const scribeHandler& rhs);
   const scribeHandler& operator=(const scribeHandler& rhs);
 
  protected:
-  bool throttleDeny(int num_messages); // returns true if overloaded
-  void deleteCategoryMap(category_map_t *pcats);
+  void deleteCategoryMap(CategoryTable *pcats);
+  void stopStoreList(boost::shared_ptr<store_list_t> pstores);
   const char* statusAsString(facebook::fb303::fb_status new_status);
   bool createCategoryFromModel(const std::string &category,
                                const boost::shared_ptr<StoreQueue> &model);
@@ -113,11 +130,20 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
                            bool category_list=false);
   bool configureStore(pStoreConf store_conf, int* num_stores);
   void stopStores();
+  void deleteStores();
+  void keepModelCategories();
   bool throttleRequest(const std::vector<scribe::thrift::LogEntry>&  messages);
+  bool acquireRateBudget(const category_route_vector_t& routes,
+                         unsigned long num_messages,
+                         unsigned long long num_bytes);
   boost::shared_ptr<store_list_t>
     createNewCategory(const std::string& category);
-  void addMessage(const scribe::thrift::LogEntry& entry,
-                  const boost::shared_ptr<store_list_t>& store_list);
+  void addMessages(const std::string& category,
+                   const boost::shared_ptr<logentry_vector_t>& messages,
+                   const boost::shared_ptr<store_list_t>& store_list);
 };
 
+// The handler counters are reported to. Set up by main.
+extern boost::shared_ptr<scribeHandler> g_Handler;
+
 #endif // SCRIBE_SERVER_H
@@ -0,0 +1,444 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <sys/file.h>
+#include "common.h"
+#include "spill_file.h"
+#include "entry_arena.h"
+
+#define SPILL_RECORD_HEADER_SIZE 8
+
+// magic (4 bytes), version (4 bytes), read offset (8 bytes)
+#define SPILL_FILE_HEADER_SIZE 16
+#define SPILL_FILE_READ_OFFSET_POS 8
+#define SPILL_FILE_VERSION 1
+
+// records larger than this are treated as corrupt
+#define SPILL_MAX_RECORD_SIZE (256 * 1024 * 1024)
+
+// least to read at once when reading back
+#define SPILL_READ_SIZE (64 * 1024)
+
+// seconds between attempts to open the file after a failure
+#define SPILL_OPEN_RETRY_INTERVAL 1
+
+using namespace std;
+using namespace scribe::thrift;
+
+static const char spillFileMagic[5] = "SSPL";
+
+static void appendUInt(string& buf, unsigned long long value, int bytes = 4) {
+  for (int i = 0; i < bytes; ++i) {
+    buf.push_back((char)((value >> (8 * i)) & 0xFF));
+  }
+}
+
+static unsigned long long readUInt(const char* buf, int bytes) {
+  unsigned long long value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value |= (unsigned long long)(unsigned char)buf[i] << (8 * i);
+  }
+  return value;
+}
+
+static unsigned readUInt(const char* buf) {
+  return (unsigned)readUInt(buf, 4);
+}
+
+static void appendRecord(string& buf, const LogEntry& entry) {
+  appendUInt(buf, 4 + entry.category.length() + entry.message.length());
+  appendUInt(buf, entry.category.length());
+  buf += entry.category;
+  buf += entry.message;
+}
+
+// Reads up to len bytes at offset, returning how many were read or -1
+static ssize_t preadFull(int fd, char* buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = ::pread(fd, buf + done, len - done, offset + done);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (r == 0) {
+      break;
+    }
+    done += r;
+  }
+  return done;
+}
+
+SpillFile::SpillFile(const std::string& name)
+  : filename(name),
+    fd(-1),
+    readOffset(0),
+    writeOffset(0),
+    active(false),
+    healthy(true),
+    lastOpenAttempt(0) {
+  pthread_mutex_init(&mutex, NULL);
+}
+
+SpillFile::~SpillFile() {
+  close();
+  pthread_mutex_destroy(&mutex);
+}
+
+bool SpillFile::open() {
+  pthread_mutex_lock(&mutex);
+  bool success = fd >= 0 || openLocked();
+  pthread_mutex_unlock(&mutex);
+  return success;
+}
+
+// Another queue for the same category may still be running, e.g. while
+// the config is reloaded, so the file is locked to keep them from both
+// using it. Whoever gets it second waits for the first to finish with it.
+bool SpillFile::openLocked() {
+  lastOpenAttempt = time(NULL);
+
+  try {
+    boost::filesystem::path dir =
+      boost::filesystem::path(filename).branch_path();
+    if (!dir.empty()) {
+      boost::filesystem::create_directories(dir);
+    }
+  } catch(std::exception const& e) {
+    LOG_OPER("Exception < %s > trying to create directory for <%s>",
+             e.what(), filename.c_str());
+    return false;
+  }
+
+  int new_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (new_fd < 0) {
+    LOG_OPER("Failed to open spill file <%s>: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  if (flock(new_fd, LOCK_EX | LOCK_NB) != 0) {
+    LOG_OPER("Spill file <%s> is in use: %s",
+             filename.c_str(), strerror(errno));
+    ::close(new_fd);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(new_fd, &st) != 0) {
+    LOG_OPER("Failed to stat spill file <%s>: %s",
+             filename.c_str(), strerror(errno));
+    ::close(new_fd);
+    return false;
+  }
+  unsigned long long size = st.st_size;
+
+  // where the last reader got to
+  unsigned long long saved_offset = SPILL_FILE_HEADER_SIZE;
+  char file_header[SPILL_FILE_HEADER_SIZE];
+  if (size > 0) {
+    if (size < SPILL_FILE_HEADER_SIZE ||
+        preadFull(new_fd, file_header, SPILL_FILE_HEADER_SIZE, 0) !=
+          SPILL_FILE_HEADER_SIZE ||
+        0 != memcmp(file_header, spillFileMagic, 4) ||
+        readUInt(file_header + 4) != SPILL_FILE_VERSION) {
+      LOG_OPER("ERROR: Bad header in spill file <%s>, dropping <%llu> bytes",
+               filename.c_str(), size);
+      size = 0;
+    } else {
+      saved_offset = readUInt(file_header + SPILL_FILE_READ_OFFSET_POS, 8);
+    }
+  }
+
+  // find the end of the last complete record, and check that the saved
+  // offset is at the start of one
+  unsigned long long end = SPILL_FILE_HEADER_SIZE;
+  bool offset_found = (saved_offset == end);
+  char header[SPILL_RECORD_HEADER_SIZE];
+  while (end + SPILL_RECORD_HEADER_SIZE <= size &&
+         preadFull(new_fd, header, SPILL_RECORD_HEADER_SIZE, end) ==
+           SPILL_RECORD_HEADER_SIZE) {
+    unsigned length = readUInt(header);
+    if (length < 4 || length > SPILL_MAX_RECORD_SIZE ||
+        readUInt(header + 4) > length - 4 ||
+        end + 4 + length > size) {
+      break;
+    }
+    end += 4 + length;
+    offset_found = offset_found || saved_offset == end;
+  }
+  if (size > 0 && end < size) {
+    LOG_OPER("Dropping <%llu> bytes of partial records from spill file <%s>",
+             size - end, filename.c_str());
+  }
+  if (!offset_found) {
+    LOG_OPER("ERROR: Bad read offset <%llu> in spill file <%s>, reading it all back",
+             saved_offset, filename.c_str());
+    saved_offset = SPILL_FILE_HEADER_SIZE;
+  }
+
+  // nothing left to read, start over with an empty file
+  if (saved_offset >= end) {
+    end = SPILL_FILE_HEADER_SIZE;
+    saved_offset = end;
+  }
+
+  if (end != (unsigned long long)st.st_size) {
+    if (ftruncate(new_fd, end) != 0) {
+      LOG_OPER("Failed to truncate spill file <%s>: %s",
+               filename.c_str(), strerror(errno));
+    }
+  }
+
+  fd = new_fd;
+  readOffset = saved_offset;
+  writeOffset = end;
+  if (!writeHeader()) {
+    ::close(new_fd);
+    fd = -1;
+    return false;
+  }
+
+  active = (readOffset < writeOffset);
+  if (active) {
+    LOG_OPER("Reading back <%llu> bytes left in spill file <%s>",
+             writeOffset - readOffset, filename.c_str());
+  }
+  healthy = true;
+  return true;
+}
+
+// Writes a fresh header with readOffset. Must hold mutex.
+bool SpillFile::writeHeader() {
+  string buf(spillFileMagic, 4);
+  appendUInt(buf, SPILL_FILE_VERSION);
+  appendUInt(buf, readOffset, 8);
+  if (::pwrite(fd, buf.data(), buf.length(), 0) != (ssize_t)buf.length()) {
+    LOG_OPER("Failed to write header of spill file <%s>: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Records readOffset in the file, so what has been read back isn't read
+// again after a restart. Must hold mutex.
+bool SpillFile::saveReadOffset() {
+  string buf;
+  appendUInt(buf, readOffset, 8);
+  if (::pwrite(fd, buf.data(), buf.length(), SPILL_FILE_READ_OFFSET_POS) !=
+      (ssize_t)buf.length()) {
+    LOG_OPER("Failed to save read offset of spill file <%s>: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Truncates the file back to just the header. Must hold mutex.
+void SpillFile::reset() {
+  readOffset = SPILL_FILE_HEADER_SIZE;
+  writeOffset = SPILL_FILE_HEADER_SIZE;
+  active = false;
+  if (ftruncate(fd, SPILL_FILE_HEADER_SIZE) != 0) {
+    LOG_OPER("Failed to truncate spill file <%s>: %s",
+             filename.c_str(), strerror(errno));
+  }
+  saveReadOffset();
+}
+
+// Anything not read back stays in the file for the next open(), which
+// carries on from the saved read offset
+void SpillFile::close() {
+  pthread_mutex_lock(&mutex);
+  if (fd >= 0) {
+    if (!active) {
+      reset();
+    }
+    ::close(fd);
+    fd = -1;
+  }
+  active = false;
+  pthread_mutex_unlock(&mutex);
+}
+
+bool SpillFile::append(const logentry_vector_t& entries) {
+  string buf;
+  for (logentry_vector_t::const_iterator iter = entries.begin();
+       iter != entries.end();
+       ++iter) {
+    appendRecord(buf, **iter);
+  }
+  return writeRecords(buf);
+}
+
+bool SpillFile::append(logentry_ptr_t entry) {
+  string buf;
+  appendRecord(buf, *entry);
+  return writeRecords(buf);
+}
+
+// Opens the file if it isn't open and it's been long enough since the
+// last try. Must hold mutex.
+bool SpillFile::retryOpen() {
+  if (fd >= 0) {
+    return true;
+  }
+  if (time(NULL) - lastOpenAttempt < SPILL_OPEN_RETRY_INTERVAL) {
+    return false;
+  }
+  return openLocked();
+}
+
+bool SpillFile::writeRecords(const std::string& buf) {
+  pthread_mutex_lock(&mutex);
+  if (!retryOpen()) {
+    healthy = false;
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+
+  size_t done = 0;
+  while (done < buf.length()) {
+    ssize_t written = ::pwrite(fd, buf.data() + done, buf.length() - done,
+                               writeOffset + done);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_OPER("Failed to write to spill file <%s>: %s",
+               filename.c_str(), strerror(errno));
+      // anything written past writeOffset gets overwritten next time
+      healthy = false;
+      pthread_mutex_unlock(&mutex);
+      return false;
+    }
+    done += written;
+  }
+
+  writeOffset += buf.length();
+  active = true;
+  healthy = true;
+  pthread_mutex_unlock(&mutex);
+  return true;
+}
+
+bool SpillFile::read(logentry_vector_t& entries,
+                     unsigned long long max_bytes,
+                     unsigned long long& bytes) {
+  pthread_mutex_lock(&mutex);
+  if (!retryOpen() || !active) {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  // appends only ever go past these, so the range can be read unlocked
+  int read_fd = fd;
+  unsigned long long offset = readOffset;
+  unsigned long long end = writeOffset;
+  pthread_mutex_unlock(&mutex);
+
+  string buf;
+  size_t pos = 0;
+  size_t first_entry = entries.size();
+  unsigned long long read_bytes = 0;
+  bool corrupt = false;
+  LogEntryArena arena;
+  while (offset + pos < end && read_bytes < max_bytes) {
+    size_t available = buf.length() - pos;
+    unsigned long long needed = SPILL_RECORD_HEADER_SIZE;
+    if (available >= SPILL_RECORD_HEADER_SIZE) {
+      needed = 4 + (unsigned long long)readUInt(&buf[pos]);
+    }
+
+    if (needed > available) {
+      // refill from the start of the next record
+      offset += pos;
+      pos = 0;
+      if (needed > SPILL_MAX_RECORD_SIZE || needed > end - offset) {
+        corrupt = true;
+        break;
+      }
+      size_t want = (size_t)min(end - offset,
+                                max(needed,
+                                    max((unsigned long long)SPILL_READ_SIZE,
+                                        max_bytes - read_bytes)));
+      buf.resize(want);
+      ssize_t got = preadFull(read_fd, &buf[0], want, offset);
+      if (got < 0) {
+        // try again next time
+        LOG_OPER("Failed to read spill file <%s> at offset %llu: %s",
+                 filename.c_str(), offset, strerror(errno));
+        break;
+      }
+      if (got < (ssize_t)want) {
+        corrupt = true;
+        break;
+      }
+      continue;
+    }
+
+    unsigned length = readUInt(&buf[pos]);
+    unsigned category_length = readUInt(&buf[pos + 4]);
+    if (length < 4 || category_length > length - 4) {
+      corrupt = true;
+      break;
+    }
+
+    logentry_ptr_t entry = arena.allocate();
+    entry->category.assign(buf, pos + SPILL_RECORD_HEADER_SIZE,
+                           category_length);
+    entry->message.assign(buf, pos + SPILL_RECORD_HEADER_SIZE + category_length,
+                          length - 4 - category_length);
+    entries.push_back(entry);
+    read_bytes += entry->message.length();
+    pos += 4 + length;
+  }
+  offset += pos;
+  bytes += read_bytes;
+
+  if (corrupt) {
+    // nothing after a bad record can be trusted, and leaving it would
+    // hold up everything spilled after it
+    LOG_OPER("ERROR: Bad record in spill file <%s>, dropping <%llu> bytes",
+             filename.c_str(), end - offset);
+    offset = end;
+  }
+
+  // The records are consumed once they're returned: the offset is saved
+  // before the caller sees them, so they are never read back twice.
+  pthread_mutex_lock(&mutex);
+  if (fd == read_fd) {
+    readOffset = offset;
+    if (readOffset >= writeOffset) {
+      // all caught up, start over with an empty file
+      reset();
+    } else {
+      saveReadOffset();
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return entries.size() > first_entry;
+}
+
+unsigned long long SpillFile::getSize() {
+  pthread_mutex_lock(&mutex);
+  unsigned long long size = writeOffset - readOffset;
+  pthread_mutex_unlock(&mutex);
+  return size;
+}
@@ -0,0 +1,95 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_SPILL_FILE_H
+#define SCRIBE_SPILL_FILE_H
+
+#include "common.h"
+
+/*
+ * Append-only file a StoreQueue moves messages to when it is over its
+ * memory budget, and reads them back from in order once it has room.
+ *
+ * The file starts with a 16 byte header: magic, version and the offset of
+ * the first record not read back yet. Each record is the record length,
+ * the category length (4 bytes each, little endian), the category and the
+ * message. Once everything written has been read back the file is
+ * truncated and the spill goes inactive, so callers can tell whether new
+ * messages have to queue up behind it.
+ *
+ * read() saves the new offset in the header before returning the records,
+ * so each record is handed out at most once, even across restarts. Records
+ * an earlier run didn't get to are read back when the file is opened again;
+ * a partial record at the end of the file is dropped. The file is locked
+ * while open, and append() and read() open it themselves (retrying about
+ * once a second) if open() hasn't been called or didn't work.
+ *
+ * append() may be called from any thread. Only one thread at a time may
+ * call read().
+ */
+class SpillFile {
+ public:
+  SpillFile(const std::string& filename);
+  ~SpillFile();
+
+  bool open();
+  void close();
+
+  // Returns false if the messages could not be written, in which case
+  // none of them were.
+  bool append(const logentry_vector_t& entries);
+  bool append(logentry_ptr_t entry);
+
+  // Reads the oldest messages, about max_bytes of them (always at least
+  // one if there are any), and adds their message size to bytes.
+  // Returns false if there was nothing to read.
+  bool read(logentry_vector_t& entries, unsigned long long max_bytes,
+            unsigned long long& bytes);
+
+  // whether there are messages that haven't been read back
+  bool isActive() const {return active;}
+  bool isOpen() const {return fd >= 0;}
+  // false after a failed write, until the next write succeeds
+  bool isHealthy() const {return healthy;}
+  // bytes on disk not read back yet
+  unsigned long long getSize();
+  const std::string& getFilename() const {return filename;}
+
+ private:
+  std::string filename;
+  volatile int fd;
+  unsigned long long readOffset;
+  unsigned long long writeOffset;
+  volatile bool active;
+  volatile bool healthy;
+  time_t lastOpenAttempt;
+  pthread_mutex_t mutex; // protects everything above
+
+  bool openLocked();   // these must hold mutex
+  bool retryOpen();
+  bool writeHeader();
+  bool saveReadOffset();
+  void reset();
+  bool writeRecords(const std::string& buf);
+
+  // disallow copy, assignment, and empty construction
+  SpillFile();
+  SpillFile(SpillFile& rhs);
+  SpillFile& operator=(SpillFile& rhs);
+};
+
+#endif // !defined SCRIBE_SPILL_FILE_H
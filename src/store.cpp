@@ -26,6 +26,9 @@
 #include "common.h"
 #include "scribe_server.h"
 #include "thrift/transport/TSimpleFileTransport.h"
+#include "timer_wheel.h"
+#include "entry_arena.h"
+#include "latency_stats.h"
 
 using namespace std;
 using namespace boost;
@@ -40,12 +43,22 @@ using namespace scribe::thrift;
 #define DEFAULT_FILESTORE_MAX_WRITE_SIZE         1000000
 #define DEFAULT_FILESTORE_ROLL_HOUR              1
 #define DEFAULT_FILESTORE_ROLL_MINUTE            15
+#define DEFAULT_FILESTORE_INDEX_CHUNK_SIZE       1000000
+#define DEFAULT_FILESTORE_SYNC_INTERVAL_MS       1000
 #define DEFAULT_BUFFERSTORE_MAX_QUEUE_LENGTH     2000000
 #define DEFAULT_BUFFERSTORE_SEND_RATE            1
+#define DEFAULT_BUFFERSTORE_SEND_CHUNK_SIZE      0
 #define DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL   300
 #define DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE 60
 #define DEFAULT_BUCKETSTORE_DELIMITER            ':'
 #define DEFAULT_NETWORKSTORE_CACHE_TIMEOUT       300
+#define DEFAULT_NETWORKSTORE_COMPRESSION_LEVEL   1
+
+// Saved next to a buffer file with how far it has been replayed
+#define OFFSET_FILE_SUFFIX                       ".offset"
+#define OFFSET_FILE_VERSION                      1
+// how much of the first record in a file is kept to recognize it
+#define OFFSET_FILE_ID_SIZE                      256
 
 ConnPool g_connPool;
 
@@ -110,6 +123,18 @@ bool Store::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
   return false;
 }
 
+bool Store::readOldestChunk(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
+                            struct tm* now, unsigned long& offset,
+                            unsigned long max_bytes, bool& eof,
+                            std::vector<unsigned long>* message_offsets) {
+  eof = true;
+  if (offset != 0) {
+    LOG_OPER("[%s] ERROR: store can't read from an offset", categoryHandled.c_str());
+    return false;
+  }
+  return readOldest(messages, now);
+}
+
 bool Store::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
                           struct tm* now) {
   LOG_OPER("[%s] ERROR: attempting to read from a write-only store", categoryHandled.c_str());
@@ -125,6 +150,13 @@ bool Store::empty(struct tm* now) {
   return true;
 }
 
+void Store::saveOldestOffset(struct tm* now, unsigned long offset) {
+}
+
+unsigned long Store::loadOldestOffset(struct tm* now) {
+  return 0;
+}
+
 const std::string& Store::getType() {
   return storeType;
 }
@@ -153,6 +185,7 @@ FileStoreBase::FileStoreBase(const string& category, const string &type,
     lzoCompressionLevel(0),
     currentSize(0),
     lastRollTime(0),
+    nextRollCheck(0),
     eventsWritten(0) {
 }
 
@@ -316,20 +349,31 @@ void FileStoreBase::periodicCheck() {
 
   time_t rawtime = time(NULL);
   struct tm timeinfo;
-  localtime_r(&rawtime, &timeinfo);
 
   // Roll the file if we're over max size, or an hour or day has passed
   bool rotate = ((currentSize > maxSize) && (maxSize != 0));
   if (!rotate) {
     switch (rollPeriod) {
       case ROLL_DAILY:
+        // Daily and hourly rolls only change on a minute boundary, so
+        // there's no need to break down the time more than once a minute.
+        if (rawtime < nextRollCheck) {
+          break;
+        }
+        localtime_r(&rawtime, &timeinfo);
         rotate = timeinfo.tm_mday != lastRollTime &&
                  static_cast<uint>(timeinfo.tm_hour) >= rollHour &&
                  static_cast<uint>(timeinfo.tm_min) >= rollMinute;
+        nextRollCheck = rawtime - timeinfo.tm_sec + 60;
         break;
       case ROLL_HOURLY:
+        if (rawtime < nextRollCheck) {
+          break;
+        }
+        localtime_r(&rawtime, &timeinfo);
         rotate = timeinfo.tm_hour != lastRollTime &&
                  static_cast<uint>(timeinfo.tm_min) >= rollMinute;
+        nextRollCheck = rawtime - timeinfo.tm_sec + 60;
         break;
       case ROLL_OTHER:
         rotate = rawtime >= lastRollTime + rollPeriodLength;
@@ -465,6 +509,13 @@ int FileStoreBase::findOldestFile(const string& base_filename) {
   return min_suffix;
 }
 
+static bool isOffsetFilename(const string& filename) {
+  static const string suffix(OFFSET_FILE_SUFFIX);
+  return filename.length() > suffix.length() &&
+    0 == filename.compare(filename.length() - suffix.length(),
+                          suffix.length(), suffix);
+}
+
 int FileStoreBase::getFileSuffix(const string& filename, const string& base_filename) {
   int suffix = -1;
 
@@ -478,7 +529,9 @@ int FileStoreBase::getFileSuffix(const string& filename, const string& base_file
     mybase  = base_filename;
   }
   
-  bool retVal = (0 == filename.substr(0, suffix_pos).compare(mybase));
+  bool retVal = (0 == filename.substr(0, suffix_pos).compare(mybase)) &&
+    !ChunkIndex::isIndexFilename(filename) &&
+    !isOffsetFilename(filename);
   
   if (string::npos != suffix_pos &&
       filename.length() > suffix_pos &&
@@ -579,7 +632,22 @@ FileStore::FileStore(const string& category, bool multi_category,
                      bool is_buffer_file)
   : FileStoreBase(category, "file", multi_category),
     isBufferFile(is_buffer_file),
-    addNewlines(false) {
+    addNewlines(false),
+    compression(CompressedFile::CODEC_NONE),
+    compressionLevel(1),
+    writeIndex(false),
+    indexChunkSize(0),
+    readThreads(0),
+    durability(DURABILITY_NONE),
+    syncIntervalMs(DEFAULT_FILESTORE_SYNC_INTERVAL_MS),
+    syncFileRange(false),
+    preallocate(false),
+    writeStatId(0),
+    flushStatId(0),
+    unsynced(false),
+    lastSyncMs(0),
+    indexValid(false) {
+  setStatIds();
 }
 
 FileStore::~FileStore() {
@@ -615,6 +683,100 @@ void FileStore::configure(pStoreConf configuration) {
   unsigned long inttemp = 0;
   configuration->getUnsigned("add_newlines", inttemp);
   addNewlines = inttemp ? true : false;
+
+  string tmp;
+  if (configuration->getString("compression", tmp)) {
+    if (0 == tmp.compare("zlib")) {
+      compression = CompressedFile::CODEC_ZLIB;
+    } else if (0 == tmp.compare("lz4") || 0 == tmp.compare("zstd")) {
+      LOG_OPER("[%s] compression <%s> is not supported, using zlib",
+               categoryHandled.c_str(), tmp.c_str());
+      compression = CompressedFile::CODEC_ZLIB;
+    } else if (0 == tmp.compare("none")) {
+      compression = CompressedFile::CODEC_NONE;
+    } else {
+      LOG_OPER("[%s] Bad config - unknown compression <%s>",
+               categoryHandled.c_str(), tmp.c_str());
+    }
+  }
+  if (configuration->getUnsigned("compression_level", compressionLevel) &&
+      compressionLevel > 9) {
+    LOG_OPER("[%s] Bad config - compression_level must be at most 9",
+             categoryHandled.c_str());
+    compressionLevel = 9;
+  }
+  if (compression != CompressedFile::CODEC_NONE && fsType.compare("std")) {
+    LOG_OPER("[%s] compression is only supported for fs_type std",
+             categoryHandled.c_str());
+    compression = CompressedFile::CODEC_NONE;
+  }
+
+  if (configuration->getString("write_index", tmp)) {
+    if (0 == tmp.compare("yes")) {
+      writeIndex = true;
+    } else {
+      writeIndex = false;
+    }
+  }
+  if (!configuration->getUnsigned("index_chunk_size", indexChunkSize) ||
+      indexChunkSize == 0) {
+    indexChunkSize = chunkSize ? chunkSize : DEFAULT_FILESTORE_INDEX_CHUNK_SIZE;
+  }
+  // offsets in the index are offsets into the uncompressed data
+  if (writeIndex &&
+      (compression != CompressedFile::CODEC_NONE || lzoCompressionLevel > 0)) {
+    LOG_OPER("[%s] write_index is not supported for compressed files",
+             categoryHandled.c_str());
+    writeIndex = false;
+  }
+
+  configuration->getUnsigned("read_threads", readThreads);
+
+  if (configuration->getString("durability", tmp)) {
+    if (0 == tmp.compare("none")) {
+      durability = DURABILITY_NONE;
+    } else if (0 == tmp.compare("interval")) {
+      durability = DURABILITY_INTERVAL;
+    } else if (0 == tmp.compare("group_commit")) {
+      durability = DURABILITY_GROUP_COMMIT;
+    } else {
+      LOG_OPER("[%s] Bad config - unknown durability <%s>",
+               categoryHandled.c_str(), tmp.c_str());
+    }
+  }
+  configuration->getUnsigned("sync_interval_ms", syncIntervalMs);
+
+  if (configuration->getString("sync_file_range", tmp)) {
+    if (0 == tmp.compare("yes")) {
+      syncFileRange = true;
+    } else {
+      syncFileRange = false;
+    }
+  }
+  if (configuration->getString("preallocate", tmp)) {
+    if (0 == tmp.compare("yes")) {
+      preallocate = true;
+    } else {
+      preallocate = false;
+    }
+  }
+
+  setStatIds();
+}
+
+void FileStore::setStatIds() {
+  writeStatId = g_latencyStats.getId("file " + fsType + " write us");
+  flushStatId = g_latencyStats.getId("file " + fsType + " flush us");
+}
+
+// Local files are always CompressedFiles, so files written with compression
+// can be read back even after it's turned off.
+shared_ptr<FileInterface> FileStore::createFile(const std::string& name) {
+  if (0 == fsType.compare("std")) {
+    return shared_ptr<FileInterface>(
+      new CompressedFile(name, isBufferFile, compression, compressionLevel));
+  }
+  return FileInterface::createFileInterface(fsType, name, isBufferFile);
 }
 
 bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
@@ -659,10 +821,12 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
       if (writeMeta) {
         writeFile->write(meta_logfile_prefix + file);
       }
+      syncFile(true);
       writeFile->close();
+      saveIndex();
     }
 
-    writeFile = FileInterface::createFileInterface(fsType, file, isBufferFile);
+    writeFile = createFile(file);
     if (!writeFile) {
       LOG_OPER("[%s] Failed to create file <%s> of type <%s> for writing",
                categoryHandled.c_str(), file.c_str(), fsType.c_str());
@@ -711,6 +875,14 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
       currentSize = writeFile->fileSize();
       currentFilename = file;
       eventsWritten = 0;
+      startIndex();
+
+      if (preallocate && maxSize > currentSize) {
+        writeFile->preallocate(maxSize);
+      }
+      writeFile->setEagerWriteback(syncFileRange);
+      unsynced = false;
+      lastSyncMs = currentTimeMs();
       setStatus("");
     }
 
@@ -731,14 +903,113 @@ bool FileStore::isOpen() {
 
 void FileStore::close() {
   if (writeFile) {
+    bool was_open = writeFile->isOpen();
+    syncFile(true);
     writeFile->close();
+    if (was_open) {
+      saveIndex();
+    }
+  }
+}
+
+// Starts the index for the file just opened. Appending to a file can only
+// continue its index if the saved index covers the whole file.
+void FileStore::startIndex() {
+  indexValid = false;
+  if (!writeIndex) {
+    return;
+  }
+
+  chunkIndex.reset(indexChunkSize);
+  if (currentSize == 0) {
+    indexValid = true;
+  } else if (readIndex(currentFilename, chunkIndex) &&
+             chunkIndex.getFileSize() == currentSize &&
+             chunkIndex.getChunkSize() == indexChunkSize) {
+    indexValid = true;
+  } else {
+    chunkIndex.reset(indexChunkSize);
+    // don't leave an index around that doesn't match the file
+    shared_ptr<FileInterface> stale = FileInterface::createFileInterface(
+      fsType, ChunkIndex::makeIndexFilename(currentFilename), true);
+    if (stale) {
+      stale->deleteFile();
+    }
+  }
+}
+
+void FileStore::saveIndex() {
+  if (!indexValid) {
+    return;
+  }
+  indexValid = false;
+
+  string filename = ChunkIndex::makeIndexFilename(currentFilename);
+  shared_ptr<FileInterface> index_file =
+    FileInterface::createFileInterface(fsType, filename, true);
+  if (!index_file || !index_file->openTruncate() ||
+      !chunkIndex.write(index_file, currentSize)) {
+    LOG_OPER("[%s] Failed to write index file <%s>",
+             categoryHandled.c_str(), filename.c_str());
+  }
+  if (index_file) {
+    index_file->close();
+  }
+}
+
+bool FileStore::readIndex(const std::string& filename, ChunkIndex& index) {
+  shared_ptr<FileInterface> index_file = FileInterface::createFileInterface(
+    fsType, ChunkIndex::makeIndexFilename(filename), true);
+  if (!index_file || !index_file->openRead()) {
+    return false;
   }
+  bool success = index.read(index_file);
+  index_file->close();
+  return success;
 }
 
 void FileStore::flush() {
   if (writeFile) {
-    writeFile->flush();
+    if (g_latencyStats.isEnabled()) {
+      unsigned long long start = currentTimeUs();
+      writeFile->flush();
+      g_latencyStats.record(flushStatId, currentTimeUs() - start);
+    } else {
+      writeFile->flush();
+    }
+    if (!syncFile(false)) {
+      // After a failed sync the file may have lost writes that it reported
+      // as done, so stop appending to it. The next write opens a new file.
+      close();
+    }
+  }
+}
+
+// Syncs writeFile if the durability setting calls for it now. force ignores
+// sync_interval_ms, for files that are about to be closed. Returns false if
+// the sync failed, in which case the writes are still counted as unsynced.
+bool FileStore::syncFile(bool force) {
+  if (durability == DURABILITY_NONE || !unsynced ||
+      !writeFile || !writeFile->isOpen()) {
+    return true;
+  }
+
+  unsigned long long now = currentTimeMs();
+  if (!force && durability == DURABILITY_INTERVAL &&
+      now < lastSyncMs + syncIntervalMs) {
+    return true;
+  }
+
+  lastSyncMs = now;
+  if (!writeFile->sync()) {
+    LOG_OPER("[%s] Failed to sync file <%s>",
+             categoryHandled.c_str(), currentFilename.c_str());
+    setStatus("File sync error");
+    incCounter(categoryHandled, "sync failed");
+    return false;
   }
+  unsynced = false;
+  return true;
 }
 
 shared_ptr<Store> FileStore::copy(const std::string &category) {
@@ -746,7 +1017,17 @@ shared_ptr<Store> FileStore::copy(const std::string &category) {
   shared_ptr<Store> copied = shared_ptr<Store>(store);
 
   store->addNewlines = addNewlines;
+  store->compression = compression;
+  store->compressionLevel = compressionLevel;
+  store->writeIndex = writeIndex;
+  store->indexChunkSize = indexChunkSize;
+  store->readThreads = readThreads;
+  store->durability = durability;
+  store->syncIntervalMs = syncIntervalMs;
+  store->syncFileRange = syncFileRange;
+  store->preallocate = preallocate;
   store->copyCommon(this);
+  store->setStatIds();
   return copied;
 }
 
@@ -764,19 +1045,45 @@ bool FileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   return writeMessages(messages);
 }
 
+// adds a buffer to a list of buffers for writev, skipping empty ones
+static void appendIov(vector<struct iovec>& iov, const char* data,
+                      size_t length) {
+  if (length == 0) {
+    return;
+  }
+  struct iovec entry;
+  entry.iov_base = const_cast<char*>(data);
+  entry.iov_len = length;
+  iov.push_back(entry);
+}
+
+static void appendIov(vector<struct iovec>& iov, const string& data) {
+  appendIov(iov, data.data(), data.length());
+}
+
 // writes messages to either the specified file or the the current writeFile
 bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                               boost::shared_ptr<FileInterface> file) {
-  // Data is written to a buffer first, then sent to disk in one call to write.
-  // This costs an extra copy of the data, but dramatically improves latency with
-  // network based files. (nfs, etc)
-  string        write_buffer;
+  // Messages are gathered into a list of buffers first, then sent to disk in
+  // one call to writev. This dramatically improves latency with network
+  // based files (nfs, etc) without copying every message into one big buffer.
+  // Frames and padding live in write_headers; a deque never moves its
+  // elements, so pointers into it stay valid as it grows. The file may
+  // write in the background, so the buffers are kept until waitForWrites().
+  static const char newline[] = "\n";
+  vector<struct iovec> write_iov;
+  deque<string> write_headers;
   bool          success = true;
-  unsigned long current_size_buffered = 0; // size of data in write_buffer
+  unsigned long current_size_buffered = 0; // size of data in write_iov
   unsigned long num_buffered = 0;
-  unsigned long num_written = 0;
+  unsigned long num_written = 0;   // submitted to the file
+  unsigned long num_confirmed = 0; // known to have completed
+  unsigned long num_synced = 0;    // known to be on disk, for group_commit
+  bool sync_failed = false;
   boost::shared_ptr<FileInterface> write_file;
   unsigned long max_write_size = min(maxSize, maxWriteSize);
+  time_t now = time(NULL);
+  bool stats = g_latencyStats.isEnabled();
 
   // if no file given, use current writeFile
   if (file) {
@@ -819,22 +1126,32 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       // padding to align messages on chunk boundaries
       unsigned long padding = bytesToPad(length, current_size_buffered, chunkSize);
 
+      if (indexValid && !file) {
+        chunkIndex.addMessage(currentSize + current_size_buffered + padding, now);
+      }
+
       length += padding;
 
       if (padding) {
-        write_buffer += string(padding, 0);
+        write_headers.push_back(string(padding, 0));
+        appendIov(write_iov, write_headers.back());
       }
 
       if (writeCategory) {
-        write_buffer += category_frame;
-        write_buffer += (*iter)->category + "\n";
+        write_headers.push_back(category_frame);
+        appendIov(write_iov, write_headers.back());
+        appendIov(write_iov, (*iter)->category);
+        appendIov(write_iov, newline, 1);
       }
 
-      write_buffer += frame;
-      write_buffer += (*iter)->message;
+      if (!frame.empty()) {
+        write_headers.push_back(frame);
+        appendIov(write_iov, write_headers.back());
+      }
+      appendIov(write_iov, (*iter)->message);
 
       if (addNewlines) {
-        write_buffer += "\n";
+        appendIov(write_iov, newline, 1);
       }
 
       current_size_buffered += length;
@@ -843,7 +1160,13 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       // Write buffer if processing last message or if larger than allowed
       if ((currentSize + current_size_buffered > max_write_size && maxSize != 0) ||
           messages->end() == iter + 1 ) {
-        if (!write_file->write(write_buffer)) {
+        unsigned long long start = stats ? currentTimeUs() : 0;
+        bool written = write_file->writev(
+          write_iov.empty() ? NULL : &write_iov[0], write_iov.size());
+        if (stats) {
+          g_latencyStats.record(writeStatId, currentTimeUs() - start);
+        }
+        if (!written) {
           LOG_OPER("[%s] File store failed to write (%lu) messages to file",
                    categoryHandled.c_str(), messages->size());
           setStatus("File write error");
@@ -852,14 +1175,41 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
         }
 
         num_written += num_buffered;
-        currentSize += current_size_buffered;
+        if (!file) {
+          unsynced = true;
+        }
+        if (compression != CompressedFile::CODEC_NONE && !file) {
+          // count what actually went to disk against max_size
+          currentSize = write_file->fileSize();
+        } else {
+          currentSize += current_size_buffered;
+        }
         num_buffered = 0;
         current_size_buffered = 0;
-        write_buffer = "";
+        write_iov.clear();
       }
 
       // rotate file if large enough and not writing to a separate file
       if ((currentSize > maxSize && maxSize != 0 )&& !file) {
+        if (!write_file->waitForWrites()) {
+          LOG_OPER("[%s] File store failed to write (%lu) messages to file",
+                   categoryHandled.c_str(), messages->size());
+          setStatus("File write error");
+          success = false;
+          break;
+        }
+        num_confirmed = num_written;
+        write_headers.clear();
+
+        if (durability == DURABILITY_GROUP_COMMIT) {
+          if (!syncFile(false)) {
+            sync_failed = true;
+            success = false;
+            break;
+          }
+          num_synced = num_confirmed;
+        }
+
         rotateFile();
         write_file = writeFile;
       }
@@ -870,14 +1220,43 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
     success = false;
   }
 
-  eventsWritten += num_written;
+  // Only count messages as written once the writes have completed
+  if (!write_file || write_file->waitForWrites()) {
+    num_confirmed = num_written;
+  } else if (success) {
+    LOG_OPER("[%s] File store failed to write (%lu) messages to file",
+             categoryHandled.c_str(), messages->size());
+    setStatus("File write error");
+    success = false;
+  }
+
+  // group_commit only reports messages as handled once they are synced
+  if (success && !file && durability == DURABILITY_GROUP_COMMIT) {
+    write_file->flush();
+    if (syncFile(false)) {
+      num_synced = num_confirmed;
+    } else {
+      sync_failed = true;
+      success = false;
+    }
+  }
+  if (sync_failed) {
+    // the unsynced writes may be lost, so they are retried
+    num_confirmed = num_synced;
+  }
+
+  eventsWritten += num_confirmed;
 
   if (!success) {
+    // the index counted messages that may not have made it to the file
+    if (!file) {
+      indexValid = false;
+    }
     close();
 
     // update messages to include only the messages that were not handled
-    if (num_written > 0) {
-      messages->erase(messages->begin(), messages->begin() + num_written);
+    if (num_confirmed > 0) {
+      messages->erase(messages->begin(), messages->begin() + num_confirmed);
     }
   }
 
@@ -890,9 +1269,19 @@ void FileStore::deleteOldest(struct tm* now) {
   if (index < 0) {
     return;
   }
-  shared_ptr<FileInterface> deletefile = FileInterface::createFileInterface(fsType,
-                                            makeFullFilename(index, now));
+  string filename = makeFullFilename(index, now);
+
+  // remove the offset first, a file without one is just replayed again
+  deleteOffsetFile(filename);
+
+  shared_ptr<FileInterface> deletefile = createFile(filename);
   deletefile->deleteFile();
+
+  shared_ptr<FileInterface> index_file = FileInterface::createFileInterface(
+    fsType, ChunkIndex::makeIndexFilename(filename), true);
+  if (index_file) {
+    index_file->deleteFile();
+  }
 }
 
 // Replace the messages in the oldest file at this timestamp with the input messages
@@ -910,13 +1299,24 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
   // Need to close and reopen store in case we already have this file open
   close();
 
-  shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType,
-                                          filename, isBufferFile);
+  // the old index and offset won't match the new contents
+  deleteOffsetFile(filename);
+  shared_ptr<FileInterface> index_file = FileInterface::createFileInterface(
+    fsType, ChunkIndex::makeIndexFilename(filename), true);
+  if (index_file) {
+    index_file->deleteFile();
+  }
+
+  shared_ptr<FileInterface> infile = createFile(filename);
 
   // overwrite the old contents of the file
   bool success;
   if (infile->openTruncate()) {
     success = writeMessages(messages, infile);
+    if (success && durability != DURABILITY_NONE && !infile->sync()) {
+      LOG_OPER("[%s] Failed to sync file <%s>",
+               categoryHandled.c_str(), filename.c_str());
+    }
 
   } else {
     LOG_OPER("[%s] Failed to open file <%s> for writing and truncate",
@@ -933,31 +1333,86 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
 
 bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
                            struct tm* now) {
+  unsigned long offset = 0;
+  bool eof;
+  return readOldestChunk(messages, now, offset, 0, eof);
+}
+
+// Reads one range of a file for a parallel readOldestChunk
+class FileStoreReadJob : public DispatchJob {
+ public:
+  FileStoreReadJob(FileStore* store_, const string& filename_,
+                   const vector<unsigned long>& starts_,
+                   const vector<unsigned long>& ends_,
+                   bool want_offsets)
+    : results(starts_.size()),
+      offsets(want_offsets ? starts_.size() : 0),
+      succeeded(starts_.size(), false),
+      store(store_),
+      filename(filename_),
+      starts(starts_),
+      ends(ends_) {
+    for (unsigned long i = 0; i < results.size(); ++i) {
+      results[i].reset(new logentry_vector_t);
+    }
+  }
+
+  void runTask(unsigned long index) {
+    shared_ptr<FileInterface> infile = store->createFile(filename);
+    if (!infile->openRead() || !infile->seekRead(starts[index])) {
+      LOG_OPER("[%s] Failed to read file <%s> at offset <%lu>",
+               store->categoryHandled.c_str(), filename.c_str(),
+               starts[index]);
+      return;
+    }
 
-  int index = findOldestFile(makeBaseFilename(now));
-  if (index < 0) {
-    // This isn't an error. It's legit to call readOldest when there aren't any
-    // files left, in which case the call succeeds but returns messages empty.
-    return true;
-  }
-  std::string filename = makeFullFilename(index, now);
-
-  shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType, filename, isBufferFile);
-
-  if (!infile->openRead()) {
-    LOG_OPER("[%s] Failed to open file <%s> for reading", categoryHandled.c_str(), filename.c_str());
-    return false;
-  }
+    unsigned long offset;
+    bool eof;
+    store->readMessages(infile, results[index], ends[index], 0, offset, eof,
+                        offsets.empty() ? NULL : &offsets[index]);
+    infile->close();
+    succeeded[index] = true;
+  }
+
+  vector<shared_ptr<logentry_vector_t> > results;
+  vector<vector<unsigned long> > offsets; // where each message can resume
+  // not vector<bool>, tasks on different threads write neighboring results
+  vector<char> succeeded;
+
+ private:
+  FileStore* store;
+  const string& filename;
+  const vector<unsigned long>& starts;
+  const vector<unsigned long>& ends;
+};
+
+// Reads messages from infile until it reaches a message boundary at or past
+// end_offset, or has read max_bytes. Either limit can be 0 for none. eof is
+// false, and offset where to resume, if it stopped early. message_offsets,
+// if given, gets the last boundary at or before each message (a compressed
+// file can only resume at the start of a block).
+void FileStore::readMessages(shared_ptr<FileInterface> infile,
+                             shared_ptr<logentry_vector_t> messages,
+                             unsigned long end_offset, unsigned long max_bytes,
+                             unsigned long& offset, bool& eof,
+                             vector<unsigned long>* message_offsets) {
+  eof = true;
 
   std::string message;
+  unsigned long bytes_read = 0;
+  unsigned long resume = 0;
+  if (message_offsets) {
+    infile->readOffset(resume);
+  }
+  LogEntryArena arena;
   while (infile->readNext(message)) {
     if (!message.empty()) {
-      logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+      logentry_ptr_t entry = arena.allocate();
 
       // check whether a category is stored with the message
       if (writeCategory) {
         // get category without trailing \n
-        entry->category = message.substr(0, message.length() - 1);
+        entry->category.assign(message, 0, message.length() - 1);
 
         if (!infile->readNext(message)) {
           LOG_OPER("[%s] category not stored with message <%s>",
@@ -967,18 +1422,262 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
         entry->category = categoryHandled;
       }
 
-      entry->message = message;
+      bytes_read += message.length();
+
+      // message is refilled by the next readNext, so just take its buffer
+      entry->message.swap(message);
 
       messages->push_back(entry);
+      if (message_offsets) {
+        message_offsets->push_back(resume);
+      }
+    }
+
+    // stop at a message boundary once we have enough, if we can resume here
+    bool full = max_bytes && bytes_read >= max_bytes;
+    unsigned long position;
+    bool boundary = (full || end_offset || message_offsets) &&
+      infile->readOffset(position);
+    if (boundary && (full || (end_offset && position >= end_offset))) {
+      offset = position;
+      eof = false;
+      break;
+    }
+    if (boundary) {
+      resume = position;
     }
   }
-  infile->close();
+}
 
-  LOG_OPER("[%s] successfully read <%lu> entries from file <%s>",
-        categoryHandled.c_str(), messages->size(), filename.c_str());
+// Splits the part of filename that a read from offset would cover into
+// ranges starting at message boundaries from the file's index, about the
+// same size each. The last range has end 0 if it runs to the end of file.
+// Returns false if the file can't be split.
+bool FileStore::splitRead(const string& filename, unsigned long offset,
+                          unsigned long max_bytes,
+                          vector<unsigned long>& starts,
+                          vector<unsigned long>& ends) {
+  ChunkIndex file_index;
+  if (!readIndex(filename, file_index)) {
+    return false;
+  }
+
+  // message boundaries after offset
+  vector<unsigned long> boundaries;
+  const vector<ChunkIndexEntry>& entries = file_index.getEntries();
+  for (vector<ChunkIndexEntry>::const_iterator iter = entries.begin();
+       iter != entries.end();
+       ++iter) {
+    if (iter->offset > offset) {
+      boundaries.push_back(iter->offset);
+    }
+  }
+  if (boundaries.empty()) {
+    return false;
+  }
+
+  unsigned long total = file_index.getFileSize() > offset ?
+    file_index.getFileSize() - offset : 0;
+  if (max_bytes && max_bytes < total) {
+    total = max_bytes;
+  }
+  unsigned long tasks = readThreads + 1;
+  unsigned long range_size = max(total / tasks, 1UL);
+
+  unsigned long start = offset;
+  for (vector<unsigned long>::iterator iter = boundaries.begin();
+       iter != boundaries.end();
+       ++iter) {
+    if (*iter - start < range_size) {
+      continue;
+    }
+    starts.push_back(start);
+    ends.push_back(*iter);
+    start = *iter;
+    if (*iter - offset >= total) {
+      return starts.size() > 1;
+    }
+  }
+
+  // whatever is left runs to the end of the file
+  starts.push_back(start);
+  ends.push_back(0);
+  return starts.size() > 1;
+}
+
+bool FileStore::readOldestChunk(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
+                                struct tm* now, unsigned long& offset,
+                                unsigned long max_bytes, bool& eof,
+                                vector<unsigned long>* message_offsets) {
+
+  eof = true;
+  int index = findOldestFile(makeBaseFilename(now));
+  if (index < 0) {
+    // This isn't an error. It's legit to call readOldest when there aren't any
+    // files left, in which case the call succeeds but returns messages empty.
+    return true;
+  }
+  std::string filename = makeFullFilename(index, now);
+
+  vector<unsigned long> starts, ends;
+  if (readThreads > 0 && splitRead(filename, offset, max_bytes, starts, ends)) {
+    if (!readDispatcher.isRunning()) {
+      readDispatcher.start(readThreads);
+    }
+
+    FileStoreReadJob job(this, filename, starts, ends,
+                         message_offsets != NULL);
+    readDispatcher.run(&job, starts.size());
+
+    for (unsigned long i = 0; i < starts.size(); ++i) {
+      if (!job.succeeded[i]) {
+        return false;
+      }
+    }
+    for (unsigned long i = 0; i < starts.size(); ++i) {
+      messages->insert(messages->end(), job.results[i]->begin(),
+                       job.results[i]->end());
+      if (message_offsets) {
+        message_offsets->insert(message_offsets->end(),
+                                job.offsets[i].begin(), job.offsets[i].end());
+      }
+      // free each range as soon as it's copied
+      job.results[i].reset();
+    }
+
+    eof = (ends.back() == 0);
+    offset = ends.back();
+  } else {
+    shared_ptr<FileInterface> infile = createFile(filename);
+
+    if (!infile->openRead()) {
+      LOG_OPER("[%s] Failed to open file <%s> for reading", categoryHandled.c_str(), filename.c_str());
+      return false;
+    }
+
+    if (!infile->seekRead(offset)) {
+      LOG_OPER("[%s] Failed to seek to offset <%lu> in file <%s>",
+               categoryHandled.c_str(), offset, filename.c_str());
+      infile->close();
+      return false;
+    }
+
+    readMessages(infile, messages, 0, max_bytes, offset, eof,
+                 message_offsets);
+    infile->close();
+  }
+
+  if (eof) {
+    offset = 0;
+    LOG_OPER("[%s] successfully read <%lu> entries from file <%s>",
+             categoryHandled.c_str(), messages->size(), filename.c_str());
+  } else {
+    LOG_DEBUG("[%s] read <%lu> entries from file <%s> up to offset <%lu>",
+              categoryHandled.c_str(), messages->size(), filename.c_str(), offset);
+  }
   return true;
 }
 
+// The offset file holds a header record and the start of the first
+// record in the buffer file it was saved for. A file that was replaced or
+// recreated under the same name won't start the same way, so its offset
+// is ignored instead of resuming in the middle of some other data.
+void FileStore::saveOldestOffset(struct tm* now, unsigned long offset) {
+  int index = findOldestFile(makeBaseFilename(now));
+  if (index < 0) {
+    return;
+  }
+  string filename = makeFullFilename(index, now);
+
+  string file_id;
+  if (!offset || !readFileId(filename, file_id)) {
+    deleteOffsetFile(filename);
+    return;
+  }
+
+  string offset_name = filename + OFFSET_FILE_SUFFIX;
+  shared_ptr<FileInterface> offset_file =
+    FileInterface::createFileInterface(fsType, offset_name, true);
+  if (!offset_file || !offset_file->openTruncate()) {
+    LOG_OPER("[%s] Failed to open offset file <%s>",
+             categoryHandled.c_str(), offset_name.c_str());
+    return;
+  }
+
+  ostringstream header;
+  header << OFFSET_FILE_VERSION << " " << offset;
+  string buf = offset_file->getFrame(header.str().length());
+  buf += header.str();
+  buf += offset_file->getFrame(file_id.length());
+  buf += file_id;
+  if (!offset_file->write(buf) || !offset_file->waitForWrites()) {
+    LOG_OPER("[%s] Failed to write offset file <%s>",
+             categoryHandled.c_str(), offset_name.c_str());
+  }
+  offset_file->close();
+}
+
+unsigned long FileStore::loadOldestOffset(struct tm* now) {
+  int index = findOldestFile(makeBaseFilename(now));
+  if (index < 0) {
+    return 0;
+  }
+  string filename = makeFullFilename(index, now);
+  string offset_name = filename + OFFSET_FILE_SUFFIX;
+
+  shared_ptr<FileInterface> offset_file =
+    FileInterface::createFileInterface(fsType, offset_name, true);
+  if (!offset_file || !offset_file->openRead()) {
+    return 0;
+  }
+
+  string header, saved_id, file_id;
+  unsigned version = 0;
+  unsigned long offset = 0;
+  bool valid = offset_file->readNext(header) &&
+    offset_file->readNext(saved_id);
+  offset_file->close();
+
+  if (valid) {
+    istringstream stream(header);
+    valid = (stream >> version >> offset) && version == OFFSET_FILE_VERSION &&
+      readFileId(filename, file_id) && file_id == saved_id;
+  }
+  if (!valid) {
+    LOG_OPER("[%s] offset file <%s> doesn't match <%s>, replaying all of it",
+             categoryHandled.c_str(), offset_name.c_str(), filename.c_str());
+    offset_file->deleteFile();
+    return 0;
+  }
+
+  LOG_OPER("[%s] resuming replay of <%s> at offset <%lu>",
+           categoryHandled.c_str(), filename.c_str(), offset);
+  return offset;
+}
+
+// What a buffer file is recognized by: the start of its first record
+bool FileStore::readFileId(const string& filename, string& file_id) {
+  shared_ptr<FileInterface> infile = createFile(filename);
+  if (!infile->openRead()) {
+    return false;
+  }
+  bool success = infile->readNext(file_id);
+  infile->close();
+
+  if (success && file_id.length() > OFFSET_FILE_ID_SIZE) {
+    file_id.resize(OFFSET_FILE_ID_SIZE);
+  }
+  return success;
+}
+
+void FileStore::deleteOffsetFile(const string& filename) {
+  shared_ptr<FileInterface> offset_file = FileInterface::createFileInterface(
+    fsType, filename + OFFSET_FILE_SUFFIX, true);
+  if (offset_file) {
+    offset_file->deleteFile();
+  }
+}
+
 bool FileStore::empty(struct tm* now) {
 
   std::vector<std::string> files = FileInterface::list(filePath, fsType);
@@ -1191,13 +1890,20 @@ BufferStore::BufferStore(const string& category, bool multi_category)
   : Store(category, "buffer", multi_category),
     maxQueueLength(DEFAULT_BUFFERSTORE_MAX_QUEUE_LENGTH),
     bufferSendRate(DEFAULT_BUFFERSTORE_SEND_RATE),
+    sendRateBytes(0),
+    sendRateMsgs(0),
+    sendChunkSize(DEFAULT_BUFFERSTORE_SEND_CHUNK_SIZE),
     avgRetryInterval(DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL),
     retryIntervalRange(DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE),
     replayBuffer(true),
-    state(DISCONNECTED) {
+    state(DISCONNECTED),
+    replayOffset(0),
+    replayBytesBudget(0),
+    replayMsgsBudget(0) {
 
   lastWriteTime = lastOpenAttempt = time(NULL);
   retryInterval = getNewRetryInterval();
+  lastReplayUs = currentTimeUs();
 
   // we can't open the client conection until we get configured
 }
@@ -1211,6 +1917,9 @@ void BufferStore::configure(pStoreConf configuration) {
   // Constructor defaults are fine if these don't exist
   configuration->getUnsigned("max_queue_length", (unsigned long&) maxQueueLength);
   configuration->getUnsigned("buffer_send_rate", (unsigned long&) bufferSendRate);
+  configuration->getUnsigned("buffer_send_rate_bytes", sendRateBytes);
+  configuration->getUnsigned("buffer_send_rate_msgs", sendRateMsgs);
+  configuration->getUnsigned("buffer_send_chunk_size", sendChunkSize);
   configuration->getUnsigned("retry_interval", (unsigned long&) avgRetryInterval);
   configuration->getUnsigned("retry_interval_range", (unsigned long&) retryIntervalRange);
 
@@ -1328,6 +2037,9 @@ shared_ptr<Store> BufferStore::copy(const std::string &category) {
 
   store->maxQueueLength = maxQueueLength;
   store->bufferSendRate = bufferSendRate;
+  store->sendRateBytes = sendRateBytes;
+  store->sendRateMsgs = sendRateMsgs;
+  store->sendChunkSize = sendChunkSize;
   store->avgRetryInterval = avgRetryInterval;
   store->retryIntervalRange = retryIntervalRange;
   store->replayBuffer = replayBuffer;
@@ -1406,6 +2118,9 @@ void BufferStore::changeState(buffer_state_t new_state) {
     if (!secondaryStore->isOpen()) {
       secondaryStore->open();
     }
+    // start replaying with an empty budget
+    replayBytesBudget = replayMsgsBudget = 0;
+    lastReplayUs = currentTimeUs();
     break;
   default:
     break;
@@ -1444,64 +2159,130 @@ void BufferStore::periodicCheck() {
   }
 
   if (state == SENDING_BUFFER) {
+    sendBuffer(&nowinfo);
+  }
+}
 
-    // Read a group of messages from the secondary store and send them to
-    // the primary store. Note that the primary store could tell us to try
-    // again later, so this isn't very efficient if it reads too many
-    // messages at once. (if the secondary store is a file, the number of
-    // messages read is controlled by the max file size)
-    unsigned sent = 0;
-    for (sent = 0; sent < bufferSendRate; ++sent) {
-      boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
-      if (secondaryStore->readOldest(messages, &nowinfo)) {
-        lastWriteTime = time(NULL);
-
-        unsigned long size = messages->size();
-        if (size) {
-          if (primaryStore->handleMessages(messages)) {
-            secondaryStore->deleteOldest(&nowinfo);
-          } else {
+// Read a group of messages from the secondary store and send them to
+// the primary store. Note that the primary store could tell us to try
+// again later, so this isn't very efficient if it reads too many
+// messages at once. (if the secondary store is a file, the number of
+// messages read is controlled by buffer_send_chunk_size or the max file size)
+//
+// Without a byte or message rate we send up to bufferSendRate files per
+// call. With one, we keep sending chunks, possibly spanning several files,
+// until the budget accrued since the last call is used up.
+void BufferStore::sendBuffer(struct tm* now) {
+  bool rate_limited = sendRateBytes || sendRateMsgs;
+  if (rate_limited) {
+    refillReplayBudget();
+  }
+
+  unsigned sent = 0;
+  while (rate_limited ? !replayBudgetExhausted() : sent < bufferSendRate) {
+    boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+    if (!replayOffset) {
+      // pick up where a previous run left off in this file, if it did
+      replayOffset = secondaryStore->loadOldestOffset(now);
+    }
+    unsigned long next_offset = replayOffset;
+    bool eof = true;
+    vector<unsigned long> offsets;
+
+    if (secondaryStore->readOldestChunk(messages, now, next_offset,
+                                        sendChunkSize, eof, &offsets)) {
+      lastWriteTime = time(NULL);
+
+      unsigned long size = messages->size();
+      unsigned long bytes = 0;
+      // the primary store may hand back any subset, so remember the order
+      vector<LogEntry*> read;
+      read.reserve(size);
+      for (logentry_vector_t::iterator iter = messages->begin();
+           iter != messages->end();
+           ++iter) {
+        bytes += (*iter)->message.length();
+        read.push_back(iter->get());
+      }
 
-            if (messages->size() != size) {
-              // We were only able to process some, but not all of this batch
-              // of messages.  Replace this batch of messages with just the messages
-              // that were not processed.
-              LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages",
-                       categoryHandled.c_str(), size - messages->size(), size);
-
-              // Put back un-handled messages
-              if (!secondaryStore->replaceOldest(messages, &nowinfo)) {
-                // Nothing we can do but try to remove oldest messages and report a loss
-                LOG_OPER("[%s] buffer store secondary store lost %lu messages",
-                         categoryHandled.c_str(), messages->size());
-                incCounter(categoryHandled, "lost", messages->size());
-                secondaryStore->deleteOldest(&nowinfo);
-              }
-            }
-
-            changeState(DISCONNECTED);
-            break;
+      if (size && !primaryStore->handleMessages(messages)) {
+
+        if (messages->size() != size) {
+          // We were only able to process some, but not all of this batch
+          // of messages. Resume the file at the first one that wasn't
+          // processed, rather than rewriting the rest of it.
+          LOG_OPER("[%s] buffer store primary store processed %lu/%lu messages",
+                   categoryHandled.c_str(), size - messages->size(), size);
+
+          unsigned long first = messages->empty() ? size :
+            find(read.begin(), read.end(), messages->front().get()) -
+            read.begin();
+          if (offsets.size() == size && first < size &&
+              offsets[first] != replayOffset) {
+            // everything from there on is sent again, including whatever
+            // the primary store did process after it, so nothing is lost
+            replayOffset = offsets[first];
+            secondaryStore->saveOldestOffset(now, replayOffset);
+          } else {
+            LOG_OPER("[%s] buffer store will resend %lu messages",
+                     categoryHandled.c_str(), size - messages->size());
           }
-        }  else {
-          // else it's valid for read to not find anything but not error
-          secondaryStore->deleteOldest(&nowinfo);
         }
-      } else {
-        // This is bad news. We'll stay in the sending state and keep trying to read.
-        setStatus("Failed to read from secondary store");
-        LOG_OPER("[%s] WARNING: buffer store can't read from secondary store", categoryHandled.c_str());
+        // If nothing was processed we leave replayOffset alone and retry
+        // this chunk later.
+
+        changeState(DISCONNECTED);
         break;
       }
 
-      if (secondaryStore->empty(&nowinfo)) {
-        LOG_OPER("[%s] No more buffer files to send, switching to streaming mode", categoryHandled.c_str());
-        changeState(STREAMING);
-
-        primaryStore->flush();
-        break;
+      // it's valid for read to not find anything but not error
+      if (eof) {
+        secondaryStore->deleteOldest(now);
+        replayOffset = 0;
+        ++sent;
+      } else {
+        replayOffset = next_offset;
+        // so a restart doesn't send what we already have again
+        secondaryStore->saveOldestOffset(now, replayOffset);
       }
+
+      replayBytesBudget -= bytes;
+      replayMsgsBudget -= size;
+    } else {
+      // This is bad news. We'll stay in the sending state and keep trying to read.
+      setStatus("Failed to read from secondary store");
+      LOG_OPER("[%s] WARNING: buffer store can't read from secondary store", categoryHandled.c_str());
+
+      // the oldest file may have changed under us, start it over
+      replayOffset = 0;
+      secondaryStore->saveOldestOffset(now, 0);
+      break;
+    }
+
+    if (secondaryStore->empty(now)) {
+      LOG_OPER("[%s] No more buffer files to send, switching to streaming mode", categoryHandled.c_str());
+      changeState(STREAMING);
+
+      primaryStore->flush();
+      break;
     }
-  }// if state == SENDING_BUFFER
+  }
+}
+
+// Budget that isn't used doesn't carry over to the next call, but
+// overshooting it (we always send whole chunks) is paid back.
+void BufferStore::refillReplayBudget() {
+  unsigned long long now = currentTimeUs();
+  double elapsed = (now - lastReplayUs) / 1000000.0;
+  lastReplayUs = now;
+
+  replayBytesBudget = min(replayBytesBudget, 0.0) + elapsed * sendRateBytes;
+  replayMsgsBudget = min(replayMsgsBudget, 0.0) + elapsed * sendRateMsgs;
+}
+
+bool BufferStore::replayBudgetExhausted() {
+  return (sendRateBytes && replayBytesBudget <= 0) ||
+    (sendRateMsgs && replayMsgsBudget <= 0);
 }
 
 
@@ -1546,6 +2327,10 @@ NetworkStore::NetworkStore(const string& category, bool multi_category)
     remotePort(0),
     serviceCacheTimeout(DEFAULT_NETWORKSTORE_CACHE_TIMEOUT),
     lastServiceCheck(0),
+    pipelineWindow(1),
+    pipelineBatchSize(0),
+    connPoolSize(1),
+    compressionLevel(0),
     opened(false) {
   // we can't open the connection until we get configured
 
@@ -1577,12 +2362,44 @@ void NetworkStore::configure(pStoreConf configuration) {
     timeout = DEFAULT_SOCKET_TIMEOUT_MS;
   }
 
+  // Constructor defaults are fine if these don't exist. A window of 1
+  // waits for each reply before sending the next call.
+  configuration->getUnsigned("pipeline_window", pipelineWindow);
+  configuration->getUnsigned("pipeline_batch_size", pipelineBatchSize);
+  if (pipelineWindow == 0) {
+    pipelineWindow = 1;
+  }
+
   string temp;
   if (configuration->getString("use_conn_pool", temp)) {
     if (0 == temp.compare("yes")) {
       useConnPool = true;
     }
   }
+  // Only used with use_conn_pool. The first store to open a connection
+  // decides how many there are.
+  configuration->getUnsigned("conn_pool_size", connPoolSize);
+  if (connPoolSize == 0) {
+    connPoolSize = 1;
+  }
+
+  // Only enable this towards servers that understand compressed messages
+  compressionLevel = 0;
+  if (configuration->getString("compression", temp)) {
+    if (0 == temp.compare("zlib")) {
+      if (!configuration->getInt("compression_level", compressionLevel)) {
+        compressionLevel = DEFAULT_NETWORKSTORE_COMPRESSION_LEVEL;
+      }
+      if (compressionLevel < 1 || compressionLevel > 9) {
+        LOG_OPER("[%s] Bad config - compression_level must be between 1 and 9, using <%d>",
+                 categoryHandled.c_str(), DEFAULT_NETWORKSTORE_COMPRESSION_LEVEL);
+        compressionLevel = DEFAULT_NETWORKSTORE_COMPRESSION_LEVEL;
+      }
+    } else if (0 != temp.compare("none")) {
+      LOG_OPER("[%s] Bad config - unknown compression <%s>, sending uncompressed",
+               categoryHandled.c_str(), temp.c_str());
+    }
+  }
 }
 
 bool NetworkStore::open() {
@@ -1607,11 +2424,15 @@ bool NetworkStore::open() {
     }
 
     if (useConnPool) {
-      opened = g_connPool.open(smcService, servers, static_cast<int>(timeout));
+      opened = g_connPool.open(smcService, servers, static_cast<int>(timeout),
+                               pipelineWindow, pipelineBatchSize, connPoolSize,
+                               static_cast<int>(compressionLevel));
     } else {
       // only open unpooled connection if not already open
       if (unpooledConn == NULL) {
-        unpooledConn = shared_ptr<scribeConn>(new scribeConn(smcService, servers, static_cast<int>(timeout)));
+        unpooledConn = shared_ptr<scribeConn>(new scribeConn(smcService, servers, static_cast<int>(timeout),
+                                                             pipelineWindow, pipelineBatchSize,
+                                                             static_cast<int>(compressionLevel)));
         opened = unpooledConn->open();
       } else {
         opened = unpooledConn->isOpen();
@@ -1629,11 +2450,15 @@ bool NetworkStore::open() {
 
   } else {
     if (useConnPool) {
-      opened = g_connPool.open(remoteHost, remotePort, static_cast<int>(timeout));
+      opened = g_connPool.open(remoteHost, remotePort, static_cast<int>(timeout),
+                               pipelineWindow, pipelineBatchSize, connPoolSize,
+                               static_cast<int>(compressionLevel));
     } else {
       // only open unpooled connection if not already open
       if (unpooledConn == NULL) {
-        unpooledConn = shared_ptr<scribeConn>(new scribeConn(remoteHost, remotePort, static_cast<int>(timeout)));
+        unpooledConn = shared_ptr<scribeConn>(new scribeConn(remoteHost, remotePort, static_cast<int>(timeout),
+                                                             pipelineWindow, pipelineBatchSize,
+                                                             static_cast<int>(compressionLevel)));
         opened = unpooledConn->open();
       } else {
         opened = unpooledConn->isOpen();
@@ -1685,6 +2510,10 @@ shared_ptr<Store> NetworkStore::copy(const std::string &category) {
   store->remoteHost = remoteHost;
   store->remotePort = remotePort;
   store->smcService = smcService;
+  store->pipelineWindow = pipelineWindow;
+  store->pipelineBatchSize = pipelineBatchSize;
+  store->connPoolSize = connPoolSize;
+  store->compressionLevel = compressionLevel;
 
   return copied;
 }
@@ -1720,7 +2549,9 @@ BucketStore::BucketStore(const string& category, bool multi_category)
     removeKey(false),
     opened(false),
     bucketRange(0),
-    numBuckets(1) {
+    numBuckets(1),
+    dispatchThreads(0),
+    randomSeed(time(NULL) ^ (unsigned long)this) {
 }
 
 BucketStore::~BucketStore() {
@@ -1976,6 +2807,9 @@ void BucketStore::configure(pStoreConf configuration) {
     goto handle_error;
   }
 
+  // Optionally write to several buckets at once
+  configuration->getUnsigned("dispatch_threads", dispatchThreads);
+
   // Buckets can be defined explicitely or by specifying a single "bucket"
   if (configuration->getStore("bucket", bucket_conf)) {
     createBucketsFromBucket(configuration, bucket_conf);
@@ -2009,6 +2843,12 @@ bool BucketStore::open() {
       return false;
     }
   }
+
+  if (dispatchThreads > 0 && !dispatcher.isRunning()) {
+    // there's never more than one batch per bucket to hand out
+    dispatcher.start(min(dispatchThreads, numBuckets));
+  }
+
   opened = true;
   return true;
 }
@@ -2026,6 +2866,7 @@ void BucketStore::close() {
        ++iter) {
     (*iter)->close();
   }
+  dispatcher.stop();
   opened = false;
 }
 
@@ -2064,6 +2905,7 @@ shared_ptr<Store> BucketStore::copy(const std::string &category) {
   store->numBuckets = numBuckets;
   store->bucketType = bucketType;
   store->delimiter = delimiter;
+  store->dispatchThreads = dispatchThreads;
 
   for (std::vector<shared_ptr<Store> >::iterator iter = buckets.begin();
        iter != buckets.end();
@@ -2074,6 +2916,35 @@ shared_ptr<Store> BucketStore::copy(const std::string &category) {
   return copied;
 }
 
+// Hands each bucket its batch. Every task touches a different bucket, so
+// they can run at the same time.
+class BucketDispatchJob : public DispatchJob {
+ public:
+  BucketDispatchJob(const vector<shared_ptr<Store> >& buckets_,
+                    const vector<unsigned long>& batch_buckets_,
+                    const vector<shared_ptr<logentry_vector_t> >& batches_)
+    : buckets(buckets_),
+      batchBuckets(batch_buckets_),
+      batches(batches_),
+      results(batches_.size(), false) {
+  }
+
+  void runTask(unsigned long index) {
+    results[index] = buckets[batchBuckets[index]]->handleMessages(batches[index]);
+  }
+
+  bool succeeded(unsigned long index) {
+    return results[index];
+  }
+
+ private:
+  const vector<shared_ptr<Store> >& buckets;
+  const vector<unsigned long>& batchBuckets;
+  const vector<shared_ptr<logentry_vector_t> >& batches;
+  // not vector<bool>, tasks on different threads write neighboring results
+  vector<char> results;
+};
+
 bool BucketStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   bool success = true;
 
@@ -2102,7 +2973,9 @@ bool BucketStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
     bucketed_messages[bucket]->push_back(*iter);
   }
 
-  // handle all batches of messages
+  // get the batch for each bucket ready
+  vector<unsigned long> batch_buckets;
+  vector<shared_ptr<logentry_vector_t> > batches;
   for (unsigned long i = 0; i <= numBuckets; i++) {
     shared_ptr<logentry_vector_t> batch = bucketed_messages[i];
 
@@ -2113,24 +2986,44 @@ bool BucketStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
         shared_ptr<logentry_vector_t> key_removed =
           shared_ptr<logentry_vector_t> (new logentry_vector_t);
 
+        key_removed->reserve(batch->size());
+        LogEntryArena arena;
         for (logentry_vector_t::iterator iter = batch->begin();
              iter != batch->end();
              ++iter) {
-          logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+          // entries are shared with other stores, so only make a new one
+          // if there is actually a key to remove
+          string::size_type pos = (*iter)->message.find(delimiter);
+          if (pos == string::npos) {
+            key_removed->push_back(*iter);
+            continue;
+          }
+          logentry_ptr_t entry = arena.allocate();
           entry->category = (*iter)->category;
-          entry->message = getMessageWithoutKey((*iter)->message);
+          entry->message.assign((*iter)->message, pos + 1, string::npos);
           key_removed->push_back(entry);
         }
         batch = key_removed;
       }
 
-      if (!buckets[i]->handleMessages(batch)) {
-        // keep track of messages that were not handled
-        failed_messages->insert(failed_messages->end(),
-                                bucketed_messages[i]->begin(),
-                                bucketed_messages[i]->end());
-        success = false;
-      }
+      batch_buckets.push_back(i);
+      batches.push_back(batch);
+    }
+  }
+
+  // handle all batches of messages, concurrently if dispatch_threads is set
+  BucketDispatchJob job(buckets, batch_buckets, batches);
+  dispatcher.run(&job, batches.size());
+
+  for (unsigned long i = 0; i < batch_buckets.size(); i++) {
+    if (!job.succeeded(i)) {
+      // keep track of messages that were not handled
+      shared_ptr<logentry_vector_t> unhandled =
+        bucketed_messages[batch_buckets[i]];
+      failed_messages->insert(failed_messages->end(),
+                              unhandled->begin(),
+                              unhandled->end());
+      success = false;
     }
   }
 
@@ -2142,26 +3035,51 @@ bool BucketStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
   return success;
 }
 
+// Same as atol() on [begin, end), without copying the key out first
+static long parseKey(const char* begin, const char* end) {
+  const char* p = begin;
+  while (p < end && isspace((unsigned char)*p)) {
+    ++p;
+  }
+
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    ++p;
+  }
+
+  unsigned long value = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    value = value * 10 + (*p - '0');
+    ++p;
+  }
+  return negative ? -(long)value : (long)value;
+}
+
+// Works directly on the message buffer, so bucketizing doesn't allocate.
 unsigned long BucketStore::bucketize(const std::string& message) {
 
+  const char* data = message.data();
   string::size_type length = message.length();
 
   if (bucketType == context_log) {
     // the key is in ascii after the third delimiter
     char delim = 1;
-    string::size_type pos = 0;
+    const char* p = data;
+    const char* end = data + length;
     for (int i = 0; i < 3; ++i) {
-      pos = message.find(delim, pos);
-      if (pos == string::npos || length <= pos + 1) {
+      p = (const char*)memchr(p, delim, end - p);
+      if (p == NULL || p + 1 >= end) {
         return 0;
       }
-      ++pos;
+      ++p;
     }
-    if (message[pos] == delim) {
+    if (*p == delim) {
       return 0;
     }
 
-    uint32_t id = strtoul(message.substr(pos).c_str(), NULL, 10);
+    // c_str() is NUL terminated, so strtoul can't run off the end
+    uint32_t id = strtoul(message.c_str() + (p - data), NULL, 10);
     if (id == 0) {
       return 0;
     }
@@ -2173,17 +3091,16 @@ unsigned long BucketStore::bucketize(const std::string& message) {
     }
   } else if (bucketType == random) {
     // return any random bucket
-    return (rand() % numBuckets) + 1;
+    return (rand_r(&randomSeed) % numBuckets) + 1;
   } else {
     // just hash everything before the first user-defined delimiter
-    string::size_type pos = message.find(delimiter);
-    if (pos == string::npos) {
+    const char* key_end = (const char*)memchr(data, delimiter, length);
+    if (key_end == NULL) {
       // if no delimiter found, write to bucket 0
       return 0;
     }
 
-    string key = message.substr(0, pos).c_str();
-    if (key.empty()) {
+    if (key_end == data || *data == '\0') {
       // if no key found, write to bucket 0
       return 0;
     }
@@ -2194,7 +3111,7 @@ unsigned long BucketStore::bucketize(const std::string& message) {
       switch (bucketType) {
         case key_modulo:
           // No hashing, just simple modulo
-          return (atol(key.c_str()) % numBuckets) + 1;
+          return (parseKey(data, key_end) % numBuckets) + 1;
           break;
         case key_range:
           if (bucketRange == 0) {
@@ -2202,14 +3119,14 @@ unsigned long BucketStore::bucketize(const std::string& message) {
           } else {
             // Calculate what bucket this key would fall into if we used
             // bucket_range to compute the modulo
-           double key_mod = atol(key.c_str()) % bucketRange;
+           double key_mod = parseKey(data, key_end) % bucketRange;
            return (unsigned long) ((key_mod / bucketRange) * numBuckets) + 1;
           }
           break;
         case key_hash:
         default:
           // Hashing by default.
-          return (strhash::hash32(key.c_str()) % numBuckets) + 1;
+          return (strhash::hash32(data, key_end - data) % numBuckets) + 1;
           break;
       }
     }
@@ -2218,16 +3135,6 @@ unsigned long BucketStore::bucketize(const std::string& message) {
   return 0;
 }
 
-string BucketStore::getMessageWithoutKey(const std::string& message) {
-  string::size_type pos = message.find(delimiter);
-
-  if (pos == string::npos) {
-    return message;
-  }
-
-  return message.substr(pos+1);
-}
-
 
 NullStore::NullStore(const std::string& category, bool multi_category)
   : Store(category, "null", multi_category)
@@ -2421,7 +3328,11 @@ bool MultiStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   for (std::vector<boost::shared_ptr<Store> >::iterator iter = stores.begin();
        iter != stores.end();
        ++iter) {
-    cur_result = (*iter)->handleMessages(messages);
+    // Stores remove handled entries from the vector they are given, so
+    // each one needs its own copy of the (shared) entry pointers.
+    boost::shared_ptr<logentry_vector_t>
+      store_messages(new logentry_vector_t(*messages));
+    cur_result = (*iter)->handleMessages(store_messages);
     any_result |= cur_result;
     all_result &= cur_result;
   }
@@ -2544,16 +3455,38 @@ void CategoryStore::close() {
 }
 
 bool CategoryStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
-  shared_ptr<logentry_vector_t> singleMessage(new logentry_vector_t);
   shared_ptr<logentry_vector_t> failed_messages(new logentry_vector_t);
+  category_batch_map_t batches;
   logentry_vector_t::iterator message_iter;
 
+  // Split the messages by category first, so that each store gets all of
+  // its messages in one call. Messages of the same category tend to arrive
+  // together, so skip the lookup when the category doesn't change.
+  const string* last_category = NULL;
+  logentry_vector_t* last_batch = NULL;
   for (message_iter = messages->begin();
       message_iter != messages->end();
       ++message_iter) {
+    const string& category = (*message_iter)->category;
+
+    if (last_category == NULL || *last_category != category) {
+      shared_ptr<logentry_vector_t>& batch = batches[category];
+      if (!batch) {
+        batch = shared_ptr<logentry_vector_t>(new logentry_vector_t);
+      }
+      last_category = &category;
+      last_batch = batch.get();
+    }
+    last_batch->push_back(*message_iter);
+  }
+
+  for (category_batch_map_t::iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
     map<string, shared_ptr<Store> >::iterator store_iter;
     shared_ptr<Store> store;
-    string category = (*message_iter)->category;
+    const string& category = batch_iter->first;
+    shared_ptr<logentry_vector_t> batch = batch_iter->second;
 
     store_iter = stores.find(category);
 
@@ -2569,18 +3502,18 @@ bool CategoryStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages
     if (store == NULL || !store->isOpen()) {
       LOG_OPER("[%s] Failed to open store for category <%s>",
                categoryHandled.c_str(), category.c_str());
-      failed_messages->push_back(*message_iter);
+      failed_messages->insert(failed_messages->end(),
+                              batch->begin(), batch->end());
       continue;
     }
 
-    // send this message to the store that handles this category
-    singleMessage->clear();
-    singleMessage->push_back(*message_iter);
-
-    if (!store->handleMessages(singleMessage)) {
-      LOG_OPER("[%s] Failed to handle message for category <%s>",
-               categoryHandled.c_str(), category.c_str());
-      failed_messages->push_back(*message_iter);
+    // send these messages to the store that handles this category
+    if (!store->handleMessages(batch)) {
+      LOG_OPER("[%s] Failed to handle %lu messages for category <%s>",
+               categoryHandled.c_str(), batch->size(), category.c_str());
+      // batch now holds just the messages that weren't handled
+      failed_messages->insert(failed_messages->end(),
+                              batch->begin(), batch->end());
       continue;
     }
   }
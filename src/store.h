@@ -29,7 +29,10 @@
 #include "common.h" // includes std libs, thrift, and stl typedefs
 #include "conf.h"
 #include "file.h"
+#include "CompressedFile.h"
+#include "chunk_index.h"
 #include "conn_pool.h"
+#include "parallel_dispatcher.h"
 
 /* defines used by the store class */
 enum roll_period_t {
@@ -72,10 +75,25 @@ class Store {
   // following methods must be overidden to make a store readable
   virtual bool readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
                           struct tm* now);
+  // Reads roughly max_bytes (0 for no limit) of the oldest messages starting
+  // at offset, then advances offset. eof is set once the rest of the oldest
+  // messages have been read. If message_offsets is given, it gets for each
+  // message an offset to resume reading from without skipping that message,
+  // or is left empty if the store can't tell. Defaults to reading everything
+  // with readOldest.
+  virtual bool readOldestChunk(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
+                               struct tm* now, unsigned long& offset,
+                               unsigned long max_bytes, bool& eof,
+                               std::vector<unsigned long>* message_offsets = NULL);
   virtual void deleteOldest(struct tm* now);
   virtual bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
                              struct tm* now);
   virtual bool empty(struct tm* now);
+  // Remembers that the oldest messages have been read up to offset, so that
+  // loadOldestOffset can resume there after a restart. 0 forgets it.
+  // Defaults to not remembering anything.
+  virtual void saveOldestOffset(struct tm* now, unsigned long offset);
+  virtual unsigned long loadOldestOffset(struct tm* now);
 
   // don't need to override
   virtual const std::string& getType();
@@ -163,6 +181,8 @@ class FileStoreBase : public Store {
   unsigned long currentSize;
   time_t lastRollTime;         // either hour, day or time since epoch,
                                // depending on rollPeriod
+  time_t nextRollCheck;        // daily and hourly rolls can't be due before
+                               // this, so periodicCheck skips localtime_r
   std::string currentFilename; // this isn't used to choose the next file name,
                                // we just need it for reporting
   unsigned long eventsWritten; // This is how many events this process has
@@ -197,10 +217,19 @@ class FileStore : public FileStoreBase {
   // This is separate from the write file, and not really a consistent interface.
   bool readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
                   struct tm* now);
+  bool readOldestChunk(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
+                       struct tm* now, unsigned long& offset,
+                       unsigned long max_bytes, bool& eof,
+                       std::vector<unsigned long>* message_offsets = NULL);
   virtual bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
                              struct tm* now);
   void deleteOldest(struct tm* now);
   bool empty(struct tm* now);
+  void saveOldestOffset(struct tm* now, unsigned long offset);
+  unsigned long loadOldestOffset(struct tm* now);
+
+  // Reads the index saved next to filename, if there is one
+  bool readIndex(const std::string& filename, ChunkIndex& index);
 
  protected:
   // Implement FileStoreBase virtual function
@@ -208,14 +237,55 @@ class FileStore : public FileStoreBase {
   bool writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                      boost::shared_ptr<FileInterface> write_file =
                      boost::shared_ptr<FileInterface>());
+  boost::shared_ptr<FileInterface> createFile(const std::string& name);
+  void startIndex();
+  void saveIndex();
+  bool syncFile(bool force);
+  void setStatIds();
+  void readMessages(boost::shared_ptr<FileInterface> infile,
+                    boost::shared_ptr<logentry_vector_t> messages,
+                    unsigned long end_offset, unsigned long max_bytes,
+                    unsigned long& offset, bool& eof,
+                    std::vector<unsigned long>* message_offsets);
+  bool readFileId(const std::string& filename, std::string& file_id);
+  void deleteOffsetFile(const std::string& filename);
+  bool splitRead(const std::string& filename, unsigned long offset,
+                 unsigned long max_bytes, std::vector<unsigned long>& starts,
+                 std::vector<unsigned long>& ends);
 
   bool isBufferFile;
   bool addNewlines;
+  CompressedFile::codec_t compression; // only for fs_type std
+  unsigned long compressionLevel;
+  bool writeIndex;
+  unsigned long indexChunkSize;
+  unsigned long readThreads;   // extra threads for reading indexed files
+
+  enum durability_t {
+    DURABILITY_NONE,           // leave syncing to the OS
+    DURABILITY_INTERVAL,       // sync at most every syncIntervalMs
+    DURABILITY_GROUP_COMMIT    // sync every write before reporting success
+  };
+  durability_t durability;
+  unsigned long syncIntervalMs;
+  bool syncFileRange;          // start writeback after every write
+  bool preallocate;            // reserve max_size bytes for each file
+
+  // for g_latencyStats, by fs_type
+  unsigned long writeStatId;
+  unsigned long flushStatId;
 
   // State
   boost::shared_ptr<FileInterface> writeFile;
+  bool unsynced;               // writeFile has writes that aren't synced
+  unsigned long long lastSyncMs;
+  ChunkIndex chunkIndex;       // messages in writeFile
+  bool indexValid;             // chunkIndex covers all of writeFile
+  ParallelDispatcher readDispatcher;
 
  private:
+  friend class FileStoreReadJob;
+
   // disallow copy, assignment, and empty construction
   FileStore(FileStore& rhs);
   FileStore& operator=(FileStore& rhs);
@@ -301,9 +371,17 @@ class BufferStore : public Store {
 
   time_t getNewRetryInterval(); // generates a random interval based on config
 
+  void sendBuffer(struct tm* now); // replays secondary store to primary
+  void refillReplayBudget();
+  bool replayBudgetExhausted();
+
   // configuration
   unsigned long maxQueueLength;   // in number of messages
   unsigned long bufferSendRate;   // number of buffer files sent each periodicCheck
+                                  // if no byte or message rate is set
+  unsigned long sendRateBytes;    // bytes per second to replay, 0 for no limit
+  unsigned long sendRateMsgs;     // messages per second to replay, 0 for no limit
+  unsigned long sendChunkSize;    // bytes read per send, 0 for a whole file
   time_t avgRetryInterval;        // in seconds, for retrying primary store open
   time_t retryIntervalRange;      // in seconds
   bool   replayBuffer;            // whether to send buffers from
@@ -315,6 +393,12 @@ class BufferStore : public Store {
   time_t lastOpenAttempt;
   time_t retryInterval;
 
+  // replay state
+  unsigned long replayOffset;     // already sent up to here in oldest file
+  double replayBytesBudget;
+  double replayMsgsBudget;
+  unsigned long long lastReplayUs; // from currentTimeUs()
+
  private:
   // disallow copy, assignment, and empty construction
   BufferStore();
@@ -355,6 +439,10 @@ class NetworkStore : public Store {
   server_vector_t servers;
   unsigned long serviceCacheTimeout;
   time_t lastServiceCheck;
+  unsigned long pipelineWindow;    // Log calls in flight per connection
+  unsigned long pipelineBatchSize; // max messages per Log call, 0 for no limit
+  unsigned long connPoolSize;      // pooled connections per remote server/service
+  long int compressionLevel;       // zlib level, 0 to send uncompressed
 
   // state
   bool opened;
@@ -405,8 +493,15 @@ class BucketStore : public Store {
   unsigned long numBuckets;
   std::vector<boost::shared_ptr<Store> > buckets;
 
+  // Number of extra threads handing batches to buckets, so that buckets
+  // are written concurrently instead of one after another. 0 to use only
+  // the store thread.
+  unsigned long dispatchThreads;
+  ParallelDispatcher dispatcher;
+
+  unsigned int randomSeed; // for rand_r(), rand() isn't thread safe
+
   unsigned long bucketize(const std::string& message);
-  std::string getMessageWithoutKey(const std::string& message);
 
  private:
   // disallow copy, assignment, and emtpy construction
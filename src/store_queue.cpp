@@ -22,13 +22,24 @@
 
 #include "common.h"
 #include "scribe_server.h"
+#include "store_thread_pool.h"
+#include "latency_stats.h"
 
 using namespace std;
 using namespace boost;
 using namespace scribe::thrift;
 
 #define DEFAULT_TARGET_WRITE_SIZE  16384LL
-#define DEFAULT_MAX_WRITE_INTERVAL 10
+#define DEFAULT_MAX_WRITE_INTERVAL 10 // in seconds
+#define DEFAULT_TARGET_LATENCY     100 // in milliseconds
+#define DEFAULT_MIN_BATCH_SIZE     1024LL
+#define DEFAULT_MAX_BATCH_SIZE     (16 * 1024 * 1024LL)
+
+// largest message vector kept around for reuse, in entries
+#define MAX_SPARE_QUEUE_CAPACITY   65536
+
+volatile long StoreQueue::numOverloaded = 0;
+volatile unsigned long long StoreQueue::defaultMaxQueueSize = 0;
 
 void* threadStatic(void *this_ptr) {
   StoreQueue *queue_ptr = (StoreQueue*)this_ptr;
@@ -39,15 +50,37 @@ void* threadStatic(void *this_ptr) {
 StoreQueue::StoreQueue(const string& type, const string& category,
                        unsigned check_period, bool is_model, bool multi_category)
   : msgQueueSize(0),
+    ingestRing(NULL),
+    ringSize(0),
+    spill(NULL),
+    failedSize(0),
+    firstQueuedUs(0),
+    overloaded(0),
     hasWork(false),
+    pool(NULL),
+    scheduled(false),
+    stopped(false),
+    lastPeriodicCheck(0),
+    lastHandleMessages(0),
+    batchWriteSize(DEFAULT_TARGET_WRITE_SIZE),
+    storeOpened(false),
     stopping(false),
     isModel(is_model),
     multiCategory(multi_category),
     categoryHandled(category),
     checkPeriod(check_period),
     targetWriteSize(DEFAULT_TARGET_WRITE_SIZE),
-    maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL),
-    mustSucceed(true) {
+    maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL * 1000),
+    mustSucceed(true),
+    ingestRingSize(0),
+    maxQueueSize(0),
+    maxMsgPerSecond(0),
+    maxBytesPerSecond(0),
+    memoryBudget(0),
+    adaptiveBatching(false),
+    targetLatency(DEFAULT_TARGET_LATENCY),
+    minBatchSize(DEFAULT_MIN_BATCH_SIZE),
+    maxBatchSize(DEFAULT_MAX_BATCH_SIZE) {
 
   store = Store::createStore(type, category, false, multiCategory);
   if (!store) {
@@ -59,7 +92,20 @@ StoreQueue::StoreQueue(const string& type, const string& category,
 StoreQueue::StoreQueue(const shared_ptr<StoreQueue> example,
                        const std::string &category)
   : msgQueueSize(0),
+    ingestRing(NULL),
+    ringSize(0),
+    spill(NULL),
+    failedSize(0),
+    firstQueuedUs(0),
+    overloaded(0),
     hasWork(false),
+    pool(NULL),
+    scheduled(false),
+    stopped(false),
+    lastPeriodicCheck(0),
+    lastHandleMessages(0),
+    batchWriteSize(example->batchWriteSize),
+    storeOpened(false),
     stopping(false),
     isModel(false),
     multiCategory(example->multiCategory),
@@ -67,7 +113,21 @@ StoreQueue::StoreQueue(const shared_ptr<StoreQueue> example,
     checkPeriod(example->checkPeriod),
     targetWriteSize(example->targetWriteSize),
     maxWriteInterval(example->maxWriteInterval),
-    mustSucceed(example->mustSucceed) {
+    mustSucceed(example->mustSucceed),
+    ingestRingSize(example->ingestRingSize),
+    maxQueueSize(example->maxQueueSize),
+    maxMsgPerSecond(example->maxMsgPerSecond),
+    maxBytesPerSecond(example->maxBytesPerSecond),
+    memoryBudget(example->memoryBudget),
+    spillPath(example->spillPath),
+    adaptiveBatching(example->adaptiveBatching),
+    targetLatency(example->targetLatency),
+    minBatchSize(example->minBatchSize),
+    maxBatchSize(example->maxBatchSize),
+    storeConf(example->storeConf) {
+
+  // every category made from a model gets its own budget
+  rateLimiter.configure(maxMsgPerSecond, maxBytesPerSecond);
 
   store = example->copyStore(category);
   if (!store) {
@@ -78,21 +138,75 @@ StoreQueue::StoreQueue(const shared_ptr<StoreQueue> example,
 
 
 StoreQueue::~StoreQueue() {
+  if (pool) {
+    pool->unregisterQueue(this);
+  }
   if (!isModel) {
     pthread_mutex_destroy(&cmdMutex);
     pthread_mutex_destroy(&msgMutex);
     pthread_mutex_destroy(&hasWorkMutex);
     pthread_cond_destroy(&hasWorkCond);
   }
+  if (ingestRing) {
+    delete ingestRing;
+  }
+  if (spill) {
+    delete spill;
+  }
+  if (overloaded) {
+    __sync_sub_and_fetch(&numOverloaded, 1);
+  }
+}
+
+void StoreQueue::setDefaultMaxQueueSize(unsigned long long size) {
+  defaultMaxQueueSize = size;
+}
+
+bool StoreQueue::isOverLimit() {
+  unsigned long long limit = maxQueueSize ? maxQueueSize : defaultMaxQueueSize;
+  // a queue that can spill never holds much more than its budget
+  return limit > 0 && msgQueueSize + ringSize > limit &&
+    !(spill && memoryBudget > 0 && spill->isHealthy());
+}
+
+// Publishes whether this queue is over its limit. Called without any locks
+// after the size changes, so a producer can publish a result the store
+// thread has already found out of date. Everyone checks the size and flag
+// again after publishing and goes around until they agree, so whoever
+// writes last leaves it right. Otherwise an empty queue could stay counted
+// as overloaded, and with every Log call refused nothing would wake the
+// store thread to correct it.
+void StoreQueue::updateOverloaded() {
+  while (true) {
+    bool over = isOverLimit();
+    if (over) {
+      if (__sync_bool_compare_and_swap(&overloaded, 0, 1)) {
+        __sync_add_and_fetch(&numOverloaded, 1);
+      }
+    } else {
+      if (__sync_bool_compare_and_swap(&overloaded, 1, 0)) {
+        __sync_sub_and_fetch(&numOverloaded, 1);
+      }
+    }
+
+    if (isOverLimit() == over && overloaded == (over ? 1 : 0)) {
+      break;
+    }
+  }
 }
 
 // WARNING: the number could change after you check this, so don't
 // expect it to be exact. Use for hueristics ONLY.
 unsigned long long StoreQueue::getSize() {
   unsigned long long retval;
-  pthread_mutex_lock(&msgMutex);
-  retval = msgQueueSize;
-  pthread_mutex_unlock(&msgMutex);
+  if (ingestRing) {
+    // don't contend with the store thread just to get an estimate
+    retval = msgQueueSize + ringSize;
+  } else {
+    pthread_mutex_lock(&msgMutex);
+    retval = msgQueueSize;
+    pthread_mutex_unlock(&msgMutex);
+  }
   return retval;
 }
 
@@ -101,32 +215,242 @@ void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
     LOG_OPER("ERROR: called addMessage on model store");
   } else {
     bool waitForWork = false;
+    unsigned long long size = entry->message.size();
 
-    pthread_mutex_lock(&msgMutex);
-    msgQueue->push_back(entry);
-    msgQueueSize += entry->message.size();
+    markQueued();
+    if (spill && spillMessage(entry)) {
+      signalWorkAvailable();
+      return;
+    }
 
-    waitForWork = (msgQueueSize >= targetWriteSize) ? true : false;
-    pthread_mutex_unlock(&msgMutex);
+    bool queued = false;
+    if (ingestRing) {
+      // Account for the bytes before publishing the entry, so the store
+      // thread never subtracts bytes that haven't been added yet.
+      __sync_add_and_fetch(&ringSize, size);
+      queued = ingestRing->push(entry);
+      if (!queued) {
+        __sync_sub_and_fetch(&ringSize, size);
+      }
+    }
+
+    if (queued) {
+      waitForWork = (msgQueueSize + ringSize >= batchWriteSize);
+    } else {
+      pthread_mutex_lock(&msgMutex);
+      // If the ring is full, empty it first so that this entry stays
+      // behind everything that was pushed before it.
+      drainIngestRing(true);
+      msgQueue->push_back(entry);
+      msgQueueSize += size;
+
+      waitForWork = (msgQueueSize + ringSize >= batchWriteSize);
+      pthread_mutex_unlock(&msgMutex);
+    }
 
     // Wake up store thread if we have enough messages
     if (waitForWork == true) {
-      // signal that there is work to do if not already signaled
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-        hasWork = true;
-        pthread_cond_signal(&hasWorkCond);
+      signalWorkAvailable();
+    }
+    updateOverloaded();
+  }
+}
+
+// Same as calling addMessage for each entry, but only takes the locks
+// and wakes up the store thread once for the whole batch.
+void StoreQueue::addMessages(boost::shared_ptr<logentry_vector_t> messages) {
+  if (isModel) {
+    LOG_OPER("ERROR: called addMessages on model store");
+    return;
+  }
+
+  markQueued();
+  if (spill && memoryBudget > 0) {
+    unsigned long long size = 0;
+    for (logentry_vector_t::iterator iter = messages->begin();
+         iter != messages->end();
+         ++iter) {
+      size += (*iter)->message.size();
+    }
+    if (spill->isActive() || overBudget(size)) {
+      if (spill->append(*messages)) {
+        incCounter(categoryHandled, "spilled", messages->size());
+        signalWorkAvailable();
+        return;
       }
-      pthread_mutex_unlock(&hasWorkMutex);
+      incCounter(categoryHandled, "spill failed", messages->size());
+    }
+  }
+
+  logentry_vector_t::iterator iter = messages->begin();
+  if (ingestRing) {
+    for (; iter != messages->end(); ++iter) {
+      unsigned long long size = (*iter)->message.size();
+      __sync_add_and_fetch(&ringSize, size);
+      if (!ingestRing->push(*iter)) {
+        __sync_sub_and_fetch(&ringSize, size);
+        break;
+      }
+    }
+  }
+
+  // queue anything that didn't fit in the ring
+  if (iter != messages->end()) {
+    pthread_mutex_lock(&msgMutex);
+    drainIngestRing(true);
+    for (; iter != messages->end(); ++iter) {
+      msgQueue->push_back(*iter);
+      msgQueueSize += (*iter)->message.size();
     }
+    pthread_mutex_unlock(&msgMutex);
+  }
+
+  // Wake up store thread if we have enough messages
+  if (msgQueueSize + ringSize >= batchWriteSize) {
+    signalWorkAvailable();
+  }
+  updateOverloaded();
+}
+
+// Notes when the oldest message waiting to be handled was queued, for the
+// queue dwell time stat
+void StoreQueue::markQueued() {
+  if (g_latencyStats.isEnabled() && !firstQueuedUs) {
+    __sync_bool_compare_and_swap(&firstQueuedUs, 0, currentTimeUs());
+  }
+}
+
+// Whether adding size bytes would put this queue over its memory budget.
+// Messages waiting to be retried count too, since they're still in memory.
+bool StoreQueue::overBudget(unsigned long long size) {
+  return memoryBudget > 0 &&
+    msgQueueSize + ringSize + failedSize + size > memoryBudget;
+}
+
+// Returns true if entry went to the spill file rather than the queue
+bool StoreQueue::spillMessage(logentry_ptr_t entry) {
+  if (memoryBudget == 0 ||
+      !(spill->isActive() || overBudget(entry->message.size()))) {
+    return false;
+  }
+  if (!spill->append(entry)) {
+    // better out of order than lost
+    incCounter(categoryHandled, "spill failed");
+    return false;
+  }
+  incCounter(categoryHandled, "spilled");
+  return true;
+}
+
+// Moves up to max_bytes of the oldest spilled messages to the end of
+// msgQueue. Anything already in msgQueue was queued before them, and
+// nothing new is queued in memory until the spill has been read back.
+bool StoreQueue::refillFromSpill(unsigned long long max_bytes) {
+  unsigned long long bytes = 0;
+  unsigned long count = msgQueue->size();
+  if (!spill->read(*msgQueue, max_bytes, bytes)) {
+    return false;
+  }
+  msgQueueSize += bytes;
+  incCounter(categoryHandled, "unspilled", msgQueue->size() - count);
+  return true;
+}
+
+// Hands everything left in the spill file to the store when the queue is
+// stopping, so a queue replacing this one doesn't have to wait for it.
+// Returns false if the store failed; what's left is read back by the next
+// queue for this category.
+bool StoreQueue::drainSpill() {
+  while (spill->isActive()) {
+    pthread_mutex_lock(&msgMutex);
+    unsigned long long max_bytes = batchWriteSize;
+    refillFromSpill(max(max_bytes, memoryBudget / 2));
+    boost::shared_ptr<logentry_vector_t> messages = msgQueue;
+    msgQueue = newQueue();
+    msgQueueSize = 0;
+    pthread_mutex_unlock(&msgMutex);
+
+    if (messages->empty()) {
+      break;
+    }
+    if (!store->handleMessages(messages)) {
+      LOG_OPER("[%s] WARNING: Lost %lu messages!",
+               categoryHandled.c_str(), messages->size());
+      LOG_OPER("[%s] Leaving <%llu> bytes in spill file <%s>",
+               categoryHandled.c_str(), spill->getSize(),
+               spill->getFilename().c_str());
+      incCounter(categoryHandled, "lost", messages->size());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Moves everything published to the ingest ring into msgQueue. pop stops
+// at the first slot that has been claimed but not published, which may be
+// ahead of entries that were. To keep the order a producer pushed in, its
+// fallback to msgQueue passes wait_for_pushes, which keeps going until
+// everything claimed before the call is in msgQueue. Producers publish
+// right after claiming, so the wait is short.
+void StoreQueue::drainIngestRing(bool wait_for_pushes) {
+  if (!ingestRing) {
+    return;
+  }
+
+  unsigned long end = ingestRing->claimed();
+  logentry_ptr_t entry;
+  for (;;) {
+    if (ingestRing->pop(entry)) {
+      unsigned long long size = entry->message.size();
+      msgQueue->push_back(entry);
+      msgQueueSize += size;
+      __sync_sub_and_fetch(&ringSize, size);
+    } else if (!wait_for_pushes || (long)(end - ingestRing->popped()) <= 0) {
+      break;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+void StoreQueue::signalWorkAvailable() {
+  // An unlocked read is enough to skip the mutex when the store thread has
+  // already been signaled: it resets hasWork before it next looks at the
+  // queue, so anything queued before this check will be seen.
+  if (hasWork) {
+    return;
+  }
+
+  // signal that there is work to do if not already signaled
+  pthread_mutex_lock(&hasWorkMutex);
+  notifyStoreThread();
+  pthread_mutex_unlock(&hasWorkMutex);
+}
+
+// Wakes up the store thread, or submits this queue to the pool if it isn't
+// already waiting for or running on a worker.
+void StoreQueue::notifyStoreThread() {
+  if (pool) {
+    hasWork = true;
+    if (!scheduled && !stopped) {
+      scheduled = true;
+      pool->submit(this);
+    }
+  } else if (!hasWork) {
+    hasWork = true;
+    pthread_cond_signal(&hasWorkCond);
   }
 }
 
 void StoreQueue::configureAndOpen(pStoreConf configuration) {
+  storeConf = configuration->clone();
+
   // model store has to handle this inline since it has no queue
   if (isModel) {
     configureInline(configuration);
   } else {
+    configureIngest(configuration);
+
     pthread_mutex_lock(&cmdMutex);
     StoreCommand cmd(CMD_CONFIGURE, configuration);
     cmdQueue.push(cmd);
@@ -134,10 +458,7 @@ void StoreQueue::configureAndOpen(pStoreConf configuration) {
 
     // signal that there is work to do if not already signaled
     pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
+    notifyStoreThread();
     pthread_mutex_unlock(&hasWorkMutex);
   }
 }
@@ -163,13 +484,18 @@ void StoreQueue::stop() {
 
   // signal that there is work to do if not already signaled
   pthread_mutex_lock(&hasWorkMutex);
-  if (!hasWork) {
-    hasWork = true;
-    pthread_cond_signal(&hasWorkCond);
+  notifyStoreThread();
+  if (pool) {
+    // wait for a worker to run the stop command and close the store
+    while (!stopped) {
+      pthread_cond_wait(&hasWorkCond, &hasWorkMutex);
+    }
   }
   pthread_mutex_unlock(&hasWorkMutex);
 
-  pthread_join(storeThread, NULL);
+  if (!pool) {
+    pthread_join(storeThread, NULL);
+  }
 }
 
 void StoreQueue::open() {
@@ -183,10 +509,7 @@ void StoreQueue::open() {
 
     // signal that there is work to do if not already signaled
     pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
+    notifyStoreThread();
     pthread_mutex_unlock(&hasWorkMutex);
   }
 }
@@ -221,111 +544,255 @@ void StoreQueue::threadMember() {
     return;
   }
 
-  // init time of last periodic check to time of 0
-  time_t last_periodic_check = 0;
-
-  time_t last_handle_messages;
-  time(&last_handle_messages);
-
   // initialize absolute timestamp
   struct timespec abs_timeout;
   memset(&abs_timeout, 0, sizeof(struct timespec));
 
   bool stop = false;
-  bool open = false;
   while (!stop) {
+    stop = processWork();
 
-    // handle commands
-    //
-    pthread_mutex_lock(&cmdMutex);
-    while (!cmdQueue.empty()) {
-      StoreCommand cmd = cmdQueue.front();
-      cmdQueue.pop();
-
-      switch (cmd.command) {
-      case CMD_CONFIGURE:
-        configureInline(cmd.configuration);
-        openInline();
-        open = true;
-        break;
-      case CMD_OPEN:
-        openInline();
-        open = true;
-        break;
-      case CMD_STOP:
-        stop = true;
-        break;
-      default:
-        LOG_OPER("LOGIC ERROR: unknown command to store queue");
-        break;
+    if (!stop) {
+      // set timeout to when we need to handle messages or do a periodic check
+      unsigned long long deadline = getNextDeadline();
+      abs_timeout.tv_sec = deadline / 1000;
+      abs_timeout.tv_nsec = (deadline % 1000) * 1000000;
+
+      // wait until there's some work to do or we timeout
+      pthread_mutex_lock(&hasWorkMutex);
+      if (!hasWork) {
+        pthread_cond_timedwait(&hasWorkCond, &hasWorkMutex, &abs_timeout);
       }
+      hasWork = false;
+      pthread_mutex_unlock(&hasWorkMutex);
     }
 
-    // handle periodic tasks
-    //
-    time_t this_loop;
-    time(&this_loop);
-    if (!stop && open && this_loop - last_periodic_check > checkPeriod) {
-      store->periodicCheck();
-      last_periodic_check = this_loop;
+  } // while (!stop)
+
+  store->close();
+}
+
+void StoreQueue::runPooled() {
+  pthread_mutex_lock(&hasWorkMutex);
+  hasWork = false;
+  pthread_mutex_unlock(&hasWorkMutex);
+
+  // copy these, this queue may be destroyed as soon as scheduled is reset
+  StoreThreadPool* my_pool = pool;
+
+  if (processWork()) {
+    store->close();
+    my_pool->unregisterQueue(this);
+
+    pthread_mutex_lock(&hasWorkMutex);
+    scheduled = false;
+    stopped = true;
+    pthread_cond_broadcast(&hasWorkCond);
+    pthread_mutex_unlock(&hasWorkMutex);
+    return;
+  }
+  unsigned long long deadline = getNextDeadline();
+
+  // go again right away if more work came in while we were running
+  pthread_mutex_lock(&hasWorkMutex);
+  bool again = hasWork;
+  if (!again) {
+    scheduled = false;
+  }
+  pthread_mutex_unlock(&hasWorkMutex);
+
+  if (again) {
+    my_pool->submit(this);
+  } else {
+    my_pool->scheduleTimer(this, deadline);
+  }
+}
+
+void StoreQueue::wakePooled() {
+  pthread_mutex_lock(&hasWorkMutex);
+  notifyStoreThread();
+  pthread_mutex_unlock(&hasWorkMutex);
+}
+
+// when we need to handle messages or do a periodic check
+unsigned long long StoreQueue::getNextDeadline() {
+  // periodic checks must wait until after this second
+  unsigned long long next_check =
+    (unsigned long long)(lastPeriodicCheck + checkPeriod + 1) * 1000;
+  // the pool's timers can't fire any sooner than one tick, and a deadline
+  // that is already due would just be resubmitted until it is
+  unsigned long write_interval = pool ?
+    max(maxWriteInterval, (unsigned long)STORE_POOL_TIMER_TICK_MS) :
+    maxWriteInterval;
+  return min(next_check, lastHandleMessages + write_interval);
+}
+
+// One pass of the store loop: runs queued commands, the periodic check,
+// and hands queued messages to the store if it's time to.
+bool StoreQueue::processWork() {
+  bool stop = false;
+
+  // handle commands
+  //
+  pthread_mutex_lock(&cmdMutex);
+  while (!cmdQueue.empty()) {
+    StoreCommand cmd = cmdQueue.front();
+    cmdQueue.pop();
+
+    switch (cmd.command) {
+    case CMD_CONFIGURE:
+      configureInline(cmd.configuration);
+      openInline();
+      storeOpened = true;
+      break;
+    case CMD_OPEN:
+      openInline();
+      storeOpened = true;
+      break;
+    case CMD_STOP:
+      stop = true;
+      break;
+    default:
+      LOG_OPER("LOGIC ERROR: unknown command to store queue");
+      break;
     }
+  }
 
-    pthread_mutex_lock(&msgMutex);
-    pthread_mutex_unlock(&cmdMutex);
+  // handle periodic tasks
+  //
+  unsigned long long now_ms = currentTimeMs();
+  time_t this_loop = now_ms / 1000;
+  if (!stop && storeOpened && this_loop - lastPeriodicCheck > checkPeriod) {
+    store->periodicCheck();
+    lastPeriodicCheck = this_loop;
+  }
 
-    boost::shared_ptr<logentry_vector_t> messages;
-
-    // handle messages if stopping, enough time has passed, or queue is large
-    //
-    if (stop ||
-        (this_loop - last_handle_messages > maxWriteInterval) ||
-        msgQueueSize >= targetWriteSize) {
-
-      if (failedMessages) {
-        // process any messages we were not able to process last time
-        messages = failedMessages;
-        failedMessages = boost::shared_ptr<logentry_vector_t>();
-      } else if (msgQueueSize > 0) {
-        // process message in queue
-        messages = msgQueue;
-        msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
-        msgQueueSize = 0;
-      }
+  pthread_mutex_lock(&msgMutex);
+  pthread_mutex_unlock(&cmdMutex);
 
-      // reset timer
-      last_handle_messages = this_loop;
+  drainIngestRing();
+
+  // read spilled messages back once what's in memory is down to half the
+  // budget (this also opens the spill file, to pick up any messages left
+  // in it from before)
+  bool refilled = false;
+  if (spill && !stop && (spill->isActive() || !spill->isOpen())) {
+    unsigned long long room = memoryBudget ? memoryBudget / 2 : batchWriteSize;
+    if (msgQueueSize + failedSize < room) {
+      refilled = refillFromSpill(room - msgQueueSize - failedSize);
     }
+  }
 
-    pthread_mutex_unlock(&msgMutex);
+  boost::shared_ptr<logentry_vector_t> messages;
+  unsigned long long batch_size = 0; // bytes, 0 when retrying failed messages
+  unsigned long long first_queued = 0;
+
+  // handle messages if stopping, enough time has passed, queue is large,
+  // or we're catching up on spilled messages
+  //
+  if (stop || refilled ||
+      (now_ms - lastHandleMessages >= maxWriteInterval) ||
+      msgQueueSize >= batchWriteSize) {
+
+    if (failedMessages) {
+      // process any messages we were not able to process last time
+      messages = failedMessages;
+      failedMessages = boost::shared_ptr<logentry_vector_t>();
+      failedSize = 0;
+    } else if (msgQueueSize > 0) {
+      // process message in queue
+      messages = msgQueue;
+      batch_size = msgQueueSize;
+      msgQueue = newQueue();
+      first_queued = __sync_lock_test_and_set(&firstQueuedUs, 0);
+      msgQueueSize = 0;
+    }
 
-    if (messages) {
-      if (!store->handleMessages(messages)) {
-        // Store could not handle these messages
-        processFailedMessages(messages);
-      }
-      store->flush();
+    // reset timer
+    lastHandleMessages = now_ms;
+  }
+
+  pthread_mutex_unlock(&msgMutex);
+
+  updateOverloaded();
+
+  if (messages) {
+    unsigned long long start = currentTimeUs();
+    if (first_queued && batch_size > 0) {
+      // how long the oldest message in the batch was waiting
+      g_latencyStats.record(dwellStatId,
+                            start > first_queued ? start - first_queued : 0);
     }
 
-    if (!stop) {
-      // set timeout to when we need to handle messages or do a periodic check
-      abs_timeout.tv_sec = min(last_periodic_check + checkPeriod,
-                               last_handle_messages + maxWriteInterval);
+    bool success = store->handleMessages(messages);
+    if (!success) {
+      // Store could not handle these messages
+      processFailedMessages(messages);
+    }
+    g_latencyStats.record(handleStatId, currentTimeUs() - start);
+    store->flush();
 
-      // must wait until after this time
-      abs_timeout.tv_sec++;
+    if (adaptiveBatching && success && batch_size > 0) {
+      adjustBatchSize(batch_size, (currentTimeUs() - start) / 1000);
+    }
 
-      // wait until there's some work to do or we timeout
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-        pthread_cond_timedwait(&hasWorkCond, &hasWorkMutex, &abs_timeout);
-      }
-      hasWork = false;
-      pthread_mutex_unlock(&hasWorkMutex);
+    // keep going until the spill file has been read back
+    if (success && !stop && spill && spill->isActive()) {
+      signalWorkAvailable();
     }
 
-  } // while (!stop)
+    recycleQueue(messages);
+  }
 
-  store->close();
+  if (stop && spill) {
+    drainSpill();
+    spill->close();
+  }
+
+  return stop;
+}
+
+// Empty vector for msgQueue, reusing the last batch's if we have it
+boost::shared_ptr<logentry_vector_t> StoreQueue::newQueue() {
+  boost::shared_ptr<logentry_vector_t> queue;
+  if (spareQueue) {
+    queue.swap(spareQueue);
+  } else {
+    queue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
+  }
+  return queue;
+}
+
+// Keeps a handled batch's vector for newQueue() if no store held on to it.
+// This also releases the entries, and with them their arena slabs.
+void StoreQueue::recycleQueue(
+  boost::shared_ptr<logentry_vector_t>& messages) {
+  if (messages.unique() && messages->capacity() <= MAX_SPARE_QUEUE_CAPACITY) {
+    messages->clear();
+    spareQueue.swap(messages);
+  }
+  messages.reset();
+}
+
+// Picks the size of the next batch from how long the store took to handle
+// and flush the last one. Batches that finish well inside targetLatency
+// grow a little at a time, so under load each write to the store carries
+// more messages, and one that runs over cuts the size in half. Only
+// batches that were sent because they were full can grow: the ones sent
+// on the timer say nothing about what a larger batch would cost.
+void StoreQueue::adjustBatchSize(unsigned long long batch_size,
+                                 unsigned long long elapsed_ms) {
+  unsigned long long new_size = batchWriteSize;
+  if (elapsed_ms > targetLatency) {
+    new_size = max(new_size / 2, minBatchSize);
+  } else if (elapsed_ms * 2 < targetLatency && batch_size >= new_size) {
+    new_size = min(new_size + new_size / 8 + 1, maxBatchSize);
+  }
+
+  if (new_size != batchWriteSize) {
+    batchWriteSize = new_size;
+    setCounter(categoryHandled, "batch size", new_size);
+  }
 }
 
 void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
@@ -335,6 +802,13 @@ void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
   if (mustSucceed) {
     // Save failed messages
     failedMessages = messages;
+    unsigned long long size = 0;
+    for (logentry_vector_t::iterator iter = messages->begin();
+         iter != messages->end();
+         ++iter) {
+      size += (*iter)->message.size();
+    }
+    failedSize = size;
 
     LOG_OPER("[%s] WARNING: Re-queueing %lu messages!",
              categoryHandled.c_str(), messages->size());
@@ -348,24 +822,156 @@ void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
 }
 
 void StoreQueue::storeInitCommon() {
+  dwellStatId = g_latencyStats.getId(categoryHandled + ":queue dwell us");
+  handleStatId = g_latencyStats.getId("store " + store->getType() +
+                                      " handle us");
+
   // model store doesn't need this stuff
   if (!isModel) {
     msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
     pthread_mutex_init(&cmdMutex, NULL);
     pthread_mutex_init(&msgMutex, NULL);
     pthread_mutex_init(&hasWorkMutex, NULL);
-    pthread_cond_init(&hasWorkCond, NULL);
+    // threadMember waits for getNextDeadline(), which is in currentTimeMs()
+    initMonotonicCond(&hasWorkCond);
+
+    if (ingestRingSize > 0) {
+      ingestRing = new MpscRing<logentry_ptr_t>(ingestRingSize);
+    }
+    createSpill();
+
+    lastHandleMessages = currentTimeMs();
+
+    if (g_storeThreadPool.isRunning()) {
+      pool = &g_storeThreadPool;
+      pool->registerQueue(this);
+    } else {
+      pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+    }
+  }
+}
+
+// Spill files are named after the category, so whatever a queue leaves in
+// one is picked up by the next queue for the same category.
+void StoreQueue::createSpill() {
+  if (spill || memoryBudget == 0) {
+    return;
+  }
+  if (spillPath.empty()) {
+    LOG_OPER("[%s] memory_budget needs a spill_path, ignoring it",
+             categoryHandled.c_str());
+    return;
+  }
+  spill = new SpillFile(spillPath + "/" + categoryHandled + ".spill");
+}
 
-    pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+// Sets up the ingest ring. This runs on the caller's thread rather than
+// the store thread because addMessage uses the ring directly, so it must
+// only be called while no messages are being added (i.e. before the queue
+// is published to the handler or while holding its write lock).
+void StoreQueue::configureIngest(pStoreConf configuration) {
+  unsigned long ring_size = 0;
+  configuration->getUnsigned("ingest_ring_size", ring_size);
+
+  // checked by updateOverloaded() on the producer threads
+  configuration->getUnsignedLongLong("max_queue_size", maxQueueSize);
+
+  // and these when messages are added
+  configuration->getUnsignedLongLong("memory_budget", memoryBudget);
+  string spill_path;
+  if (configuration->getString("spill_path", spill_path)) {
+    if (spill && spill_path != spillPath) {
+      LOG_OPER("[%s] New spill_path <%s> won't be used until restart",
+               categoryHandled.c_str(), spill_path.c_str());
+    } else {
+      spillPath = spill_path;
+    }
+  }
+  if (!spill) {
+    // the store thread looks at this while holding msgMutex
+    pthread_mutex_lock(&msgMutex);
+    createSpill();
+    pthread_mutex_unlock(&msgMutex);
+  }
+
+  // and these by the handler before it queues anything
+  configuration->getUnsignedLongLong("max_msg_per_second", maxMsgPerSecond);
+  configuration->getUnsignedLongLong("max_bytes_per_second", maxBytesPerSecond);
+  rateLimiter.configure(maxMsgPerSecond, maxBytesPerSecond);
+
+  // keep an existing ring if it is already big enough
+  if (ingestRing && ring_size > 0 && ingestRing->capacity() >= ring_size) {
+    ingestRingSize = ring_size;
+    return;
+  }
+
+  pthread_mutex_lock(&msgMutex);
+  drainIngestRing(true);
+  if (ingestRing) {
+    delete ingestRing;
+    ingestRing = NULL;
   }
+  ingestRingSize = ring_size;
+  if (ingestRingSize > 0) {
+    ingestRing = new MpscRing<logentry_ptr_t>(ingestRingSize);
+  }
+  pthread_mutex_unlock(&msgMutex);
 }
 
 void StoreQueue::configureInline(pStoreConf configuration) {
   // Constructor defaults are fine if these don't exist
+  if (isModel) {
+    // copies of a model create their own ring from this size
+    configuration->getUnsigned("ingest_ring_size", ingestRingSize);
+    configuration->getUnsignedLongLong("max_queue_size", maxQueueSize);
+    configuration->getUnsignedLongLong("max_msg_per_second", maxMsgPerSecond);
+    configuration->getUnsignedLongLong("max_bytes_per_second",
+                                       maxBytesPerSecond);
+    configuration->getUnsignedLongLong("memory_budget", memoryBudget);
+    configuration->getString("spill_path", spillPath);
+  }
+
   configuration->getUnsignedLongLong("target_write_size", targetWriteSize);
-  configuration->getUnsigned("max_write_interval", (unsigned long&) maxWriteInterval);
+  unsigned long write_interval;
+  if (configuration->getUnsigned("max_write_interval", write_interval)) {
+    // 0 has always meant about once a second, since the store thread used
+    // to wake up at most once a second
+    maxWriteInterval = write_interval ? write_interval * 1000 : 1000;
+  }
+  // overrides max_write_interval, for handling messages more than once a second
+  if (configuration->getUnsigned("max_write_interval_ms", write_interval)) {
+    if (write_interval == 0) {
+      // the store thread would never wait for anything
+      LOG_OPER("[%s] max_write_interval_ms must be at least 1",
+               categoryHandled.c_str());
+      write_interval = 1;
+    }
+    maxWriteInterval = write_interval;
+  }
 
   string tmp;
+  if (configuration->getString("adaptive_batching", tmp)) {
+    adaptiveBatching = (0 == tmp.compare("yes"));
+  }
+  configuration->getUnsigned("target_latency_ms", targetLatency);
+  configuration->getUnsignedLongLong("adaptive_min_batch_size", minBatchSize);
+  configuration->getUnsignedLongLong("adaptive_max_batch_size", maxBatchSize);
+  if (maxBatchSize < minBatchSize) {
+    LOG_OPER("[%s] adaptive_max_batch_size is less than adaptive_min_batch_size, using %llu",
+             categoryHandled.c_str(), minBatchSize);
+    maxBatchSize = minBatchSize;
+  }
+
+  // adaptive batches start from target_write_size
+  unsigned long long batch_size = targetWriteSize;
+  if (adaptiveBatching) {
+    batch_size = min(max(batch_size, minBatchSize), maxBatchSize);
+  }
+  batchWriteSize = batch_size;
+  if (!isModel) {
+    setCounter(categoryHandled, "batch size", batchWriteSize);
+  }
+
   if (configuration->getString("must_succeed", tmp) && tmp == "no") {
     LOG_OPER("[%s] Setting mustSucceed to false.", categoryHandled.c_str());
     mustSucceed = false;
@@ -30,6 +30,11 @@
 
 #include "src/gen-cpp/scribe.h"
 #include "store.h"
+#include "ring_buffer.h"
+#include "rate_limiter.h"
+#include "spill_file.h"
+
+class StoreThreadPool;
 
 /*
  * This class implements a queue and a thread for dispatching
@@ -45,6 +50,7 @@ class StoreQueue {
   virtual ~StoreQueue();
 
   void addMessage(logentry_ptr_t entry);
+  void addMessages(boost::shared_ptr<logentry_vector_t> messages);
   void configureAndOpen(pStoreConf configuration); // closes first if already open
   void open();                                     // closes first if already open
   void stop();
@@ -53,20 +59,59 @@ class StoreQueue {
   std::string getBaseType();
   std::string getCategoryHandled();
   bool isModelStore() { return isModel;}
+  bool isStopping() { return stopping;}
+  // copy of what this queue was last configured with, NULL if never
+  pStoreConf getConfiguration() { return storeConf;}
 
   // this needs to be public for the thread creation to get to it,
   // but no one else should ever call it.
   void threadMember();
 
+  // called by StoreThreadPool when this queue runs on the pool
+  void runPooled();  // one pass of the same loop as threadMember
+  void wakePooled(); // makes sure a pass is coming
+
   // WARNING: don't expect this to be exact, because it could change after you check.
   //          This is only for hueristics to decide when we're overloaded.
   unsigned long long getSize();
 
+  // Number of queues currently holding more than their max queue size.
+  // Kept up to date as messages are added and handled, so checking for
+  // overload doesn't have to look at every queue.
+  static long getNumOverloaded() {return numOverloaded;}
+
+  // Limit for queues that don't set max_queue_size themselves, 0 for none
+  static void setDefaultMaxQueueSize(unsigned long long size);
+
+  // Limits how fast messages for this queue's category are accepted.
+  // Unlimited unless max_msg_per_second or max_bytes_per_second is set.
+  RateLimiter& getRateLimiter() {return rateLimiter;}
+
  private:
   void storeInitCommon();
+  void configureIngest(pStoreConf configuration);
   void configureInline(pStoreConf configuration);
   void openInline();
   void processFailedMessages(boost::shared_ptr<logentry_vector_t> messages);
+  // must hold msgMutex. With wait_for_pushes, also waits for pushes that
+  // have claimed a slot but not published it yet.
+  void drainIngestRing(bool wait_for_pushes = false);
+  void signalWorkAvailable();
+  void notifyStoreThread(); // must hold hasWorkMutex
+  bool processWork(); // returns true once the queue has been stopped
+  unsigned long long getNextDeadline(); // in milliseconds
+  bool isOverLimit();
+  void updateOverloaded();
+  boost::shared_ptr<logentry_vector_t> newQueue(); // store thread only
+  void recycleQueue(boost::shared_ptr<logentry_vector_t>& messages);
+  void markQueued();
+  void createSpill();
+  bool overBudget(unsigned long long size);
+  bool spillMessage(logentry_ptr_t entry);
+  bool refillFromSpill(unsigned long long max_bytes); // must hold msgMutex
+  bool drainSpill();
+  void adjustBatchSize(unsigned long long batch_size,
+                       unsigned long long elapsed_ms);
 
   // implementation of queues and thread
   enum store_command_t {
@@ -92,19 +137,57 @@ class StoreQueue {
   cmd_queue_t cmdQueue;
   boost::shared_ptr<logentry_vector_t> msgQueue;
   boost::shared_ptr<logentry_vector_t> failedMessages;
+  boost::shared_ptr<logentry_vector_t> spareQueue; // for reuse by msgQueue
   unsigned long long msgQueueSize;   // in bytes
   pthread_t storeThread;
 
+  // Optional lock-free staging area in front of msgQueue. Producers push
+  // here without taking msgMutex, and the store thread moves entries
+  // into msgQueue before handling them. NULL if ingest_ring_size is 0.
+  MpscRing<logentry_ptr_t>* ingestRing;
+  volatile unsigned long long ringSize; // bytes currently in ingestRing
+
+  // Where messages go while the queue is over memoryBudget. Messages stay
+  // in order: once anything is spilled, everything after it is spilled
+  // too until the store thread has read it all back. NULL if this queue
+  // has no memory budget.
+  SpillFile* spill;
+  volatile unsigned long long failedSize; // bytes in failedMessages
+
+  // when the oldest unhandled message was queued, in microseconds, or 0
+  volatile unsigned long long firstQueuedUs;
+
+  static volatile long numOverloaded;
+  static volatile unsigned long long defaultMaxQueueSize;
+  volatile int overloaded; // 1 if counted in numOverloaded
+
   // Mutexes
   pthread_mutex_t cmdMutex;     // Must be held to read/modify cmdQueue
   pthread_mutex_t msgMutex;     // Must be held to read/modify msgQueue
   pthread_mutex_t hasWorkMutex; // Must be held to read/modify hasWork
   // If acquiring multiple mutexes, always acquire in this order:
   // {cmdMutex, msgMutex, hasWorkMutex}
+  // Popping from ingestRing also requires msgMutex.
 
   bool hasWork;  // whether there are messages or commands queued
   pthread_cond_t hasWorkCond; // cond variable to wait on for hasWork
 
+  // NULL if this queue has its own thread
+  StoreThreadPool* pool;
+  bool scheduled; // submitted to or running on the pool
+  bool stopped;   // the pool has run the stop command
+  // Both of these are protected by hasWorkMutex
+
+  // state of the store loop, only touched by the thread running it
+  time_t lastPeriodicCheck;
+  unsigned long long lastHandleMessages; // in milliseconds
+  // Size of batch the store loop waits for. The same as targetWriteSize
+  // unless adaptive batching is on. Read by producers without a lock.
+  volatile unsigned long long batchWriteSize;
+  bool storeOpened;
+  unsigned long dwellStatId;  // for g_latencyStats
+  unsigned long handleStatId;
+
   bool stopping;
   bool isModel;
   bool multiCategory; // Whether multiple categories are handled
@@ -113,8 +196,23 @@ class StoreQueue {
   std::string        categoryHandled;  // what category this store is handling
   time_t             checkPeriod;      // how often to call periodicCheck in seconds
   unsigned long long targetWriteSize;  // in bytes
-  time_t             maxWriteInterval; // in seconds
+  unsigned long      maxWriteInterval; // in milliseconds
   bool               mustSucceed;      // Always retry even if secondary fails
+  unsigned long      ingestRingSize;   // in messages, 0 to always lock msgMutex
+  unsigned long long maxQueueSize;     // in bytes, 0 to use the default
+  unsigned long long maxMsgPerSecond;  // 0 for no limit
+  unsigned long long maxBytesPerSecond; // 0 for no limit
+  unsigned long long memoryBudget;     // in bytes, 0 for no spilling
+  std::string        spillPath;        // directory for spill files
+  bool               adaptiveBatching; // size batches by how long they take
+  unsigned long      targetLatency;    // in milliseconds per batch
+  unsigned long long minBatchSize;     // bounds for adaptive batches, bytes
+  unsigned long long maxBatchSize;
+  // Taken before the store sees it, since stores can change theirs.
+  // Only used by the thread configuring the stores.
+  pStoreConf         storeConf;
+
+  RateLimiter rateLimiter;
 
   // Store that will handle messages. This can contain other stores.
   boost::shared_ptr<Store> store;
@@ -0,0 +1,238 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "store_queue.h"
+#include "store_thread_pool.h"
+
+using namespace std;
+
+StoreThreadPool g_storeThreadPool;
+
+// index of the worker running on this thread, -1 for other threads
+static __thread long currentWorker = -1;
+
+struct workerArgs {
+  StoreThreadPool* pool;
+  unsigned long index;
+};
+
+static void* workerStatic(void* arg) {
+  workerArgs* args = (workerArgs*)arg;
+  StoreThreadPool* pool = args->pool;
+  unsigned long index = args->index;
+  delete args;
+
+  currentWorker = index;
+  pool->workerMember(index);
+  return NULL;
+}
+
+static void* timerStatic(void* arg) {
+  ((StoreThreadPool*)arg)->timerMember();
+  return NULL;
+}
+
+StoreThreadPool::StoreThreadPool()
+  : running(false),
+    nextWorker(0),
+    numTasks(0),
+    timers(currentTimeMs(), STORE_POOL_TIMER_TICK_MS),
+    timerSleepUntil(0) {
+  pthread_mutex_init(&idleMutex, NULL);
+  pthread_cond_init(&idleCond, NULL);
+  pthread_mutex_init(&timerMutex, NULL);
+  initMonotonicCond(&timerCond); // deadlines are in currentTimeMs()
+}
+
+// The threads are never stopped, the pool lives as long as the process.
+StoreThreadPool::~StoreThreadPool() {
+}
+
+bool StoreThreadPool::start(unsigned long num_threads) {
+  if (running) {
+    return num_threads == workers.size();
+  }
+  if (num_threads == 0) {
+    return false;
+  }
+
+  LOG_OPER("Starting store thread pool with <%lu> threads", num_threads);
+
+  // create all the deques before any thread can look at them
+  for (unsigned long i = 0; i < num_threads; ++i) {
+    Worker* worker = new Worker;
+    pthread_mutex_init(&worker->mutex, NULL);
+    workers.push_back(worker);
+  }
+  running = true;
+
+  for (unsigned long i = 0; i < num_threads; ++i) {
+    workerArgs* args = new workerArgs;
+    args->pool = this;
+    args->index = i;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workerStatic, (void*)args) != 0) {
+      LOG_OPER("ERROR: failed to start store pool thread");
+      delete args;
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, timerStatic, (void*)this) != 0) {
+    LOG_OPER("ERROR: failed to start store pool timer thread");
+  } else {
+    pthread_detach(thread);
+  }
+  return true;
+}
+
+void StoreThreadPool::registerQueue(StoreQueue* queue) {
+  pthread_mutex_lock(&timerMutex);
+  queues[queue] = 0;
+  pthread_mutex_unlock(&timerMutex);
+}
+
+void StoreThreadPool::unregisterQueue(StoreQueue* queue) {
+  pthread_mutex_lock(&timerMutex);
+  queues.erase(queue);
+  pthread_mutex_unlock(&timerMutex);
+}
+
+void StoreThreadPool::submit(StoreQueue* queue) {
+  unsigned long index;
+  if (currentWorker >= 0) {
+    // keep work that a worker generates on that worker
+    index = currentWorker;
+  } else {
+    index = __sync_fetch_and_add(&nextWorker, 1) % workers.size();
+  }
+
+  Worker* worker = workers[index];
+  pthread_mutex_lock(&worker->mutex);
+  worker->tasks.push_back(queue);
+  pthread_mutex_unlock(&worker->mutex);
+
+  pthread_mutex_lock(&idleMutex);
+  ++numTasks;
+  pthread_cond_signal(&idleCond);
+  pthread_mutex_unlock(&idleMutex);
+}
+
+void StoreThreadPool::scheduleTimer(StoreQueue* queue,
+                                    unsigned long long when_ms) {
+  pthread_mutex_lock(&timerMutex);
+
+  boost::unordered_map<StoreQueue*, unsigned long long>::iterator iter =
+    queues.find(queue);
+  // nothing to do if the queue is gone or will already be woken up sooner
+  if (iter != queues.end() && (iter->second == 0 || when_ms < iter->second)) {
+    iter->second = when_ms;
+    timers.add(when_ms, make_pair(queue, when_ms));
+
+    // wake the timer thread if it's going to sleep past this
+    if (timerSleepUntil == 0 || when_ms < timerSleepUntil) {
+      pthread_cond_signal(&timerCond);
+    }
+  }
+
+  pthread_mutex_unlock(&timerMutex);
+}
+
+// Takes from the front of this worker's deque, or else steals from the back
+// of another worker's.
+bool StoreThreadPool::takeTask(unsigned long index, StoreQueue*& task) {
+  bool found = false;
+  for (unsigned long i = 0; i < workers.size() && !found; ++i) {
+    Worker* worker = workers[(index + i) % workers.size()];
+
+    pthread_mutex_lock(&worker->mutex);
+    if (!worker->tasks.empty()) {
+      if (i == 0) {
+        task = worker->tasks.front();
+        worker->tasks.pop_front();
+      } else {
+        task = worker->tasks.back();
+        worker->tasks.pop_back();
+      }
+      found = true;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+  }
+
+  if (found) {
+    pthread_mutex_lock(&idleMutex);
+    --numTasks;
+    pthread_mutex_unlock(&idleMutex);
+  }
+  return found;
+}
+
+void StoreThreadPool::workerMember(unsigned long index) {
+  while (true) {
+    StoreQueue* task;
+    if (takeTask(index, task)) {
+      task->runPooled();
+      continue;
+    }
+
+    pthread_mutex_lock(&idleMutex);
+    while (numTasks == 0) {
+      pthread_cond_wait(&idleCond, &idleMutex);
+    }
+    pthread_mutex_unlock(&idleMutex);
+  }
+}
+
+void StoreThreadPool::timerMember() {
+  vector<pool_timer_t> expired;
+
+  pthread_mutex_lock(&timerMutex);
+  while (true) {
+    expired.clear();
+    timers.advance(currentTimeMs(), expired);
+
+    for (vector<pool_timer_t>::iterator timer = expired.begin();
+         timer != expired.end();
+         ++timer) {
+      // Skip timers for queues that have gone away, and ones that were
+      // replaced by an earlier timer which has already fired.
+      boost::unordered_map<StoreQueue*, unsigned long long>::iterator iter =
+        queues.find(timer->first);
+      if (iter != queues.end() && iter->second == timer->second) {
+        iter->second = 0;
+        // holding timerMutex keeps the queue from being unregistered
+        timer->first->wakePooled();
+      }
+    }
+
+    unsigned long long deadline;
+    if (!timers.getNextDeadline(deadline)) {
+      timerSleepUntil = 0;
+      pthread_cond_wait(&timerCond, &timerMutex);
+    } else if (deadline > currentTimeMs()) {
+      timerSleepUntil = deadline;
+      struct timespec abs_timeout;
+      abs_timeout.tv_sec = deadline / 1000;
+      abs_timeout.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait(&timerCond, &timerMutex, &abs_timeout);
+    }
+  }
+}
@@ -0,0 +1,107 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_STORE_THREAD_POOL_H
+#define SCRIBE_STORE_THREAD_POOL_H
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <boost/unordered_map.hpp>
+#include "timer_wheel.h"
+
+class StoreQueue;
+
+/*
+ * Fixed set of threads that run StoreQueues, used instead of a thread per
+ * StoreQueue when store_thread_pool=yes.
+ *
+ * A StoreQueue with work to do is submitted as a task and a worker runs one
+ * pass of its loop (commands, periodic check, handling messages). A queue
+ * is never submitted again until its current pass has finished, so each
+ * queue is still handled by one thread at a time, in order.
+ *
+ * Every worker has its own deque of tasks. Tasks submitted from a worker go
+ * on that worker's deque, and an idle worker steals from the back of the
+ * others'. A timer thread resubmits idle queues when their next periodic
+ * check or max_write_interval is due, keeping every queue's deadline in one
+ * timer wheel so idle queues cost nothing until they're due.
+ */
+// resolution of queue deadlines
+#define STORE_POOL_TIMER_TICK_MS 10
+
+class StoreThreadPool {
+ public:
+  StoreThreadPool();
+  ~StoreThreadPool();
+
+  // Starts the workers. The pool can only be started once.
+  bool start(unsigned long num_threads);
+  bool isRunning() {return running;}
+
+  // Queues must be registered before they are submitted and unregistered
+  // before they are destroyed.
+  void registerQueue(StoreQueue* queue);
+  void unregisterQueue(StoreQueue* queue);
+
+  void submit(StoreQueue* queue);
+
+  // Submits queue at when_ms, unless it has been unregistered by then.
+  // Doesn't dereference queue, so it's safe to call after giving it up.
+  void scheduleTimer(StoreQueue* queue, unsigned long long when_ms);
+
+  // these need to be public for the thread creation to get to them,
+  // but no one else should ever call them.
+  void workerMember(unsigned long index);
+  void timerMember();
+
+ private:
+  struct Worker {
+    pthread_mutex_t mutex;          // Must be held to read/modify tasks
+    std::deque<StoreQueue*> tasks;
+  };
+
+  typedef std::pair<StoreQueue*, unsigned long long> pool_timer_t;
+
+  bool takeTask(unsigned long index, StoreQueue*& task);
+
+  bool running;
+  std::vector<Worker*> workers;
+  volatile unsigned long nextWorker; // round robin for outside submitters
+
+  pthread_mutex_t idleMutex;  // Must be held to read/modify numTasks
+  pthread_cond_t idleCond;    // signaled when a task is submitted
+  unsigned long numTasks;     // tasks sitting in any worker's deque
+
+  pthread_mutex_t timerMutex; // Must be held to read/modify timers, queues
+  pthread_cond_t timerCond;
+  TimerWheel<pool_timer_t> timers;
+  unsigned long long timerSleepUntil; // 0 if the timer thread has no timers
+  // registered queues, and the time of the earliest timer each one has
+  // pending (0 for none) so an idle queue doesn't pile up timers
+  boost::unordered_map<StoreQueue*, unsigned long long> queues;
+  // If acquiring multiple mutexes, always acquire in this order:
+  // {timerMutex, StoreQueue::hasWorkMutex, Worker::mutex, idleMutex}
+
+  // disallow copy and assignment
+  StoreThreadPool(const StoreThreadPool& rhs);
+  const StoreThreadPool& operator=(const StoreThreadPool& rhs);
+};
+
+extern StoreThreadPool g_storeThreadPool;
+
+#endif // !defined SCRIBE_STORE_THREAD_POOL_H
@@ -0,0 +1,216 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_TIMER_WHEEL_H
+#define SCRIBE_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+
+// monotonic time in milliseconds, so deadlines don't move when the wall
+// clock is stepped
+inline unsigned long long currentTimeMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Condition variables whose timed waits use currentTimeMs() deadlines
+inline void initMonotonicCond(pthread_cond_t* cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Time is divided into ticks of tickMs milliseconds. Level 0 has a slot per
+ * tick for the next 64 ticks, level 1 a slot per 64 ticks for the next 64^2,
+ * and so on. Adding a timer is O(1), and timers in the higher levels are
+ * moved down a level each time the level below wraps around, so advancing
+ * costs O(1) per elapsed tick plus O(1) per timer. Timers further out than
+ * the top level can reach are kept in its last slot until they fit.
+ *
+ * Not thread safe, callers have to provide their own locking.
+ */
+template <typename T>
+class TimerWheel {
+ public:
+  TimerWheel(unsigned long long now_ms, unsigned long tick_ms)
+    : tickMs(tick_ms ? tick_ms : 1),
+      currentTick(now_ms / tickMs),
+      count(0) {
+  }
+
+  void add(unsigned long long when_ms, const T& value) {
+    Entry entry;
+    // round up, timers never fire early
+    entry.tick = (when_ms + tickMs - 1) / tickMs;
+    entry.value = value;
+    insert(entry);
+    ++count;
+  }
+
+  // Removes every timer due by now_ms and appends its value to expired
+  void advance(unsigned long long now_ms, std::vector<T>& expired) {
+    unsigned long long now_tick = now_ms / tickMs;
+
+    if (count == 0) {
+      if (now_tick >= currentTick) {
+        currentTick = now_tick + 1;
+      }
+      return;
+    }
+
+    while (currentTick <= now_tick) {
+      unsigned long index = currentTick & SLOT_MASK;
+      if (index == 0) {
+        cascade();
+      }
+
+      slot_t& slot = slots[0][index];
+      for (typename slot_t::iterator iter = slot.begin();
+           iter != slot.end();
+           ++iter) {
+        expired.push_back(iter->value);
+      }
+      count -= slot.size();
+      slot.clear();
+
+      ++currentTick;
+      if (count == 0 && now_tick >= currentTick) {
+        currentTick = now_tick + 1;
+      }
+    }
+  }
+
+  // Returns the earliest time advance() has something to do: a timer
+  // expiring, or timers moving down a level. False if there are no timers.
+  bool getNextDeadline(unsigned long long& when_ms) {
+    if (count == 0) {
+      return false;
+    }
+
+    unsigned long long best = 0;
+    bool found = false;
+
+    for (unsigned long k = 0; k < SLOTS; ++k) {
+      unsigned long long tick = currentTick + k;
+      if (!slots[0][tick & SLOT_MASK].empty()) {
+        best = tick;
+        found = true;
+        break;
+      }
+    }
+
+    for (int level = 1; level < LEVELS; ++level) {
+      unsigned long shift = level * SLOT_BITS;
+      unsigned long long base = currentTick >> shift;
+      // the current slot is still due to move down if advance() hasn't
+      // processed its first tick yet
+      unsigned long first = (currentTick & ((1ULL << shift) - 1)) ? 1 : 0;
+      for (unsigned long k = first; k <= SLOTS; ++k) {
+        if (!slots[level][(base + k) & SLOT_MASK].empty()) {
+          unsigned long long tick = (base + k) << shift;
+          if (!found || tick < best) {
+            best = tick;
+            found = true;
+          }
+          break;
+        }
+      }
+    }
+
+    when_ms = best * tickMs;
+    return found;
+  }
+
+  bool empty() {return count == 0;}
+
+ private:
+  enum {
+    LEVELS = 4,
+    SLOT_BITS = 6,
+    SLOTS = 1 << SLOT_BITS,
+    SLOT_MASK = SLOTS - 1
+  };
+
+  struct Entry {
+    unsigned long long tick;
+    T value;
+  };
+  typedef std::vector<Entry> slot_t;
+
+  void insert(const Entry& entry) {
+    unsigned long long tick = entry.tick;
+    if (tick < currentTick) {
+      tick = currentTick;
+    }
+
+    unsigned long long delta = tick - currentTick;
+    int level = 0;
+    while (level < LEVELS - 1 &&
+           delta >= (1ULL << ((level + 1) * SLOT_BITS))) {
+      ++level;
+    }
+
+    unsigned long shift = level * SLOT_BITS;
+    if (level == LEVELS - 1 && delta >= (1ULL << ((level + 1) * SLOT_BITS))) {
+      // too far out, park it in the last slot that the top level reaches
+      tick = currentTick + (1ULL << ((level + 1) * SLOT_BITS)) - 1;
+    }
+    slots[level][(tick >> shift) & SLOT_MASK].push_back(entry);
+  }
+
+  // Moves the timers in the current slot of each level down, for as many
+  // levels as have wrapped around
+  void cascade() {
+    for (int level = 1; level < LEVELS; ++level) {
+      unsigned long shift = level * SLOT_BITS;
+      unsigned long index = (currentTick >> shift) & SLOT_MASK;
+
+      slot_t moving;
+      moving.swap(slots[level][index]);
+      for (typename slot_t::iterator iter = moving.begin();
+           iter != moving.end();
+           ++iter) {
+        insert(*iter);
+      }
+
+      if (index != 0) {
+        break;
+      }
+    }
+  }
+
+  unsigned long tickMs;
+  unsigned long long currentTick; // next tick for advance() to process
+  unsigned long count;
+  slot_t slots[LEVELS][SLOTS];
+
+  // disallow copy, assignment, and empty construction
+  TimerWheel();
+  TimerWheel(const TimerWheel& rhs);
+  TimerWheel& operator=(const TimerWheel& rhs);
+};
+
+#endif // !defined SCRIBE_TIMER_WHEEL_H